@@ -0,0 +1,63 @@
+//
+//  Created by Praveen Murali Nair on 09/07/2013.
+//  Copyright (c) 2013 Praveen M Nair. All rights reserved.
+//
+// 	Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are met:
+//      * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//      * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//      * Neither the name of the <organization> nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//      ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//      WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//      DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+//      DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//      (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//       LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//      ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef zwave_remote_changes_h
+#define zwave_remote_changes_h
+
+#include "defs.h"
+#include "zw_api.h"
+#include "zw_node.h"
+
+/* longest a waitForChanges request is held */
+#define HZR_CHANGES_MAX_WAIT_MS		30000
+
+/*
+ * Requests held at once. Each one ties up an Abyss connection thread, so
+ * past this many a request returns right away and the client is told to
+ * ask again after HZR_CHANGES_BUSY_RETRY_MS, the old polling interval.
+ */
+#define HZR_CHANGES_MAX_WAITERS		8
+#define HZR_CHANGES_BUSY_RETRY_MS	10000
+
+void
+changes_init( zw_api_ctx_S *nets, int networks );
+
+u32
+changes_epoch( void );
+
+u32
+changes_version( void );
+
+u32
+changes_wait( u32 since, int timeout_ms, int *retry_ms );
+
+int
+changes_since( u32 since, int netid, u8 *ids, int *full );
+
+void
+changes_describe_node( const struct zw_node_snapshot *snap, const char **type, const char **state );
+
+#endif
@@ -0,0 +1,46 @@
+//
+//  Created by Praveen Murali Nair on 09/07/2013.
+//  Copyright (c) 2013 Praveen M Nair. All rights reserved.
+//
+// 	Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are met:
+//      * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//      * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//      * Neither the name of the <organization> nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//      ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//      WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//      DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+//      DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//      (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//       LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//      ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef zwave_remote_push_h
+#define zwave_remote_push_h
+
+#include "defs.h"
+#include "zw_api.h"
+
+#define HZR_PUSH_PORT		8081	/* Server-Sent Events, 0 turns it off */
+#define HZR_PUSH_MAX_CLIENTS	32
+#define HZR_PUSH_CLIENT_BUF	16384	/* unsent bytes a client may have; past that it is dropped */
+#define HZR_PUSH_RING		256	/* events kept for the push thread, power of two */
+#define HZR_PUSH_EVENT_MAX	256	/* one formatted event */
+#define HZR_PUSH_PING_MS	15000	/* comment line sent on quiet streams */
+
+int
+push_init( zw_api_ctx_S *nets, int networks, int port );
+
+void
+push_node_changed( int netid, u8 id );
+
+#endif
@@ -30,6 +30,8 @@
 #ifndef zwave_remote_xmlconfig_h
 #define zwave_remote_xmlconfig_h
 
-int xmlconfig_load( const char *filename );
+#include "zw_api.h"
+
+int xmlconfig_load( zw_api_ctx_S *networks, int count, const char *filename );
 
 #endif
@@ -39,8 +39,18 @@
 #include "zw_api.h"
 #include "log.h"
 
+#define HZR_MAX_NETWORKS	8
+
+/* how old a cached node value refreshState and state changes may answer with */
+#define HZR_STATE_MAX_AGE_MS	2000
+
+/*
+ * One zw_api context per controller. Nodes are addressed over XML-RPC as
+ * (NetworkId, NodeId); NetworkId is the order of the --port options.
+ */
 typedef struct _hzremote_ctx {
-	zw_api_ctx_S zw_ctx;
+	zw_api_ctx_S zw_ctx[ HZR_MAX_NETWORKS ];
+	int networks;
 } hzremote_ctx_S;
 
 xmlrpc_value * xmlrpc_get_node_list(
@@ -49,6 +59,12 @@ xmlrpc_value * xmlrpc_get_node_list(
 		void * const serverInfo, 
 		void * const channelInfo);
 
+xmlrpc_value * xmlrpc_wait_for_changes(
+		xmlrpc_env * const envP, 
+		xmlrpc_value * const paramArrayP, 
+		void * const serverInfo, 
+		void * const channelInfo);
+
 xmlrpc_value * xmlrpc_turn_switch_off(
 		xmlrpc_env * const envP, 
 		xmlrpc_value * const paramArrayP, 
@@ -80,4 +96,16 @@ xmlrpc_value * xmlrpc_set_node_label(
 		void * const serverInfo, 
 		void * const channelInfo);
 
+xmlrpc_value * xmlrpc_set_group_state(
+		xmlrpc_env * const envP, 
+		xmlrpc_value * const paramArrayP, 
+		void * const serverInfo, 
+		void * const channelInfo);
+
+xmlrpc_value * xmlrpc_get_stats(
+		xmlrpc_env * const envP, 
+		xmlrpc_value * const paramArrayP, 
+		void * const serverInfo, 
+		void * const channelInfo);
+
 #endif /* _XMLRPC_METHODS_H_ */
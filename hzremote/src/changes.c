@@ -0,0 +1,205 @@
+//
+//  Created by Praveen Murali Nair on 09/07/2013.
+//  Copyright (c) 2013 Praveen M Nair. All rights reserved.
+//
+// 	Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are met:
+//      * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//      * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//      * Neither the name of the <organization> nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//      ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//      WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//      DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+//      DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//      (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//       LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//      ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "changes.h"
+#include "push.h"
+#include "xmlrpc-methods.h"
+#include "zw_node.h"
+#include "zw_time.h"
+#include "log.h"
+
+/*
+ * Change feed behind hzremote.waitForChanges. Every node change on any
+ * network bumps one version and stamps the node with it, so a client
+ * that has seen version v only needs the nodes stamped after v. Version
+ * 0 is never used; a client asking since 0 gets every node.
+ *
+ * Versions restart with the daemon, so they are only compared within one
+ * epoch, an id picked at start up that clients pass back with the
+ * version; a version from another epoch counts as 0.
+ */
+typedef struct _changes {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		/* broadcast on every change */
+	zw_api_ctx_S *nets;
+	u32 epoch;			/* set once by changes_init() */
+	u32 version;
+	u32 node_version[ HZR_MAX_NETWORKS ][ ZW_MAX_NODE_ID + 1 ];
+	int waiters;
+} changes_S;
+
+static changes_S g_changes;
+
+/* Runs in the network's reader thread */
+static void
+changes_node_changed( zw_api_ctx_S *ctx, u8 id, void *arg )
+{
+	int netid = ctx - g_changes.nets;
+
+	pthread_mutex_lock( &g_changes.lock );
+	g_changes.version++;
+	g_changes.node_version[ netid ][ id ] = g_changes.version;
+	pthread_cond_broadcast( &g_changes.cond );
+	pthread_mutex_unlock( &g_changes.lock );
+
+	push_node_changed( netid, id );
+}
+
+/* The NodeType and NodeState the web interface shows for a node */
+void
+changes_describe_node( const struct zw_node_snapshot *snap, const char **type, const char **state )
+{
+	*type = "BASIC";
+	*state = "OFF";
+
+	switch( snap->cclass ) {
+	case COMMAND_CLASS_SWITCH_BINARY:
+		if ( snap->stype == 3 )
+			*type = "PushSwitch";
+		else
+			*type = "Switch";
+		*state = ( snap->state == 0 )?"OFF":"ON";
+		break;
+	case COMMAND_CLASS_SENSOR_BINARY:
+		*type = "DoorSensor";
+		*state = ( snap->state == 0 )?"CLOSE":"OPEN";
+		break;
+	case COMMAND_CLASS_SWITCH_TOGGLE_BINARY:
+		*type = "ToggleSwitch";
+		break;
+	}
+}
+
+void
+changes_init( zw_api_ctx_S *nets, int networks )
+{
+	pthread_condattr_t attr;
+	int netid;
+
+	pthread_mutex_init( &g_changes.lock, NULL );
+	pthread_condattr_init( &attr );
+	pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+	pthread_cond_init( &g_changes.cond, &attr );
+	pthread_condattr_destroy( &attr );
+	g_changes.nets = nets;
+	g_changes.version = 1;
+	/* positive, as it travels as an XML-RPC int */
+	g_changes.epoch = ( (u32)time( NULL ) ^ ( (u32)getpid() << 16 ) ) & 0x7fffffff;
+	if ( !g_changes.epoch ) g_changes.epoch = 1;
+
+	for ( netid = 0; netid < networks; netid++ )
+		zw_node_on_change( &nets[ netid ], changes_node_changed, NULL );
+}
+
+u32
+changes_epoch( void )
+{
+	return g_changes.epoch;
+}
+
+u32
+changes_version( void )
+{
+	u32 version;
+
+	pthread_mutex_lock( &g_changes.lock );
+	version = g_changes.version;
+	pthread_mutex_unlock( &g_changes.lock );
+
+	return version;
+}
+
+/*
+ * Wait up to timeout_ms for the version to move past since and return
+ * the current one. A since the feed never handed out (0, or past the
+ * current version) returns at once, as does any request over
+ * HZR_CHANGES_MAX_WAITERS; that one also gets *retry_ms, how long the
+ * client should wait before asking again, otherwise 0.
+ */
+u32
+changes_wait( u32 since, int timeout_ms, int *retry_ms )
+{
+	struct timespec ts;
+	u32 version;
+	int rc = 0;
+
+	*retry_ms = 0;
+	if ( timeout_ms > HZR_CHANGES_MAX_WAIT_MS ) timeout_ms = HZR_CHANGES_MAX_WAIT_MS;
+	zw_ns_to_timespec( zw_time_ns() + (u64)( 0 < timeout_ms ? timeout_ms : 0 ) * ZW_NSEC_PER_MSEC, &ts );
+
+	pthread_mutex_lock( &g_changes.lock );
+	if ( since == g_changes.version && 0 < timeout_ms ) {
+		if ( g_changes.waiters < HZR_CHANGES_MAX_WAITERS ) {
+			g_changes.waiters++;
+			while ( since == g_changes.version && ETIMEDOUT != rc )
+				rc = pthread_cond_timedwait( &g_changes.cond, &g_changes.lock, &ts );
+			g_changes.waiters--;
+		}
+		else {
+			SYSLOG_DEBUG( "changes_wait: %d waiters, not holding another", g_changes.waiters );
+			*retry_ms = HZR_CHANGES_BUSY_RETRY_MS;
+		}
+	}
+	version = g_changes.version;
+	pthread_mutex_unlock( &g_changes.lock );
+
+	return version;
+}
+
+/*
+ * Ids of the nodes of a network changed after since, removed ones
+ * included. When since isn't a version the feed handed out, every
+ * present node is listed and *full is set. ids must have room for
+ * ZW_MAX_NODE_ID + 1. Returns how many.
+ */
+int
+changes_since( u32 since, int netid, u8 *ids, int *full )
+{
+	struct zw_node *zwnode;
+	int id, count = 0;
+
+	pthread_mutex_lock( &g_changes.lock );
+	*full = !since || since > g_changes.version;
+	if ( !*full ) {
+		for ( id = 1; id <= ZW_MAX_NODE_ID; id++ ) {
+			if ( g_changes.node_version[ netid ][ id ] > since )
+				ids[ count++ ] = id;
+		}
+	}
+	pthread_mutex_unlock( &g_changes.lock );
+
+	if ( *full ) {
+		zw_foreach_node( &g_changes.nets[ netid ], zwnode )
+			ids[ count++ ] = zwnode->id;
+	}
+
+	return count;
+}
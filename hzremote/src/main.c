@@ -28,6 +28,8 @@
 #include <unistd.h>
 #include <string.h>
 #include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
 #include <xmlrpc-c/base.h>
 #include <xmlrpc-c/abyss.h>
 #include <xmlrpc-c/server.h>
@@ -38,6 +40,8 @@
 #include "xmlrpc-utils.h"
 #include "xmlrpc-methods.h"
 #include "xmlconfig.h"
+#include "changes.h"
+#include "push.h"
 #include "zw_node.h"
 
 hzremote_ctx_S hzr_ctx;
@@ -49,6 +53,11 @@ struct xmlrpc_method_info3 const methodInfo[] = {
 	.serverInfo = &hzr_ctx,
 	},
 	{
+	.methodName = "hzremote.waitForChanges",
+	.methodFunction = &xmlrpc_wait_for_changes,
+	.serverInfo = &hzr_ctx,
+	},
+	{
 	.methodName = "hzremote.turnSwitchOff",
 	.methodFunction = &xmlrpc_turn_switch_off,
 	.serverInfo = &hzr_ctx,
@@ -72,21 +81,63 @@ struct xmlrpc_method_info3 const methodInfo[] = {
 	.methodName = "hzremote.setNodeLabel",
 	.methodFunction = &xmlrpc_set_node_label,
 	.serverInfo = &hzr_ctx,
+	},
+	{
+	.methodName = "hzremote.setGroupState",
+	.methodFunction = &xmlrpc_set_group_state,
+	.serverInfo = &hzr_ctx,
+	},
+	{
+	.methodName = "hzremote.getStats",
+	.methodFunction = &xmlrpc_get_stats,
+	.serverInfo = &hzr_ctx,
 	}
 };
 
-static char short_opts[] = "dc:";
+static char short_opts[] = "dc:p:w:P:e:";
 static const struct option long_opts[] = {
         { "daemon",	0,	0,	'd' },
         { "config",	1,	0,	'c' },
+        { "port",	1,	0,	'p' },
+        { "capture",	1,	0,	'w' },
+        { "pool",	1,	0,	'P' },
+        { "push-port",	1,	0,	'e' },
         { NULL, 0, NULL, 0 }
 };
 
 static char *usage_txt =
-"Call: hzremote -d|--daemon [-c|--config <config file>]\n\n";
+"Call: hzremote -d|--daemon [-c|--config <config file>] [-p|--port <uri>]... [-w|--capture <file>]\n"
+"                [-P|--pool <n>] [-e|--push-port <port>]\n"
+"      <uri> is a tty path (tty:///dev/ttyUSB0) or a serial server (tcp://host:port)\n"
+"      repeat --port to serve several networks; they get NetworkId 0, 1, ... in order\n"
+"      and each one is captured to <file>.<NetworkId>\n"
+"      <n> is the number of requests each network can have queued or in flight\n"
+"      <port> serves node changes as Server-Sent Events (default 8081, 0 turns it off)\n\n";
+
+/*
+ * SIGINT and SIGTERM are blocked before any other thread starts and
+ * taken here, so the networks are closed, and their captures finished,
+ * outside of signal context.
+ */
+static void *
+hzr_signal_thread( void *arg )
+{
+	sigset_t *set = (sigset_t *)arg;
+	int sig = 0;
+	int ii;
+
+	if ( sigwait( set, &sig ) ) return NULL;
+
+	SYSLOG_INFO( "Caught signal %d, shutting down", sig );
+	for ( ii = 0; ii < hzr_ctx.networks; ii++ )
+		zw_api_close( &hzr_ctx.zw_ctx[ ii ] );
+	exit( 0 );
+}
 
 int main(int argc, char **argv)
 {
+	static sigset_t sigs;
+	pthread_t sig_thread;
 	xmlrpc_server_abyss_parms serverparm;
 	xmlrpc_registry * registryP;
 	xmlrpc_env env;
@@ -94,6 +145,12 @@ int main(int argc, char **argv)
 	int c;
 	int dmn = 0;
         char *config_file = NULL;
+        char *ports[ HZR_MAX_NETWORKS ];
+        int nports = 0;
+        char *capture = NULL;
+        char capfile[ 256 ];
+        int pool_size = 0;
+        int push_port = HZR_PUSH_PORT;
         
 	while ( ( c = getopt_long( argc, argv, short_opts, long_opts, NULL ) ) != -1 )
         {
@@ -104,6 +161,22 @@ int main(int argc, char **argv)
                         case 'c':
                                 config_file = strdup( optarg );
                                 break;
+                        case 'p':
+                                if ( HZR_MAX_NETWORKS == nports ) {
+                                        fprintf(stderr, "at most %d ports are supported\n", HZR_MAX_NETWORKS);
+                                        exit(1);
+                                }
+                                ports[ nports++ ] = strdup( optarg );
+                                break;
+                        case 'w':
+                                capture = strdup( optarg );
+                                break;
+                        case 'P':
+                                pool_size = atoi( optarg );
+                                break;
+                        case 'e':
+                                push_port = atoi( optarg );
+                                break;
                         case '?':
                         default:
                                 fprintf(stderr, "unknown option\n");
@@ -117,16 +190,46 @@ int main(int argc, char **argv)
                 return 1;
 	}
 
-	if ( zw_api_init( "/dev/ttyUSB0", &hzr_ctx.zw_ctx ) ) {
-		SYSLOG_FAULT("zWave API Init failed");
+	if ( !nports )
+		ports[ nports++ ] = strdup( "/dev/ttyUSB0" );
+
+	sigemptyset( &sigs );
+	sigaddset( &sigs, SIGINT );
+	sigaddset( &sigs, SIGTERM );
+	pthread_sigmask( SIG_BLOCK, &sigs, NULL );
+	if ( pthread_create( &sig_thread, NULL, hzr_signal_thread, &sigs ) ) {
+		SYSLOG_FAULT("Failed to start signal thread");
 		return 1;
 	}
 
+	for ( ii = 0; ii < nports; ii++ ) {
+		struct zw_api_opts opts = { 0 };
+
+		opts.pool_size = 0 < pool_size ? pool_size : 0;
+
+		if ( capture ) {
+			if ( 1 < nports )
+				snprintf( capfile, sizeof( capfile ), "%s.%d", capture, ii );
+			else
+				snprintf( capfile, sizeof( capfile ), "%s", capture );
+			opts.capture = capfile;
+		}
+
+		if ( zw_api_init_opts( ports[ ii ], &hzr_ctx.zw_ctx[ ii ], &opts ) ) {
+			SYSLOG_FAULT("zWave API Init failed for %s", ports[ ii ]);
+			return 1;
+		}
+		hzr_ctx.networks++;
+	}
+	changes_init( hzr_ctx.zw_ctx, hzr_ctx.networks );
+	push_init( hzr_ctx.zw_ctx, hzr_ctx.networks, push_port );
+
         sleep(3);
-        zw_list_nodes();
+	for ( ii = 0; ii < hzr_ctx.networks; ii++ )
+		zw_list_nodes( &hzr_ctx.zw_ctx[ ii ] );
 
         if ( config_file )
-        	xmlconfig_load( config_file );
+        	xmlconfig_load( hzr_ctx.zw_ctx, hzr_ctx.networks, config_file );
         
 	xmlrpc_env_init(&env);
 	dieOnFault("init", &env);
@@ -150,6 +253,9 @@ int main(int argc, char **argv)
 	xmlrpc_server_abyss(&env, &serverparm, XMLRPC_APSIZE(registryP));
 
 	if ( config_file ) free( config_file );
+	for ( ii = 0; ii < nports; ii++ )
+		free( ports[ ii ] );
+	if ( capture ) free( capture );
 	return 0;
 }
 
@@ -0,0 +1,461 @@
+//
+//  Created by Praveen Murali Nair on 09/07/2013.
+//  Copyright (c) 2013 Praveen M Nair. All rights reserved.
+//
+// 	Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are met:
+//      * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//      * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//      * Neither the name of the <organization> nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//      ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//      WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//      DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+//      DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//      (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//       LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//      ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "push.h"
+#include "changes.h"
+#include "zw_node.h"
+#include "log.h"
+
+/*
+ * Server-Sent Events on their own port, for browsers that stay open on
+ * the dashboard. Every node change is formatted once, by whoever made
+ * it, into a ring of events. One push thread copies new events into
+ * each client's send buffer and writes what the socket takes.
+ *
+ * A client whose buffer can't take the next event is dropped, and it
+ * reconnects and resyncs by itself (EventSource does). The thread that
+ * changed the node never waits on a client. Producers only lock
+ * against each other; the push thread reads the ring without a lock,
+ * and if an event is overwritten while it is being copied, every
+ * client still waiting on it is dropped.
+ *
+ * A new stream starts with a reset event, then one node event per node,
+ * then synced; after that come node and remove events as nodes change.
+ */
+
+#define PUSH_TAG_LISTEN		HZR_PUSH_MAX_CLIENTS
+#define PUSH_TAG_EVENT		( HZR_PUSH_MAX_CLIENTS + 1 )
+#define PUSH_REQUEST_MAX	2048
+
+typedef struct _push_client {
+	int fd;			/* -1 when the slot is free */
+	int streaming;		/* the request was read and answered */
+	int syncing;		/* still sending the current nodes */
+	int sync_net;		/* where the sync has got to */
+	int sync_id;
+	u32 next;		/* next ring event to copy */
+	int len;		/* bytes in buf */
+	int off;		/* of which written */
+	u32 events;		/* epoll events asked for */
+	char buf[ HZR_PUSH_CLIENT_BUF ];
+} push_client_S;
+
+typedef struct _push {
+	pthread_mutex_t lock;		/* between producers */
+	u32 head;			/* events published */
+	u16 ring_len[ HZR_PUSH_RING ];
+	char ring[ HZR_PUSH_RING ][ HZR_PUSH_EVENT_MAX ];
+	zw_api_ctx_S *nets;
+	int networks;
+	int running;
+	int listen_fd;
+	int event_fd;
+	int epoll_fd;
+	pthread_t thread;
+	int clients;
+	u64 dropped;
+	push_client_S client[ HZR_PUSH_MAX_CLIENTS ];
+} push_S;
+
+static push_S g_push;
+
+/* JSON string body; names are short, anything odd becomes a space */
+static void
+push_json_escape( char *out, int size, const char *in )
+{
+	int len = 0;
+
+	for ( ; *in && len < size - 2; in++ ) {
+		if ( '"' == *in || '\\' == *in ) {
+			out[ len++ ] = '\\';
+			out[ len++ ] = *in;
+		}
+		else
+			out[ len++ ] = ( (unsigned char)*in < 0x20 ) ? ' ' : *in;
+	}
+	out[ len ] = 0;
+}
+
+/* Returns the length of the event, which always fits HZR_PUSH_EVENT_MAX */
+static int
+push_format_node( char *out, zw_api_ctx_S *zw_ctx, int netid, u8 id )
+{
+	struct zw_node *zwnode = zw_node_find( zw_ctx, id );
+	struct zw_node_snapshot snap;
+	char name[ 2 * MAX_ZW_NODE_NAME ];
+	const char *type, *state;
+	int len;
+
+	if ( !zwnode )
+		return snprintf( out, HZR_PUSH_EVENT_MAX,
+				 "event: remove\ndata: {\"NetworkId\":%d,\"NodeId\":%d}\n\n", netid, id );
+
+	zw_node_snapshot( zwnode, &snap );
+	changes_describe_node( &snap, &type, &state );
+	push_json_escape( name, sizeof( name ), snap.name );
+	len = snprintf( out, HZR_PUSH_EVENT_MAX,
+			"event: node\ndata: {\"NetworkId\":%d,\"NodeId\":%d,\"NodeName\":\"%s\","
+			"\"NodeType\":\"%s\",\"NodeState\":\"%s\",\"NodeBattLevel\":%d}\n\n",
+			netid, snap.id, name, type, state, snap.batt_level );
+
+	return len < HZR_PUSH_EVENT_MAX ? len : HZR_PUSH_EVENT_MAX - 1;
+}
+
+/* Called by changes.c for every node change; never blocks on a client */
+void
+push_node_changed( int netid, u8 id )
+{
+	u64 one = 1;
+	u32 head;
+
+	if ( !__atomic_load_n( &g_push.running, __ATOMIC_ACQUIRE ) ) return;
+
+	pthread_mutex_lock( &g_push.lock );
+	head = g_push.head;
+	g_push.ring_len[ head & ( HZR_PUSH_RING - 1 ) ] =
+		push_format_node( g_push.ring[ head & ( HZR_PUSH_RING - 1 ) ], &g_push.nets[ netid ], netid, id );
+	__atomic_store_n( &g_push.head, head + 1, __ATOMIC_RELEASE );
+	pthread_mutex_unlock( &g_push.lock );
+
+	if ( 0 > write( g_push.event_fd, &one, sizeof( one ) ) && EAGAIN != errno )
+		SYSLOG_WARN( "push: eventfd write failed (%d)", errno );
+}
+
+static void
+push_close( push_client_S *c, const char *why )
+{
+	if ( why ) {
+		SYSLOG_INFO( "push: dropping client %d: %s", c->fd, why );
+		g_push.dropped++;
+	}
+	epoll_ctl( g_push.epoll_fd, EPOLL_CTL_DEL, c->fd, NULL );
+	close( c->fd );
+	c->fd = -1;
+	g_push.clients--;
+}
+
+static int
+push_append( push_client_S *c, const char *data, int len )
+{
+	if ( c->off && c->len + len > HZR_PUSH_CLIENT_BUF ) {
+		memmove( c->buf, c->buf + c->off, c->len - c->off );
+		c->len -= c->off;
+		c->off = 0;
+	}
+	if ( c->len + len > HZR_PUSH_CLIENT_BUF ) return -1;
+
+	memcpy( c->buf + c->len, data, len );
+	c->len += len;
+
+	return 0;
+}
+
+/* Copy the events published since the client's last; -1 if it fell behind */
+static int
+push_copy_events( push_client_S *c )
+{
+	u32 head = __atomic_load_n( &g_push.head, __ATOMIC_ACQUIRE );
+	char event[ HZR_PUSH_EVENT_MAX ];
+	int slot, len;
+
+	for ( ; c->next != head; c->next++ ) {
+		if ( head - c->next >= HZR_PUSH_RING ) return -1;
+		slot = c->next & ( HZR_PUSH_RING - 1 );
+		len = g_push.ring_len[ slot ];
+		if ( len > HZR_PUSH_EVENT_MAX ) len = HZR_PUSH_EVENT_MAX;
+		memcpy( event, g_push.ring[ slot ], len );
+		/* a producer may have reused the slot while we copied it */
+		__atomic_thread_fence( __ATOMIC_ACQUIRE );
+		if ( __atomic_load_n( &g_push.head, __ATOMIC_RELAXED ) - c->next >= HZR_PUSH_RING )
+			return -1;
+		if ( push_append( c, event, len ) ) return -1;
+	}
+
+	return 0;
+}
+
+/* Send the current nodes as far as the buffer has room */
+static void
+push_sync( push_client_S *c )
+{
+	static const char synced[] = "event: synced\ndata: {}\n\n";
+	char event[ HZR_PUSH_EVENT_MAX ];
+	struct zw_node *zwnode;
+	int len;
+
+	while ( c->syncing && HZR_PUSH_CLIENT_BUF - ( c->len - c->off ) >= 2 * HZR_PUSH_EVENT_MAX ) {
+		if ( c->sync_net == g_push.networks ) {
+			push_append( c, synced, sizeof( synced ) - 1 );
+			c->syncing = 0;
+			break;
+		}
+		zwnode = zw_node_next( &g_push.nets[ c->sync_net ], c->sync_id );
+		if ( !zwnode ) {
+			c->sync_net++;
+			c->sync_id = 0;
+			continue;
+		}
+		c->sync_id = zwnode->id;
+		len = push_format_node( event, &g_push.nets[ c->sync_net ], c->sync_net, zwnode->id );
+		push_append( c, event, len );
+	}
+}
+
+/* Write what the socket takes and only ask for EPOLLOUT while data is left */
+static void
+push_flush( push_client_S *c )
+{
+	struct epoll_event ev;
+	ssize_t n;
+
+	while ( c->off < c->len ) {
+		n = send( c->fd, c->buf + c->off, c->len - c->off, MSG_NOSIGNAL | MSG_DONTWAIT );
+		if ( 0 > n ) {
+			if ( EAGAIN == errno || EWOULDBLOCK == errno ) break;
+			push_close( c, NULL );
+			return;
+		}
+		c->off += n;
+	}
+	if ( c->off == c->len ) c->off = c->len = 0;
+
+	ev.events = EPOLLIN | ( c->len || c->syncing ? EPOLLOUT : 0 );
+	ev.data.u32 = c - g_push.client;
+	if ( ev.events != c->events ) {
+		epoll_ctl( g_push.epoll_fd, EPOLL_CTL_MOD, c->fd, &ev );
+		c->events = ev.events;
+	}
+}
+
+static void
+push_accept( void )
+{
+	static const char busy[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+	struct epoll_event ev;
+	push_client_S *c = NULL;
+	int fd, i, one = 1;
+
+	while ( 0 <= ( fd = accept4( g_push.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC ) ) ) {
+		for ( i = 0; i < HZR_PUSH_MAX_CLIENTS; i++ ) {
+			c = &g_push.client[ i ];
+			if ( 0 > c->fd ) break;
+		}
+		if ( HZR_PUSH_MAX_CLIENTS == i ) {
+			SYSLOG_INFO( "push: %d clients, turning one away", g_push.clients );
+			if ( 0 > send( fd, busy, sizeof( busy ) - 1, MSG_NOSIGNAL | MSG_DONTWAIT ) )
+				SYSLOG_DEBUG( "push: 503 not sent (%d)", errno );
+			close( fd );
+			continue;
+		}
+
+		setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+		memset( c, 0, offsetof( push_client_S, buf ) );
+		c->fd = fd;
+		c->events = EPOLLIN;
+		ev.events = c->events;
+		ev.data.u32 = i;
+		if ( epoll_ctl( g_push.epoll_fd, EPOLL_CTL_ADD, fd, &ev ) ) {
+			close( fd );
+			c->fd = -1;
+			continue;
+		}
+		g_push.clients++;
+	}
+}
+
+/*
+ * Read the request; any GET of /events starts a stream. The headers
+ * allow any origin since the page comes from the web server's port.
+ */
+static void
+push_read_request( push_client_S *c )
+{
+	static const char hdr[] = "HTTP/1.1 200 OK\r\n"
+				  "Content-Type: text/event-stream\r\n"
+				  "Cache-Control: no-cache\r\n"
+				  "Access-Control-Allow-Origin: *\r\n"
+				  "Connection: keep-alive\r\n\r\n"
+				  "retry: 3000\n\n"
+				  "event: reset\ndata: {}\n\n";
+	static const char notfound[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+	ssize_t n;
+
+	n = recv( c->fd, c->buf + c->len, PUSH_REQUEST_MAX - 1 - c->len, MSG_DONTWAIT );
+	if ( 0 >= n ) {
+		if ( 0 > n && ( EAGAIN == errno || EWOULDBLOCK == errno ) ) return;
+		push_close( c, NULL );
+		return;
+	}
+	c->len += n;
+	c->buf[ c->len ] = 0;
+	if ( !strstr( c->buf, "\r\n\r\n" ) ) {
+		if ( PUSH_REQUEST_MAX - 1 == c->len ) push_close( c, "request too long" );
+		return;
+	}
+
+	if ( strncmp( c->buf, "GET /events", 11 ) ) {
+		if ( 0 > send( c->fd, notfound, sizeof( notfound ) - 1, MSG_NOSIGNAL | MSG_DONTWAIT ) )
+			SYSLOG_DEBUG( "push: 404 not sent (%d)", errno );
+		push_close( c, NULL );
+		return;
+	}
+
+	c->len = c->off = 0;
+	push_append( c, hdr, sizeof( hdr ) - 1 );
+	c->streaming = 1;
+	c->syncing = 1;
+	c->next = __atomic_load_n( &g_push.head, __ATOMIC_ACQUIRE );
+	SYSLOG_DEBUG( "push: client %d streaming", c->fd );
+}
+
+/* A streaming client has nothing to say; reading tells us it went away */
+static void
+push_read_stream( push_client_S *c )
+{
+	char scratch[ 512 ];
+	ssize_t n;
+
+	while ( 0 < ( n = recv( c->fd, scratch, sizeof( scratch ), MSG_DONTWAIT ) ) )
+		;
+	if ( 0 == n || ( EAGAIN != errno && EWOULDBLOCK != errno ) )
+		push_close( c, NULL );
+}
+
+static void *
+push_thread( void *arg )
+{
+	static const char ping[] = ": ping\n\n";
+	struct epoll_event evs[ 16 ];
+	push_client_S *c;
+	u64 count;
+	int n, i;
+
+	for ( ;; ) {
+		n = epoll_wait( g_push.epoll_fd, evs, 16, HZR_PUSH_PING_MS );
+		if ( 0 > n && EINTR != errno ) {
+			SYSLOG_FAULT( "push: epoll_wait failed (%d)", errno );
+			break;
+		}
+
+		for ( i = 0; i < n; i++ ) {
+			if ( PUSH_TAG_LISTEN == evs[ i ].data.u32 )
+				push_accept();
+			else if ( PUSH_TAG_EVENT == evs[ i ].data.u32 ) {
+				if ( 0 > read( g_push.event_fd, &count, sizeof( count ) ) && EAGAIN != errno )
+					SYSLOG_WARN( "push: eventfd read failed (%d)", errno );
+			}
+			else {
+				c = &g_push.client[ evs[ i ].data.u32 ];
+				if ( 0 > c->fd || !( evs[ i ].events & ( EPOLLIN | EPOLLERR | EPOLLHUP ) ) ) continue;
+				if ( c->streaming ) push_read_stream( c );
+				else push_read_request( c );
+			}
+		}
+
+		for ( i = 0; i < HZR_PUSH_MAX_CLIENTS; i++ ) {
+			c = &g_push.client[ i ];
+			if ( 0 > c->fd || !c->streaming ) continue;
+			if ( !n && push_append( c, ping, sizeof( ping ) - 1 ) ) {
+				push_close( c, "no room for a ping" );
+				continue;
+			}
+			if ( push_copy_events( c ) ) {
+				push_close( c, "too slow" );
+				continue;
+			}
+			push_sync( c );
+			push_flush( c );
+		}
+	}
+
+	return NULL;
+}
+
+/* Listen for event streams on port; 0 leaves push off */
+int
+push_init( zw_api_ctx_S *nets, int networks, int port )
+{
+	struct sockaddr_in addr;
+	struct epoll_event ev;
+	int i, one = 1;
+
+	g_push.listen_fd = g_push.event_fd = g_push.epoll_fd = -1;
+	if ( !port ) return 0;
+
+	pthread_mutex_init( &g_push.lock, NULL );
+	g_push.nets = nets;
+	g_push.networks = networks;
+	for ( i = 0; i < HZR_PUSH_MAX_CLIENTS; i++ )
+		g_push.client[ i ].fd = -1;
+
+	g_push.listen_fd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+	if ( 0 > g_push.listen_fd ) goto fail;
+	setsockopt( g_push.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+	memset( &addr, 0, sizeof( addr ) );
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl( INADDR_ANY );
+	addr.sin_port = htons( port );
+	if ( bind( g_push.listen_fd, (struct sockaddr *)&addr, sizeof( addr ) ) ||
+	     listen( g_push.listen_fd, 16 ) )
+		goto fail;
+
+	g_push.event_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+	g_push.epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+	if ( 0 > g_push.event_fd || 0 > g_push.epoll_fd ) goto fail;
+
+	ev.events = EPOLLIN;
+	ev.data.u32 = PUSH_TAG_LISTEN;
+	if ( epoll_ctl( g_push.epoll_fd, EPOLL_CTL_ADD, g_push.listen_fd, &ev ) ) goto fail;
+	ev.data.u32 = PUSH_TAG_EVENT;
+	if ( epoll_ctl( g_push.epoll_fd, EPOLL_CTL_ADD, g_push.event_fd, &ev ) ) goto fail;
+
+	if ( pthread_create( &g_push.thread, NULL, push_thread, NULL ) ) goto fail;
+	__atomic_store_n( &g_push.running, 1, __ATOMIC_RELEASE );
+	SYSLOG_INFO( "push: serving events on port %d", port );
+
+	return 0;
+fail:
+	SYSLOG_FAULT( "push: cannot serve events on port %d (%d)", port, errno );
+	if ( 0 <= g_push.epoll_fd ) close( g_push.epoll_fd );
+	if ( 0 <= g_push.event_fd ) close( g_push.event_fd );
+	if ( 0 <= g_push.listen_fd ) close( g_push.listen_fd );
+	g_push.listen_fd = g_push.event_fd = g_push.epoll_fd = -1;
+	return -1;
+}
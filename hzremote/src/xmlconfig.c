@@ -67,7 +67,7 @@ xmlconfig_load_timer( xmlTextReaderPtr reader )
 }
 
 static int
-xmlconfig_load_node( xmlTextReaderPtr reader )
+xmlconfig_load_node( zw_api_ctx_S *networks, int count, xmlTextReaderPtr reader )
 {
 	int ret;
 	const xmlChar *name;
@@ -82,13 +82,20 @@ xmlconfig_load_node( xmlTextReaderPtr reader )
 			const xmlChar *id = xmlTextReaderGetAttribute( reader, (const xmlChar*)"id" );
 			const xmlChar *nname = xmlTextReaderGetAttribute( reader, (const xmlChar*)"name" );
 			const xmlChar *type = xmlTextReaderGetAttribute( reader, (const xmlChar*)"type" );
+			const xmlChar *net = xmlTextReaderGetAttribute( reader, (const xmlChar*)"network" );
+			int netid = net ? atoi((const char*)net) : 0;
                         
-			SYSLOG_DEBUG( "xmlconfig_load_node: Name=%s Id=%s Type=%s",
-                                     	nname, id, type );
+			SYSLOG_DEBUG( "xmlconfig_load_node: Name=%s Id=%s Type=%s Network=%d",
+                                     	nname, id, type, netid );
                         
-                        ret = zw_node_set_label( atoi((const char*)id), (char *)nname );
-                        if ( ret )
-                                SYSLOG_DEBUG( "xmlconfig_load_node: set label for node(%d) failed %d", atoi((const char*)id), ret );
+                        if ( netid < 0 || netid >= count ) {
+                                SYSLOG_DEBUG( "xmlconfig_load_node: no network %d for node %s", netid, id );
+                        }
+                        else {
+                                ret = zw_node_set_label( &networks[ netid ], atoi((const char*)id), (char *)nname );
+                                if ( ret )
+                                        SYSLOG_DEBUG( "xmlconfig_load_node: set label for node(%d) failed %d", atoi((const char*)id), ret );
+                        }
 		}
 		if ( (XML_READER_TYPE_END_ELEMENT == xmlTextReaderNodeType( reader )) &&
 			(0 == xmlStrncmp(name, (const xmlChar *)"NodeConfig", 10)))
@@ -99,7 +106,7 @@ xmlconfig_load_node( xmlTextReaderPtr reader )
 	return ret;
 }
 
-int xmlconfig_load( const char *filename )
+int xmlconfig_load( zw_api_ctx_S *networks, int count, const char *filename )
 {
 	int rc = -1;
 	int ret;
@@ -115,7 +122,7 @@ int xmlconfig_load( const char *filename )
                             (XML_READER_TYPE_ELEMENT == xmlTextReaderNodeType( reader )) &&
                             ( 0 == xmlStrncmp( name, (const xmlChar *)"NodeConfig", 10 ) ) )
 			{
-				xmlconfig_load_node( reader );
+				xmlconfig_load_node( networks, count, reader );
 			}
 			else if ( name &&
                             (XML_READER_TYPE_ELEMENT == xmlTextReaderNodeType( reader )) &&
@@ -25,104 +25,314 @@
 //      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 //
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "xmlrpc-methods.h"
 #include "xmlrpc-utils.h"
+#include "changes.h"
 #include "zw_api.h"
 #include "zw_node.h"
+#include "cmd_class.h"
+#include "zw_time.h"
 #include "log.h"
 
+/* An optional int member of the request struct; returns 1 if it was there */
+static int
+xmlrpc_get_param_int( xmlrpc_env * const envP,
+		xmlrpc_value * const paramArrayP,
+		const char *key, int *val )
+{
+	xmlrpc_value *params = NULL;
+	xmlrpc_value *intval = NULL;
+
+	if ( 0 >= xmlrpc_array_size( envP, paramArrayP ) ) return 0;
+
+	xmlrpc_array_read_item( envP, paramArrayP, 0, &params );
+	dieOnFault("read_params", envP);
+	xmlrpc_struct_find_value( envP, params, key, &intval );
+	dieOnFault("find_param", envP);
+	xmlrpc_DECREF( params );
+	if ( !intval ) return 0;
+
+	xmlrpc_read_int( envP, intval, val );
+	dieOnFault("read_param", envP);
+	xmlrpc_DECREF( intval );
+
+	return 1;
+}
+
+/*
+ * Look up the network a request is addressed to. NetworkId is optional
+ * in the request struct; requests without it go to the first network.
+ */
+static zw_api_ctx_S *
+xmlrpc_get_network( xmlrpc_env * const envP,
+		hzremote_ctx_S *ctx,
+		xmlrpc_value * const paramArrayP )
+{
+	xmlrpc_value *params = NULL;
+	xmlrpc_value *netval = NULL;
+	int netid = 0;
+
+	xmlrpc_array_read_item( envP, paramArrayP, 0, &params );
+	dieOnFault("read_params", envP);
+
+	xmlrpc_struct_find_value( envP, params, "NetworkId", &netval );
+	dieOnFault("find_network", envP);
+	if ( netval ) {
+		xmlrpc_read_int( envP, netval, &netid );
+		dieOnFault("read_network", envP);
+		xmlrpc_DECREF( netval );
+	}
+	xmlrpc_DECREF( params );
+
+	if ( netid < 0 || netid >= ctx->networks ) {
+		SYSLOG_INFO( "xmlrpc_get_network: no network %d", netid );
+		return NULL;
+	}
+
+	/* a node request from the UI has someone waiting on it */
+	zw_api_set_thread_prio( ZW_PRIO_INTERACTIVE );
+
+	return &ctx->zw_ctx[ netid ];
+}
+
+/* One node as getNodeList and waitForChanges report it */
+static xmlrpc_value *
+xmlrpc_build_node_item( xmlrpc_env * const envP, int netid, struct zw_node *zwnode )
+{
+	struct zw_node_snapshot snap;
+	xmlrpc_value *node_item = NULL;
+	const char *type;
+	const char *state;
+
+	zw_node_snapshot( zwnode, &snap );
+	changes_describe_node( &snap, &type, &state );
+	node_item = xmlrpc_build_value( envP, "{s:i,s:i,s:s,s:s,s:s,s:i}", "NetworkId", netid,
+						"NodeId", snap.id, 
+						"NodeName", snap.name,
+						"NodeType", type,
+						"NodeState", state,
+						"NodeBattLevel", snap.batt_level );
+	assertValue( node_item );
+
+	return node_item;
+}
+
+/*
+ * The NodeList array of the last getNodeList, for the change version it
+ * was built at. Every field in it is covered by a change notification,
+ * so it is only rebuilt when the version moves; round trip figures are
+ * in getStats instead. The registry method hands its result to xmlrpc-c
+ * to serialize, so the array is shared by reference rather than as
+ * bytes; serving bytes would take an Abyss URI handler of its own in
+ * front of /RPC2. It is never modified once built, and callers only read
+ * it. The lock is held across a rebuild so concurrent callers wait for
+ * that one.
+ */
+static struct {
+	pthread_mutex_t lock;
+	xmlrpc_value *list;
+	u32 version;
+} node_list_cache = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
+
+/* A reference to the current NodeList array, and its version */
+static xmlrpc_value *
+xmlrpc_node_list( xmlrpc_env * const envP, hzremote_ctx_S *ctx, u32 *version )
+{
+	struct zw_node *zwnode;
+	xmlrpc_value *node_arr;
+	u32 current;
+	int netid;
+
+	pthread_mutex_lock( &node_list_cache.lock );
+	current = changes_version();
+	if ( !node_list_cache.list || current != node_list_cache.version ) {
+		node_arr = xmlrpc_array_new( envP );
+		assertValue( node_arr );
+		for ( netid = 0; netid < ctx->networks; netid++ ) {
+			zw_foreach_node( &ctx->zw_ctx[ netid ], zwnode ) {
+				xmlrpc_value *node_item = xmlrpc_build_node_item( envP, netid, zwnode );
+
+				xmlrpc_array_append_item( envP, node_arr, node_item );
+				xmlrpc_DECREF( node_item );
+			}
+		}
+		if ( node_list_cache.list ) xmlrpc_DECREF( node_list_cache.list );
+		node_list_cache.list = node_arr;
+		node_list_cache.version = current;
+		SYSLOG_DEBUG( "xmlrpc_node_list: rebuilt at version %u", current );
+	}
+	node_arr = node_list_cache.list;
+	xmlrpc_INCREF( node_arr );
+	*version = node_list_cache.version;
+	pthread_mutex_unlock( &node_list_cache.lock );
+
+	return node_arr;
+}
+
+/*
+ * Version is the change feed version the list is at least as new as, to
+ * start waitForChanges from, and Epoch the run of the daemon it belongs
+ * to. A caller that passes the Version and Epoch it already has gets
+ * NotModified and no NodeList while nothing changed.
+ */
 xmlrpc_value * xmlrpc_get_node_list(
 		xmlrpc_env * const envP, 
 		xmlrpc_value * const paramArrayP, 
 		void * const serverInfo, 
 		void * const channelInfo) 
 {
-	list_head *zw_nodes = NULL;
-        list_node *node = NULL;
-        struct zw_node *zwnode;
+	hzremote_ctx_S *ctx = (hzremote_ctx_S *)serverInfo;
+	xmlrpc_value *node_arr;
+	int known = 0, epoch = 0;
+	u32 version;
+	xmlrpc_value *result = xmlrpc_struct_new( envP );
+
+	assertValue( result );
+
+	SYSLOG_DEBUG( "xmlrpc_get_node_list" );
+	xmlrpc_get_param_int( envP, paramArrayP, "Version", &known );
+	xmlrpc_get_param_int( envP, paramArrayP, "Epoch", &epoch );
+
+	if ( known && (u32)epoch == changes_epoch() && (u32)known == changes_version() ) {
+		xmlrpc_set_struct_int( envP, result, "NotModified", 1 );
+		version = known;
+	}
+	else {
+		node_arr = xmlrpc_node_list( envP, ctx, &version );
+		xmlrpc_struct_set_value( envP, result, "NodeList", node_arr );
+		xmlrpc_DECREF( node_arr );
+	}
+
+	xmlrpc_set_struct_string( envP, result, "Method", "hzremote.getNodeList" );
+	xmlrpc_set_struct_int( envP, result, "Version", (int)version );
+	xmlrpc_set_struct_int( envP, result, "Epoch", (int)changes_epoch() );
+	xmlrpc_set_struct_int( envP, result, "Result", 0 );
+
+	return result;
+}
+
+/*
+ * Long poll: held until some node changes after SinceVersion, or for
+ * TimeoutMs, then returns the nodes that changed, the ones that went
+ * away and the Version and Epoch to ask from next. Full is set when
+ * NodeList is every node rather than the changes, e.g. for SinceVersion
+ * 0 or an Epoch from before a restart. RetryMs
+ * is set when too many polls are held already and the request wasn't:
+ * the client must wait that long before asking again.
+ */
+xmlrpc_value * xmlrpc_wait_for_changes(
+		xmlrpc_env * const envP, 
+		xmlrpc_value * const paramArrayP, 
+		void * const serverInfo, 
+		void * const channelInfo) 
+{
+	hzremote_ctx_S *ctx = (hzremote_ctx_S *)serverInfo;
+	struct zw_node *zwnode;
+	u8 ids[ ZW_MAX_NODE_ID + 1 ];
+	int since, timeout_ms, retry_ms, epoch = 0;
+	int netid, count, full = 0, i;
+	u32 version;
 	xmlrpc_value *result = xmlrpc_struct_new( envP );
 	xmlrpc_value *node_arr = xmlrpc_array_new( envP );
+	xmlrpc_value *removed_arr = xmlrpc_array_new( envP );
 
 	assertValue( result );
 	assertValue( node_arr );
+	assertValue( removed_arr );
 
-	SYSLOG_DEBUG( "xmlrpc_get_node_list" );
-	zw_nodes = zw_get_node_list();
-
-        list_foreach(node, (zw_nodes)) { 
-		xmlrpc_value *node_item = NULL;
-		const char *type = "BASIC";
-		const char *state = "OFF";
-
-                zwnode = (struct zw_node *)node;
-		switch( zwnode->cclass ) {
-		case COMMAND_CLASS_SWITCH_BINARY:
-                        if ( zwnode->stype == 3 )
-				type = "PushSwitch";
-                        else
-				type = "Switch";
-                        state = ( zwnode->state == 0 )?"OFF":"ON";
-			break;
-		case COMMAND_CLASS_SENSOR_BINARY:
-			type = "DoorSensor";
-			state = ( zwnode->state == 0 )?"CLOSE":"OPEN";
-			break;
-		case COMMAND_CLASS_SWITCH_TOGGLE_BINARY:
-			type = "ToggleSwitch";
-			break;
+	xmlrpc_decompose_value( envP, paramArrayP, "({s:i,s:i,*})", "SinceVersion", &since, "TimeoutMs", &timeout_ms );
+	dieOnFault("decompose_result", envP);
+	xmlrpc_get_param_int( envP, paramArrayP, "Epoch", &epoch );
+	if ( (u32)epoch != changes_epoch() ) since = 0;
+
+	version = changes_wait( (u32)since, timeout_ms, &retry_ms );
+	for ( netid = 0; netid < ctx->networks; netid++ ) {
+		count = changes_since( (u32)since, netid, ids, &full );
+		for ( i = 0; i < count; i++ ) {
+			xmlrpc_value *item;
+
+			zwnode = zw_node_find( &ctx->zw_ctx[ netid ], ids[ i ] );
+			if ( zwnode ) {
+				item = xmlrpc_build_node_item( envP, netid, zwnode );
+				xmlrpc_array_append_item( envP, node_arr, item );
+			}
+			else {
+				item = xmlrpc_build_value( envP, "{s:i,s:i}", "NetworkId", netid, "NodeId", (int)ids[ i ] );
+				assertValue( item );
+				xmlrpc_array_append_item( envP, removed_arr, item );
+			}
+			xmlrpc_DECREF( item );
 		}
-		node_item = xmlrpc_build_value( envP, "{s:i,s:s,s:s,s:s,s:i}", "NodeId", zwnode->id, 
-							"NodeName", zwnode->name,
-							"NodeType", type,
-							"NodeState", state,
-							"NodeBattLevel", zwnode->batt_level );
-		assertValue( node_item );
-
-		xmlrpc_array_append_item( envP, node_arr, node_item );
-		xmlrpc_DECREF( node_item );
-        }
+	}
+	SYSLOG_DEBUG( "xmlrpc_wait_for_changes: %d -> %u", since, version );
 
 	xmlrpc_struct_set_value( envP, result, "NodeList", node_arr );
-	xmlrpc_set_struct_string( envP, result, "Method", "hzremote.getNodeList" );
+	xmlrpc_struct_set_value( envP, result, "RemovedNodes", removed_arr );
+	xmlrpc_set_struct_string( envP, result, "Method", "hzremote.waitForChanges" );
+	xmlrpc_set_struct_int( envP, result, "Version", (int)version );
+	xmlrpc_set_struct_int( envP, result, "Epoch", (int)changes_epoch() );
+	xmlrpc_set_struct_int( envP, result, "Full", full );
+	xmlrpc_set_struct_int( envP, result, "RetryMs", retry_ms );
 	xmlrpc_set_struct_int( envP, result, "Result", 0 );
 
 	xmlrpc_DECREF( node_arr );
+	xmlrpc_DECREF( removed_arr );
 
 	return result;
 }
 
+/*
+ * Once the node acknowledges the set its value is cached, so the check
+ * that follows is normally answered without another radio round trip.
+ * If the set failed, or the cache disagrees, the node itself is asked.
+ */
 static int
-xmlrpc_change_node_state( hzremote_ctx_S *ctx,
+xmlrpc_change_node_state( zw_api_ctx_S *ctx,
                          int nodeid,
                          int state )
 {
-        int res;
+        zw_future_S *set_fut = NULL;
+        zw_future_S *get_fut = NULL;
+        int res = -1;
         int val = state;
+        int max_age = HZR_STATE_MAX_AGE_MS;
         int retries = 5;
         
         do {
-		res = zw_node_set_value( &ctx->zw_ctx, (u8)nodeid, (void *)&val );
-                if ( res ) usleep( 500 );
-        } while ( res && retries-- );
+		set_fut = zw_node_set_value_async( ctx, (u8)nodeid, (void *)&val );
+                if ( !set_fut ) usleep( 500 );
+        } while ( !set_fut && retries-- );
         
-        if ( res ) {
+        if ( !set_fut ) {
                 SYSLOG_INFO( "xmlrpc_change_node_state: failed to set state (%d) for node(%d)", state, nodeid );
                 goto out;
         }
         
+        if ( zw_future_wait( set_fut, CC_GET_TIMEOUT_MS, NULL ) )
+                max_age = 0;
+
         retries = 5;
         do {
-        	res = zw_node_get_value( &ctx->zw_ctx, (u8)nodeid, (void *)&val );
+        	get_fut = zw_node_get_value_async( ctx, (u8)nodeid, max_age );
+		res = get_fut ? zw_future_wait( get_fut, CC_GET_TIMEOUT_MS, &val ) : -1;
+		zw_future_put( get_fut );
                 if ( res ) {
                         SYSLOG_INFO( "xmlrpc_change_node_state: failed to get state for node(%d)", nodeid );
                         usleep( 500 );
                 }
-                if ( val == state ) break;
-        } while ( res && retries-- );
+                else if ( val == state ) break;
+                max_age = 0;
+        } while ( retries-- );
+
+        if ( !res && val != state )
+                res = -1;
 
 out:
+        zw_future_put( set_fut );
         return res;
 }
 
@@ -133,6 +343,7 @@ xmlrpc_value * xmlrpc_turn_switch_off(
 		void * const channelInfo)
 {
 	hzremote_ctx_S *ctx = (hzremote_ctx_S *)serverInfo;
+	zw_api_ctx_S *zw_ctx;
 	int nodeid;
 	int res;
 	xmlrpc_value *result = xmlrpc_struct_new( envP );
@@ -142,7 +353,10 @@ xmlrpc_value * xmlrpc_turn_switch_off(
 
 	SYSLOG_INFO( "xmlrpc_turn_switch_off: id - %d", nodeid );
 
-        res = xmlrpc_change_node_state( ctx, nodeid, ZW_NODE_STATE_OFF );
+	res = -1;
+	zw_ctx = xmlrpc_get_network( envP, ctx, paramArrayP );
+	if ( zw_ctx )
+		res = xmlrpc_change_node_state( zw_ctx, nodeid, ZW_NODE_STATE_OFF );
 
 	xmlrpc_set_struct_string( envP, result, "Method", "hzremote.turnSwitchOff" );
 	xmlrpc_set_struct_int( envP, result, "Result", res );
@@ -157,6 +371,7 @@ xmlrpc_value * xmlrpc_turn_switch_on(
 		void * const channelInfo)
 {
 	hzremote_ctx_S *ctx = (hzremote_ctx_S *)serverInfo;
+	zw_api_ctx_S *zw_ctx;
 	int nodeid;
 	int res;
 	xmlrpc_value *result = xmlrpc_struct_new( envP );
@@ -166,7 +381,10 @@ xmlrpc_value * xmlrpc_turn_switch_on(
 
 	SYSLOG_INFO( "xmlrpc_turn_switch_on: id - %d", nodeid );
 
-        res = xmlrpc_change_node_state( ctx, nodeid, ZW_NODE_STATE_ON );
+	res = -1;
+	zw_ctx = xmlrpc_get_network( envP, ctx, paramArrayP );
+	if ( zw_ctx )
+		res = xmlrpc_change_node_state( zw_ctx, nodeid, ZW_NODE_STATE_ON );
 
 	xmlrpc_set_struct_string( envP, result, "Method", "hzremote.turnSwitchOn" );
 	xmlrpc_set_struct_int( envP, result, "Result", res );
@@ -181,6 +399,7 @@ xmlrpc_value * xmlrpc_toggle_switch_on_off(
 		void * const channelInfo)
 {
 	hzremote_ctx_S *ctx = (hzremote_ctx_S *)serverInfo;
+	zw_api_ctx_S *zw_ctx;
 	int nodeid;
 	int res;
 	xmlrpc_value *result = xmlrpc_struct_new( envP );
@@ -190,14 +409,18 @@ xmlrpc_value * xmlrpc_toggle_switch_on_off(
         
 	SYSLOG_INFO( "xmlrpc_toggle_switch_on_off: id - %d", nodeid );
         
+	res = -1;
+	zw_ctx = xmlrpc_get_network( envP, ctx, paramArrayP );
+	if ( !zw_ctx ) goto out;
+
 	/* Turn the node ON */
-        res = xmlrpc_change_node_state( ctx, nodeid, ZW_NODE_STATE_ON );
+        res = xmlrpc_change_node_state( zw_ctx, nodeid, ZW_NODE_STATE_ON );
         if ( res ) goto out;
 
         usleep(500);
         
         /* Turn the node OFF */
-        res = xmlrpc_change_node_state( ctx, nodeid, ZW_NODE_STATE_OFF );
+        res = xmlrpc_change_node_state( zw_ctx, nodeid, ZW_NODE_STATE_OFF );
 
 out:
 	xmlrpc_set_struct_string( envP, result, "Method", "hzremote.toggleSwitchOnOff" );
@@ -213,17 +436,36 @@ xmlrpc_value * xmlrpc_refresh_state(
 		void * const channelInfo)
 {
 	hzremote_ctx_S *ctx = (hzremote_ctx_S *)serverInfo;
+	zw_api_ctx_S *zw_ctx;
 	int nodeid;
+	int max_age = HZR_STATE_MAX_AGE_MS;
 	int val = ZW_NODE_STATE_ON;
 	int res;
+	xmlrpc_value *params = NULL;
+	xmlrpc_value *ageval = NULL;
 	xmlrpc_value *result = xmlrpc_struct_new( envP );
 
 	xmlrpc_decompose_value( envP, paramArrayP, "({s:i,*})", "NodeId", &nodeid );
 	dieOnFault("decompose_result", envP);
 
-	SYSLOG_INFO( "xmlrpc_refresh_state: id - %d", nodeid );
-
-	res = zw_node_get_value( &ctx->zw_ctx, (u8)nodeid, (void *)&val );
+	/* MaxAgeMs is optional, 0 always asks the node */
+	xmlrpc_array_read_item( envP, paramArrayP, 0, &params );
+	dieOnFault("read_params", envP);
+	xmlrpc_struct_find_value( envP, params, "MaxAgeMs", &ageval );
+	dieOnFault("find_max_age", envP);
+	if ( ageval ) {
+		xmlrpc_read_int( envP, ageval, &max_age );
+		dieOnFault("read_max_age", envP);
+		xmlrpc_DECREF( ageval );
+	}
+	xmlrpc_DECREF( params );
+
+	SYSLOG_INFO( "xmlrpc_refresh_state: id - %d, max age %d ms", nodeid, max_age );
+
+	res = -1;
+	zw_ctx = xmlrpc_get_network( envP, ctx, paramArrayP );
+	if ( zw_ctx )
+		res = zw_node_get_value( zw_ctx, (u8)nodeid, max_age, (void *)&val );
 	
 	xmlrpc_set_struct_string( envP, result, "Method", "hzremote.refreshState" );
 	xmlrpc_set_struct_int( envP, result, "Result", res );
@@ -237,6 +479,8 @@ xmlrpc_value * xmlrpc_set_node_label(
 		void * const serverInfo, 
 		void * const channelInfo)
 {
+	hzremote_ctx_S *ctx = (hzremote_ctx_S *)serverInfo;
+	zw_api_ctx_S *zw_ctx;
 	int nodeid;
 	char *nodename;
 	int res;
@@ -247,7 +491,10 @@ xmlrpc_value * xmlrpc_set_node_label(
 	dieOnFault("decompose_result", envP);
 
 	SYSLOG_INFO( "xmlrpc_set_node_label: id - %d, name - %s", nodeid, nodename );
-	res = zw_node_set_label( nodeid, nodename );
+	res = -1;
+	zw_ctx = xmlrpc_get_network( envP, ctx, paramArrayP );
+	if ( zw_ctx )
+		res = zw_node_set_label( zw_ctx, nodeid, nodename );
 
 	rc = xmlrpc_int_new( envP, res );
 	xmlrpc_struct_set_value( envP, result, "Result", rc );
@@ -256,5 +503,202 @@ xmlrpc_value * xmlrpc_set_node_label(
 	return result;
 }
 
+/*
+ * { State, [NetworkId], [Nodes] }: switch every node in the Nodes array,
+ * or every switch on the network when Nodes is left out, with one group
+ * frame rather than one request per node.
+ */
+xmlrpc_value * xmlrpc_set_group_state(
+		xmlrpc_env * const envP, 
+		xmlrpc_value * const paramArrayP, 
+		void * const serverInfo, 
+		void * const channelInfo)
+{
+	hzremote_ctx_S *ctx = (hzremote_ctx_S *)serverInfo;
+	struct zw_group_result gr;
+	zw_api_ctx_S *zw_ctx;
+	xmlrpc_value *params = NULL;
+	xmlrpc_value *nodes = NULL;
+	xmlrpc_value *item;
+	xmlrpc_value *failed_arr;
+	u8 ids[ MAX_ZWAVE_NODES ];
+	int count = 0;
+	int state, id, i;
+	int res = -1;
+	xmlrpc_value *result = xmlrpc_struct_new( envP );
 
+	memset( &gr, 0, sizeof( gr ) );
+	xmlrpc_decompose_value( envP, paramArrayP, "({s:i,*})", "State", &state );
+	dieOnFault("decompose_result", envP);
+
+	xmlrpc_array_read_item( envP, paramArrayP, 0, &params );
+	dieOnFault("read_params", envP);
+	xmlrpc_struct_find_value( envP, params, "Nodes", &nodes );
+	dieOnFault("find_nodes", envP);
+	xmlrpc_DECREF( params );
+	if ( nodes ) {
+		for ( i = 0; i < xmlrpc_array_size( envP, nodes ) && count < MAX_ZWAVE_NODES; i++ ) {
+			xmlrpc_array_read_item( envP, nodes, i, &item );
+			dieOnFault("read_node", envP);
+			xmlrpc_read_int( envP, item, &id );
+			dieOnFault("read_node_id", envP);
+			xmlrpc_DECREF( item );
+			if ( 0 < id && MAX_ZWAVE_NODES > id ) ids[ count++ ] = id;
+		}
+		xmlrpc_DECREF( nodes );
+	}
+
+	SYSLOG_INFO( "xmlrpc_set_group_state: state - %d, nodes - %d", state, nodes ? count : -1 );
+
+	zw_ctx = xmlrpc_get_network( envP, ctx, paramArrayP );
+	if ( zw_ctx && ( !nodes || count ) )
+		res = zw_node_set_group( zw_ctx, nodes ? ids : NULL, count,
+					 state ? ZW_NODE_STATE_ON : ZW_NODE_STATE_OFF, &gr );
 
+	failed_arr = xmlrpc_array_new( envP );
+	for ( i = 0; i < gr.nfailed; i++ ) {
+		item = xmlrpc_int_new( envP, gr.failed[ i ] );
+		xmlrpc_array_append_item( envP, failed_arr, item );
+		xmlrpc_DECREF( item );
+	}
+
+	xmlrpc_set_struct_string( envP, result, "Method", "hzremote.setGroupState" );
+	xmlrpc_set_struct_int( envP, result, "Result", res );
+	xmlrpc_set_struct_int( envP, result, "Confirmed", gr.confirmed );
+	xmlrpc_set_struct_int( envP, result, "Reported", gr.reported );
+	xmlrpc_set_struct_int( envP, result, "FollowUps", gr.followups );
+	xmlrpc_struct_set_value( envP, result, "Failed", failed_arr );
+	xmlrpc_DECREF( failed_arr );
+
+	return result;
+}
+
+static const char *prio_names[ ZW_PRIO_COUNT ] = {
+	[ ZW_PRIO_INTERACTIVE ]	= "Interactive",
+	[ ZW_PRIO_NORMAL ]	= "Normal",
+	[ ZW_PRIO_BACKGROUND ]	= "Background",
+};
+
+xmlrpc_value * xmlrpc_get_stats(
+		xmlrpc_env * const envP, 
+		xmlrpc_value * const paramArrayP, 
+		void * const serverInfo, 
+		void * const channelInfo)
+{
+	hzremote_ctx_S *ctx = (hzremote_ctx_S *)serverInfo;
+	struct zw_prio_stats st;
+	struct zw_tx_stats tx;
+	struct zw_transport_stats tp;
+	struct zw_cc_stats cc;
+	struct zw_pool_stats msgs, futs;
+	struct zw_node *zwnode;
+	struct zw_rtt rtt;
+	int netid, prio;
+	xmlrpc_value *result = xmlrpc_struct_new( envP );
+	xmlrpc_value *net_arr = xmlrpc_array_new( envP );
+
+	assertValue( result );
+	assertValue( net_arr );
+
+	for ( netid = 0; netid < ctx->networks; netid++ ) {
+		xmlrpc_value *net_item = NULL;
+		xmlrpc_value *queue_arr = xmlrpc_array_new( envP );
+		xmlrpc_value *node_arr = xmlrpc_array_new( envP );
+
+		assertValue( queue_arr );
+		assertValue( node_arr );
+		for ( prio = ZW_PRIO_INTERACTIVE; prio < ZW_PRIO_COUNT; prio++ ) {
+			xmlrpc_value *queue_item = NULL;
+
+			zw_api_get_prio_stats( &ctx->zw_ctx[ netid ], prio, &st );
+			queue_item = xmlrpc_build_value( envP, "{s:s,s:i,s:i,s:i,s:d,s:d}",
+							"Priority", prio_names[ prio ],
+							"Sent", (int)st.sent,
+							"Queued", (int)st.queued,
+							"Aged", (int)st.aged,
+							"AvgWaitMs", st.sent ? (double)st.wait_total_ns / st.sent / ZW_NSEC_PER_MSEC : 0.0,
+							"MaxWaitMs", (double)st.wait_max_ns / ZW_NSEC_PER_MSEC );
+			assertValue( queue_item );
+			xmlrpc_array_append_item( envP, queue_arr, queue_item );
+			xmlrpc_DECREF( queue_item );
+		}
+
+		/* round trips move on every frame, so they stay out of the node list */
+		zw_foreach_node( &ctx->zw_ctx[ netid ], zwnode ) {
+			xmlrpc_value *node_item = NULL;
+
+			zw_api_get_rtt( &ctx->zw_ctx[ netid ], zwnode->id, &rtt );
+			node_item = xmlrpc_build_value( envP, "{s:i,s:d,s:d,s:d,s:i,s:i}",
+							"NodeId", (int)zwnode->id,
+							"RttMs", (double)rtt.srtt_ns / ZW_NSEC_PER_MSEC,
+							"RttVarMs", (double)rtt.rttvar_ns / ZW_NSEC_PER_MSEC,
+							"RtoMs", (double)rtt.rto_ns / ZW_NSEC_PER_MSEC,
+							"Samples", (int)rtt.samples,
+							"Timeouts", (int)rtt.timeouts );
+			assertValue( node_item );
+			xmlrpc_array_append_item( envP, node_arr, node_item );
+			xmlrpc_DECREF( node_item );
+		}
+
+		zw_api_get_tx_stats( &ctx->zw_ctx[ netid ], &tx );
+		zw_api_get_transport_stats( &ctx->zw_ctx[ netid ], &tp );
+		cc_get_stats( &ctx->zw_ctx[ netid ], &cc );
+		zw_api_get_pool_stats( &ctx->zw_ctx[ netid ], &msgs, &futs );
+		net_item = xmlrpc_build_value( envP, "{s:i,s:A,s:A,s:{s:i,s:i,s:i,s:i,s:i,s:i},s:{s:i,s:i,s:i,s:i,s:d},"
+						"s:{s:{s:i,s:i,s:i,s:i,s:i},s:{s:i,s:i,s:i,s:i,s:i}},"
+						"s:{s:d,s:d,s:d,s:i,s:d,s:d,s:d,s:d,s:i}}",
+						"NetworkId", netid,
+						"Queues", queue_arr,
+						"Nodes", node_arr,
+						"Transactions",
+							"Ok", (int)tx.ok,
+							"NoAck", (int)tx.no_ack,
+							"Failed", (int)tx.failed,
+							"CallbackTimeouts", (int)tx.cb_timeouts,
+							"LateCallbacks", (int)tx.late_callbacks,
+							"Batched", (int)tx.batched,
+						"Gets",
+							"Sent", (int)cc.gets,
+							"Coalesced", (int)cc.coalesced,
+							"CacheHits", (int)cc.cache_hits,
+							"CacheMisses", (int)cc.cache_misses,
+							"CacheHitRatio", cc.cache_hits + cc.cache_misses ?
+								(double)cc.cache_hits / ( cc.cache_hits + cc.cache_misses ) : 0.0,
+						"Pool",
+							"Messages",
+								"Capacity", (int)msgs.capacity,
+								"InUse", (int)msgs.in_use,
+								"HighWater", (int)msgs.high_water,
+								"Allocs", (int)msgs.allocs,
+								"Exhausted", (int)msgs.exhausted,
+							"Futures",
+								"Capacity", (int)futs.capacity,
+								"InUse", (int)futs.in_use,
+								"HighWater", (int)futs.high_water,
+								"Allocs", (int)futs.allocs,
+								"Exhausted", (int)futs.exhausted,
+						"Transport",
+							"RttLastMs", (double)tp.rtt_last_ns / ZW_NSEC_PER_MSEC,
+							"RttAvgMs", (double)tp.rtt_avg_ns / ZW_NSEC_PER_MSEC,
+							"RttMaxMs", (double)tp.rtt_max_ns / ZW_NSEC_PER_MSEC,
+							"RttSamples", (int)tp.rtt_samples,
+							"RxBytes", (double)tp.rx_bytes,
+							"TxBytes", (double)tp.tx_bytes,
+							"RxReads", (double)tp.rx_reads,
+							"TxWrites", (double)tp.tx_writes,
+							"Reconnects", (int)tp.reconnects );
+		assertValue( net_item );
+		xmlrpc_array_append_item( envP, net_arr, net_item );
+		xmlrpc_DECREF( net_item );
+		xmlrpc_DECREF( queue_arr );
+		xmlrpc_DECREF( node_arr );
+	}
+
+	xmlrpc_struct_set_value( envP, result, "Networks", net_arr );
+	xmlrpc_set_struct_string( envP, result, "Method", "hzremote.getStats" );
+	xmlrpc_set_struct_int( envP, result, "Result", 0 );
+
+	xmlrpc_DECREF( net_arr );
+
+	return result;
+}
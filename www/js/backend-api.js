@@ -1,18 +1,44 @@
 
 var intervalId = 0;
 
-var nodeList = new Array();
+var nodeList = new Object();
 var xmlserver = "http://" + location.host + "/RPC2";
 //var xmlserver = "http://192.168.1.7/RPC2";
 
+// Change feed: hzremote.waitForChanges is held by the server until a node
+// changes, so the page follows changes as they happen instead of fetching
+// the whole list every few seconds.
+var feedVersion = 0;
+var feedEpoch = 0;
+var feedGen = 0;
+var feedActive = false;
+var feedRetryMs = 10000;
+var feedWaitMs = 25000;
+
+// Push: hzremote streams the same changes as Server-Sent Events on its own
+// port; browsers that have EventSource use that and skip the long poll.
+var pushPort = 8081;
+var pushSource = null;
+var pushSynced = false;
+
 function clearRefresh(interval) {
+    feedActive = false;
+    feedGen++;
+    StopPush();
     if (intervalId > 0) {
-        clearInterval(intervalId);
+        clearTimeout(intervalId);
+        intervalId = 0;
     }
 }
+// interval is how long to wait before asking again after an error
 function setupRefresh(interval) {
     clearRefresh();
-    intervalId = setInterval("GetNodeList()", interval);
+    feedRetryMs = interval;
+    feedActive = true;
+    if ( window.EventSource )
+        StartPush();
+    else
+        WaitForChanges();
 }
 
 function RefreshAllNodes() {
@@ -33,98 +59,137 @@ function final() {
     //alert('final');
 }
 
+// Nodes are kept by NetworkId and NodeId so changes replace them in place
+function MergeNodes(nodes) {
+    for( var i in nodes )
+        nodeList[(nodes[i]["NetworkId"] || 0) + "_" + nodes[i]["NodeId"]] = nodes[i];
+}
+
+function RenderNodeList() {
+    var nodeStr = "<table width='100%' class='nodeList' cellpadding=0 cellspacing=0 border=0 >";
+    var nodeSetupStr = "<table width='100%' class='nodeList' cellpadding=0 cellspacing=0 border=0 >";
+    for( var i in nodeList ) {
+        var net = nodeList[i]["NetworkId"] || 0;
+        //alert(nodes[i]["NodeType"]);
+        if ( nodeList[i]["NodeType"] != "BASIC" ) {
+            nodeSetupStr += "<tr><td class='nodeName'>";
+            nodeStr += "<tr><td class='nodeName'>";
+            if ( nodeList[i]["NodeName"] != "" ) {
+                nodeSetupStr += "<input type='text' class='form-control' id='node" + net + "_" +
+                nodeList[i]["NodeId"] + "' name='Name' value='" + 
+                nodeList[i]["NodeName"] + "' id='Name'>";
+                nodeStr += "<h4>" + nodeList[i]["NodeName"] + "</h4></td>";
+            }
+            else {
+                nodeSetupStr += "<input type='text' class='form-control' id='node" + net + "_" +
+                nodeList[i]["NodeId"] +
+                "' name='Name' value='Node: " + nodeList[i]["NodeId"] + ", " +
+                nodeList[i]["NodeType"] + "' id='Name'>";
+                nodeStr += "<h4>Node: " + nodeList[i]["NodeId"] + ", " + nodeList[i]["NodeType"] + "</h4></td>";
+            }
+        
+            nodeSetupStr += "<td class='nodeControl'><button type='button' class='btn btn-success' onclick='SetNodeName(" + 
+                            net + "," + nodeList[i]["NodeId"] + ")'>Update</button></td></tr>";
+            
+            nodeStr += "<td class='nodeControl'>";
+            if (nodeList[i]["NodeType"] == "Switch") {
+                if (nodeList[i]["NodeState"] == "OFF") {
+                    var switchName = "switchNode" + net + "_" + nodeList[i]["NodeId"];
+                    nodeStr += "<div class='onoffswitch'><input type='checkbox' name=" + switchName +
+                    " class='onoffswitch-checkbox' id=" + switchName + 
+                    " onclick='TurnSwitchOn(" + net + "," + nodeList[i]["NodeId"] + ")'>" +
+                    " <label class='onoffswitch-label' for=" + switchName + "> \
+                    <div class='onoffswitch-inner'></div> \
+                    <div class='onoffswitch-switch'></div> \
+                    </label></div>";
+                }
+                else if ( nodeList[i]["NodeState"] == "ON" ) {
+                    var switchName = "switchNode" + net + "_" + nodeList[i]["NodeId"];
+                    nodeStr += "<div class='onoffswitch'><input type='checkbox' name=" + switchName +
+                    " class='onoffswitch-checkbox' id=" + switchName + 
+                    " onclick='TurnSwitchOff(" + net + "," + nodeList[i]["NodeId"] + ")' checked>" +
+                    " <label class='onoffswitch-label' for=" + switchName + "> \
+                    <div class='onoffswitch-inner'></div> \
+                    <div class='onoffswitch-switch'></div> \
+                    </label></div>";
+                }
+            }
+            else if (nodeList[i]["NodeType"] == "PushSwitch") {
+                if (nodeList[i]["NodeState"] == "OFF") {
+                    nodeStr += "<div class='button'><button class='pushbtn'" +
+                    " onclick='ToggleSwitchOnOff(" + net + "," + nodeList[i]["NodeId"] + ")'/></div>";
+                }
+                else if ( nodeList[i]["NodeState"] == "ON" ) {
+                    var switchName = "switchNode" + net + "_" + nodeList[i]["NodeId"];
+                    nodeStr += "<div class='onoffswitch'><input type='checkbox' name=" + switchName +
+                    " class='onoffswitch-checkbox' id=" + switchName + 
+                    " onclick='TurnSwitchOff(" + net + "," + nodeList[i]["NodeId"] + ")' checked>" +
+                    " <label class='onoffswitch-label' for=" + switchName + "> \
+                    <div class='onoffswitch-inner'></div> \
+                    <div class='onoffswitch-switch'></div> \
+                    </label></div>";
+                }
+            }
+            else if (nodeList[i]["NodeType"] == "DoorSensor") {
+                if (nodeList[i]["NodeState"] == "CLOSE")
+                    nodeStr += "<h4>Closed</h4>";//"<img align='center' src='images/door.png'>";
+                else if (nodeList[i]["NodeState"] == "OPEN")
+                    nodeStr += "<h4>Open</h4>";//"<img src='images/door_open.png'>";
+            }
+            nodeStr += "</td>";
+        }
+    }	
+    nodeStr += "</table>";
+    nodeSetupStr += "</table>";
+    $('#tab-remote').html(nodeStr);
+    $('#tab-setup').html(nodeSetupStr);
+}
+
 function callback(ret) {
     var method = ret['Method'];
     switch( method ) {
         case "hzremote.getNodeList":
-            var nodes = ret['NodeList'];
-            var nodeStr = "<table width='100%' class='nodeList' cellpadding=0 cellspacing=0 border=0 >";
-            var nodeSetupStr = "<table width='100%' class='nodeList' cellpadding=0 cellspacing=0 border=0 >";
-            for( var i in nodes ) {
-                nodeList[i] = nodes[i];
-                //alert(nodes[i]["NodeType"]);
-                if ( nodeList[i]["NodeType"] != "BASIC" ) {
-                    nodeSetupStr += "<tr><td class='nodeName'>";
-                    nodeStr += "<tr><td class='nodeName'>";
-                    if ( nodeList[i]["NodeName"] != "" ) {
-                        nodeSetupStr += "<input type='text' class='form-control' id='" + 
-                        nodeList[i]["NodeId"] + "' name='Name' value='" + 
-                        nodeList[i]["NodeName"] + "' id='Name'>";
-                        nodeStr += "<h4>" + nodeList[i]["NodeName"] + "</h4></td>";
-                    }
-                    else {
-                        nodeSetupStr += "<input type='text' class='form-control' id='" + 
-                        nodeList[i]["NodeId"] +
-                        "' name='Name' value='Node: " + nodeList[i]["NodeId"] + ", " +
-                        nodeList[i]["NodeType"] + "' id='Name'>";
-                        nodeStr += "<h4>Node: " + nodeList[i]["NodeId"] + ", " + nodeList[i]["NodeType"] + "</h4></td>";
-                    }
-                
-                    nodeSetupStr += "<td class='nodeControl'><button type='button' class='btn btn-success' onclick='SetNodeName(" + 
-                                    nodeList[i]["NodeId"] + ")'>Update</button></td></tr>";
-                    
-                    nodeStr += "<td class='nodeControl'>";
-                    if (nodeList[i]["NodeType"] == "Switch") {
-                        if (nodeList[i]["NodeState"] == "OFF") {
-                            var switchName = "switchNode" + nodeList[i]["NodeId"];
-                            nodeStr += "<div class='onoffswitch'><input type='checkbox' name=" + switchName +
-                            " class='onoffswitch-checkbox' id=" + switchName + 
-                            " onclick='TurnSwitchOn(" + nodeList[i]["NodeId"] + ")'>" +
-                            " <label class='onoffswitch-label' for=" + switchName + "> \
-                            <div class='onoffswitch-inner'></div> \
-                            <div class='onoffswitch-switch'></div> \
-                            </label></div>";
-                        }
-                        else if ( nodeList[i]["NodeState"] == "ON" ) {
-                            var switchName = "switchNode" + nodeList[i]["NodeId"];
-                            nodeStr += "<div class='onoffswitch'><input type='checkbox' name=" + switchName +
-                            " class='onoffswitch-checkbox' id=" + switchName + 
-                            " onclick='TurnSwitchOff(" + nodeList[i]["NodeId"] + ")' checked>" +
-                            " <label class='onoffswitch-label' for=" + switchName + "> \
-                            <div class='onoffswitch-inner'></div> \
-                            <div class='onoffswitch-switch'></div> \
-                            </label></div>";
-                        }
-                    }
-                    else if (nodeList[i]["NodeType"] == "PushSwitch") {
-                        if (nodeList[i]["NodeState"] == "OFF") {
-                            nodeStr += "<div class='button'><button class='pushbtn'" +
-                            " onclick='ToggleSwitchOnOff(" + nodeList[i]["NodeId"] + ")'/></div>";
-                        }
-                        else if ( nodeList[i]["NodeState"] == "ON" ) {
-                            var switchName = "switchNode" + nodeList[i]["NodeId"];
-                            nodeStr += "<div class='onoffswitch'><input type='checkbox' name=" + switchName +
-                            " class='onoffswitch-checkbox' id=" + switchName + 
-                            " onclick='TurnSwitchOff(" + nodeList[i]["NodeId"] + ")' checked>" +
-                            " <label class='onoffswitch-label' for=" + switchName + "> \
-                            <div class='onoffswitch-inner'></div> \
-                            <div class='onoffswitch-switch'></div> \
-                            </label></div>";
-                        }
-                    }
-                    else if (nodeList[i]["NodeType"] == "DoorSensor") {
-                        if (nodeList[i]["NodeState"] == "CLOSE")
-                            nodeStr += "<h4>Closed</h4>";//"<img align='center' src='images/door.png'>";
-                        else if (nodeList[i]["NodeState"] == "OPEN")
-                            nodeStr += "<h4>Open</h4>";//"<img src='images/door_open.png'>";
-                    }
-                    nodeStr += "</td>";
-                }
-            }	
-            nodeStr += "</table>";
-            nodeSetupStr += "</table>";
-            $('#tab-remote').html(nodeStr);
-            $('#tab-setup').html(nodeSetupStr);
+            // the list we have is still current
+            if ( ret['NotModified'] )
+                break;
+            nodeList = new Object();
+            MergeNodes(ret['NodeList']);
+            // a new epoch means the daemon restarted and the versions did too
+            if ( ret['Epoch'] != feedEpoch || ret['Version'] > feedVersion ) {
+                feedVersion = ret['Version'];
+                feedEpoch = ret['Epoch'];
+            }
+            RenderNodeList();
+            break;
+        case "hzremote.waitForChanges":
+            if ( ret['Full'] )
+                nodeList = new Object();
+            MergeNodes(ret['NodeList']);
+            var removed = ret['RemovedNodes'];
+            for( var i in removed )
+                delete nodeList[removed[i]["NetworkId"] + "_" + removed[i]["NodeId"]];
+            feedVersion = ret['Version'];
+            feedEpoch = ret['Epoch'];
+            if ( ret['NodeList'].length || removed.length )
+                RenderNodeList();
             break;
         case "hzremote.turnSwitchOff":
             if ( ret['Result'] != 0 )
                 alert( "Switch Off failed!!!" );
-            GetNodeList();
+            if ( ret['Result'] != 0 || !feedActive )
+                GetNodeList();
             break;
         case "hzremote.turnSwitchOn":
             if ( ret['Result'] != 0 )
                 alert( "Switch On failed!!!" );
-            GetNodeList();
+            if ( ret['Result'] != 0 || !feedActive )
+                GetNodeList();
+            break;
+        case "hzremote.setGroupState":
+            if ( ret['Result'] != 0 )
+                alert( "Switching " + ret['Failed'].length + " node(s) failed!!!" );
+            if ( ret['Result'] != 0 || !feedActive )
+                GetNodeList();
             break;
         case "hzremote.refreshState":
             break;
@@ -137,44 +202,123 @@ function callback(ret) {
 //Get the list of known nodes
 function GetNodeList() {
     var params = new Array();
+    if ( feedVersion )
+        params[0] = {'Version': feedVersion, 'Epoch': feedEpoch};
     xmlrpc( xmlserver, "hzremote.getNodeList", params, callback, err, final );
 }
 
+//Wait for nodes to change and ask again; after an error fall back to a full list
+function WaitForChanges() {
+    var gen = feedGen;
+    var started = new Date().getTime();
+    var params = new Array();
+    params[0] = {'SinceVersion': feedVersion, 'Epoch': feedEpoch, 'TimeoutMs': feedWaitMs};
+    xmlrpc( xmlserver, "hzremote.waitForChanges", params,
+            function(ret) {
+                if ( gen != feedGen ) return;
+                callback(ret);
+                // the server wasn't holding polls, or came back early with nothing: don't spin
+                var delay = ret['RetryMs'] || 0;
+                if ( !delay && !ret['Full'] && !ret['NodeList'].length && !ret['RemovedNodes'].length &&
+                     new Date().getTime() - started < feedWaitMs / 2 )
+                    delay = feedRetryMs;
+                if ( delay )
+                    intervalId = setTimeout("WaitForChanges()", delay);
+                else
+                    WaitForChanges();
+            },
+            function(e) {
+                if ( gen != feedGen ) return;
+                feedVersion = 0;
+                intervalId = setTimeout("WaitForChanges()", feedRetryMs);
+            }, final );
+}
+
+function StopPush() {
+    if ( pushSource != null ) {
+        pushSource.close();
+        pushSource = null;
+    }
+}
+
+//Follow node changes pushed by the daemon; fall back to the long poll if no stream comes up
+function StartPush() {
+    var gen = feedGen;
+    pushSynced = false;
+    pushSource = new EventSource("http://" + location.hostname + ":" + pushPort + "/events");
+    // every (re)connect starts with reset, then all nodes, then synced
+    pushSource.addEventListener("reset", function(e) {
+        pushSynced = false;
+        nodeList = new Object();
+    }, false);
+    pushSource.addEventListener("node", function(e) {
+        MergeNodes([ JSON.parse(e.data) ]);
+        if ( pushSynced )
+            RenderNodeList();
+    }, false);
+    pushSource.addEventListener("remove", function(e) {
+        var node = JSON.parse(e.data);
+        delete nodeList[node["NetworkId"] + "_" + node["NodeId"]];
+        if ( pushSynced )
+            RenderNodeList();
+    }, false);
+    pushSource.addEventListener("synced", function(e) {
+        pushSynced = true;
+        RenderNodeList();
+    }, false);
+    intervalId = setTimeout(function() {
+        if ( gen != feedGen || pushSynced )
+            return;
+        StopPush();
+        WaitForChanges();
+    }, feedRetryMs);
+}
+
 //SetNodeName
-function SetNodeName(node) {
-    var param_node  = {'NodeId': node, 'NodeLabel' : document.getElementById(node).value };
+function SetNodeName(net, node) {
+    var param_node  = {'NetworkId': net, 'NodeId': node, 'NodeLabel' : document.getElementById("node" + net + "_" + node).value };
     var params = new Array();
     params[0] = param_node;
     xmlrpc( xmlserver, "hzremote.setNodeLabel", params, callback, err, final );
 }
 
 //Turn SWitch OFF
-function TurnSwitchOff(node) {
-    var param_nodeid  = {'NodeId': node};
+function TurnSwitchOff(net, node) {
+    var param_nodeid  = {'NetworkId': net, 'NodeId': node};
     var params = new Array();
     params[0] = param_nodeid;
     xmlrpc( xmlserver, "hzremote.turnSwitchOff", params, callback, err, final );
 }
 
 //Turn SWitch ON
-function TurnSwitchOn(node) {
-    var param_nodeid  = {'NodeId': node};
+function TurnSwitchOn(net, node) {
+    var param_nodeid  = {'NetworkId': net, 'NodeId': node};
     var params = new Array();
     params[0] = param_nodeid;
     xmlrpc( xmlserver, "hzremote.turnSwitchOn", params, callback, err, final );
 }
 
+//Switch several nodes at once; all switches when nodes is null
+function SetGroupState(net, nodes, state) {
+    var param_group  = {'NetworkId': net, 'State': state};
+    var params = new Array();
+    if ( nodes != null )
+        param_group['Nodes'] = nodes;
+    params[0] = param_group;
+    xmlrpc( xmlserver, "hzremote.setGroupState", params, callback, err, final );
+}
+
 //Toggle Switch ON and then back OFF
-function ToggleSwitchOnOff(node) {
-    var param_nodeid  = {'NodeId': node};
+function ToggleSwitchOnOff(net, node) {
+    var param_nodeid  = {'NetworkId': net, 'NodeId': node};
     var params = new Array();
     params[0] = param_nodeid;
     xmlrpc( xmlserver, "hzremote.toggleSwitchOnOff", params, callback, err, final );
 }
 
 //Refresh Node State
-function RefreshNodeState(node) {
-    var param_nodeid  = {'NodeId': node};
+function RefreshNodeState(net, node) {
+    var param_nodeid  = {'NetworkId': net, 'NodeId': node};
     var params = new Array();
     params[0] = param_nodeid;
     xmlrpc( xmlserver, "hzremote.refreshState", params, callback, err, final );
@@ -33,16 +33,30 @@
 #include "zw_api.h"
 #include "genlist.h"
 
+/* how long the blocking cc_get() waits for the node's report */
+#define CC_GET_TIMEOUT_MS	5000
+
+/* nodes addressed by one SEND_DATA_MULTI frame */
+#define CC_MULTICAST_MAX	64
+
+/*
+ * get_async/set_async queue the request and return a future that the
+ * class completes from process_msg() with zw_api_report(). A get for a
+ * report that is already awaited joins that request instead. The blocking
+ * get/set are only used by classes that don't provide them.
+ */
 struct cmd_class {
-	list_node list;
 	const char* name;
 	unsigned char type;
+	unsigned char report_cmd;	/* the report get_async waits for */
   
 	int (*process_msg)( zw_api_ctx_S *ctx, const u8* frame, u8 nodeid );
 	int (*version)( zw_api_ctx_S *ctx, u8 nodeid, void *resp );
 	int (*get)( zw_api_ctx_S *ctx, u8 nodeid, void *resp );
 	int (*set)( zw_api_ctx_S *ctx, u8 nodeid, void *resp );
 	int (*report)( zw_api_ctx_S *ctx, u8 nodeid, void *resp );
+	zw_future_S *(*get_async)( zw_api_ctx_S *ctx, u8 nodeid );
+	zw_future_S *(*set_async)( zw_api_ctx_S *ctx, u8 nodeid, void *val );
 };
 
 int 
@@ -52,7 +66,7 @@ int
 unregister_cmd_class( struct cmd_class *cops);
 
 int 
-cc_process_msg( zw_api_ctx_S *ctx, const u8* frame, u8 nodeid );
+cc_process_msg( zw_api_ctx_S *ctx, const u8* frame, int length, u8 nodeid );
 
 int 
 cc_version( zw_api_ctx_S *ctx, u8 nodeid, const u8 cls_type, void *resp );
@@ -63,6 +77,18 @@ cc_get( zw_api_ctx_S *ctx, u8 nodeid, const u8 cls_type, void *resp );
 int 
 cc_set( zw_api_ctx_S *ctx, u8 nodeid, const u8 cls_type, void *val );
 
+zw_future_S *
+cc_get_async( zw_api_ctx_S *ctx, u8 nodeid, const u8 cls_type );
+
+void
+cc_get_stats( zw_api_ctx_S *ctx, struct zw_cc_stats *stats );
+
+zw_future_S *
+cc_set_async( zw_api_ctx_S *ctx, u8 nodeid, const u8 cls_type, void *val );
+
+zw_future_S *
+cc_set_group_async( zw_api_ctx_S *ctx, const u8 *ids, const u8 *classes, int count, int val, int broadcast );
+
 int 
 cc_report( zw_api_ctx_S *ctx, u8 nodeid, const u8 cls_type, void *resp );
 
@@ -87,6 +87,7 @@ typedef unsigned long long u64;
 #define FUNC_ID_ZW_GET_NODE_PROTOCOL_INFO               0x41
 #define FUNC_ID_ZW_REQUEST_NODE_NEIGHBOR_UPDATE         0x48
 #define FUNC_ID_ZW_SEND_DATA                            0x13
+#define FUNC_ID_ZW_SEND_DATA_MULTI                      0x14
 #define FUNC_ID_ZW_SET_LEARN_MODE                       0x50
 #define FUNC_ID_ZW_ASSIGN_SUC_RETURN_ROUTE		0x51
 #define FUNC_ID_ZW_ENABLE_SUC                           0x52
@@ -191,6 +192,7 @@ typedef unsigned long long u64;
 
 #define WAKE_UP_INTERVAL_SET                         	0x04
 #define WAKE_UP_INTERVAL_GET                         	0x05
+#define WAKE_UP_INTERVAL_REPORT                      	0x06
 #define WAKE_UP_NOTIFICATION                         	0x07
 #define WAKE_UP_NO_MORE_INFORMATION                  	0x08
 
@@ -41,6 +41,12 @@ typedef struct _node
 
 #define list_foreach(node, list) for(node = list->next; node != list; node = node->next)
 
+static inline void list_init(list_head *list)
+{
+	list->next = list;
+	list->prev = list;
+}
+
 static inline int list_empty(list_head *list)
 {
 	if ( list->next == list ) return 1;
@@ -69,6 +75,18 @@ static inline void list_add_tail(list_head *list, list_node *node)
     _list_add(node, list->prev, list);
 }
 
+/* move every node of other to the front of list, keeping their order */
+static inline void list_splice_head(list_head *list, list_head *other)
+{
+	if ( list_empty( other ) ) return;
+
+	other->next->prev = list;
+	other->prev->next = list->next;
+	list->next->prev = other->prev;
+	list->next = other->next;
+	list_init( other );
+}
+
 static inline list_node* list_pop_front(list_head *list)
 {
 	list_node *node = list->next;
@@ -85,6 +103,16 @@ static inline list_node* list_front( list_head *list )
 		return list->next;
 }
 
+/* unlink a node that is known to be on a list */
+static inline void list_del(list_node *node)
+{
+	node->next->prev = node->prev;
+	node->prev->next = node->next;
+	node->next = node;
+	node->prev = node;
+}
+
+/* unlink node if it is on list; walks the list to find out */
 static inline void list_remove(list_head *list, list_node *node)
 {
     list_node *temp = NULL;
@@ -27,36 +27,239 @@
 #ifndef _ZW_API_H_
 #define _ZW_API_H_
 
+#include <pthread.h>
 #include "defs.h"
 #include "genlist.h"
+#include "zw_frame.h"
+#include "zw_transport.h"
+#include "zw_future.h"
+#include "zw_pool.h"
+#include "zw_ring.h"
 
 #define MAX_CMD_SZ      128
 #define MAX_ZWAVE_NODES 256
+#define ZW_MAX_NODE_ID	232	/* highest id a Z-Wave network assigns */
+
+/*
+ * Round trip estimate for one destination, kept the way TCP keeps its
+ * RTO (RFC 6298). Slot 0 is the controller itself. A node that keeps
+ * timing out is held back for an exponentially growing time so it can't
+ * stall the queue for the others.
+ */
+struct zw_rtt {
+	u64 srtt_ns;
+	u64 rttvar_ns;
+	u64 rto_ns;
+	u64 holdoff_ns;		/* nothing is sent to the node before this */
+	u32 samples;
+	u32 timeouts;
+	u32 backoff;		/* consecutive timeouts */
+};
+
+/*
+ * Outgoing messages are queued per priority. The sender drains higher
+ * priorities first, but a message that has waited past the aging limit
+ * of its class goes ahead of everything so background work can't starve.
+ * ZW_PRIO_DEFAULT takes the calling thread's priority, see
+ * zw_api_set_thread_prio().
+ */
+enum zw_prio {
+	ZW_PRIO_DEFAULT = -1,
+	ZW_PRIO_INTERACTIVE = 0,	/* someone is waiting on it */
+	ZW_PRIO_NORMAL,
+	ZW_PRIO_BACKGROUND,		/* polls, node discovery, wake-up refresh */
+	ZW_PRIO_COUNT
+};
+
+/* Time messages spent queued before they were first written */
+struct zw_prio_stats {
+	u64 sent;
+	u64 wait_total_ns;
+	u64 wait_max_ns;
+	u64 aged;		/* sent ahead of higher priorities */
+	u32 queued;
+};
+
+/*
+ * Commands for a node that doesn't listen are held here until it sends a
+ * WAKE_UP_NOTIFICATION and then go out as one batch.
+ */
+#define ZW_MAILBOX_MAX	16
+
+struct zw_mailbox {
+	list_head msgs;
+	u32 count;
+	u32 dropped;
+	u8 sleeping;
+};
+
+/* Outcome of SEND_DATA transactions, from the callback's transmit status */
+struct zw_tx_stats {
+	u64 ok;
+	u64 no_ack;		/* node didn't acknowledge */
+	u64 failed;		/* rejected by the controller or other errors */
+	u64 cb_timeouts;	/* no callback before the deadline */
+	u64 late_callbacks;	/* callback for a transaction we gave up on */
+	u64 batched;		/* commands that rode along in a MULTI_CMD frame */
+};
+
+/* GETs issued through cc_get_async(), and the node value cache in front of it */
+struct zw_cc_stats {
+	u64 gets;		/* sent to the node */
+	u64 coalesced;		/* attached to one already in flight */
+	u64 cache_hits;		/* answered from a fresh enough cached value */
+	u64 cache_misses;	/* cached value missing or too old, went to the node */
+};
+
+/*
+ * SEND_DATA to a node that advertises COMMAND_CLASS_MULTI_CMD is held for
+ * ZW_BATCH_WINDOW_NS after it was queued unless it is interactive, and so
+ * is anything queued behind it for that node. When it goes out, whatever
+ * else is queued for the same node by then rides along in one
+ * MULTI_CMD_ENCAP frame, up to ZW_MULTI_CMD_MAX bytes of encapsulated
+ * payload.
+ */
+#define ZW_BATCH_WINDOW_NS	( 10 * ZW_NSEC_PER_MSEC )
+#define ZW_MULTI_CMD_MAX	46
+
+/*
+ * Everything belonging to one controller. Each context has its own port,
+ * queues, reader thread and node table, so several networks can be driven
+ * from one process without sharing any state.
+ */
 
 typedef struct zw_api_ctx {
-	int port;
+	struct zw_transport tp;
 	int node_id;
+	int offline;		/* replaying a capture; nothing is sent */
+	u64 offline_sends;
+	int epoll_fd;
+	int wake_fd;
+	int timer_fd;
+	struct zw_rx_buf rx;
+	u64 rx_stall_ns;	/* an incomplete frame is dropped at this time */
+	int port_down;		/* lost the port, reader only, see zw_port_lost() */
+	u64 reconnect_ns;	/* next attempt to reopen it */
+	pthread_t reader;
+	u32 stop;			/* set by zw_api_close(), the reader exits */
+	struct zw_ring submit;		/* producers -> reader, the only way in */
+	u32 submit_wake;		/* set once the reader has been woken for it */
+	/*
+	 * The queues, the transaction and the per-node state below are the
+	 * reader's alone. A message is on exactly one send queue or mailbox,
+	 * or it is tx, until it is freed.
+	 */
+	list_head msg_list[ ZW_PRIO_COUNT ];	/* queued, not yet written */
+	struct zwave_msg *tx;		/* the transaction on the wire */
+	int tx_state;			/* enum zw_tx_state */
+	u64 tx_deadline_ns;		/* what tx waits on is due by */
+	u8 next_cbid;
+	struct zw_tx_stats tx_stats;
+	pthread_mutex_t stats_lock;	/* the stats and rtt, read from other threads */
+	struct zw_prio_stats prio_stats[ ZW_PRIO_COUNT ];
+	struct zw_node *node_table[ ZW_MAX_NODE_ID + 1 ];	/* by node id, see zw_node_find() */
+	u32 node_map[ ( ZW_MAX_NODE_ID + 32 ) / 32 ];	/* ids present in node_table */
+	void (*node_change)( struct zw_api_ctx *ctx, u8 id, void *arg );	/* see zw_node_on_change() */
+	void *node_change_arg;
+	struct zw_waiters waiters;	/* futures waiting for a report */
+	pthread_mutex_t cc_lock;	/* single-flight gets in the cmd_class layer */
+	struct zw_cc_stats cc_stats;	/* under cc_lock */
+	struct zw_pool msg_pool;	/* every zwave_msg_S comes from here */
+	struct zw_pool fut_pool;	/* and every zw_future_S from here */
+	struct zw_rtt rtt[ MAX_ZWAVE_NODES ];
+	struct zw_mailbox mailbox[ MAX_ZWAVE_NODES ];
+	u8 multi_cmd[ MAX_ZWAVE_NODES ];	/* node takes MULTI_CMD_ENCAP */
+	u64 next_holdoff_ns;	/* earliest time a held message may go out */
 } zw_api_ctx_S;
 
+/*
+ * The Serial API has one transaction open at a time. The frame is ACKed
+ * by the controller, answered with a RESPONSE if the function has one,
+ * and a SEND_DATA then reports the radio outcome in a callback.
+ */
+enum zw_tx_state {
+	ZW_TX_IDLE,		/* nothing in flight, the next message may go */
+	ZW_TX_WAIT_ACK,
+	ZW_TX_WAIT_RESP,
+	ZW_TX_WAIT_CB,
+};
+
 typedef struct zwave_msg {
         list_node list;
         u8	cmd[ MAX_CMD_SZ ];
         int     len;
-        int     port;
         int     resp_req;
 	int	resp_id;
 	int	node_id;
-	time_t	ts;
+	int	prio;
+	u64	enq_ns;		/* queued by zw_send_request() */
+	u64	ts_ns;		/* last written to the port */
 	int	retry;
+	u8	want_cb;	/* SEND_DATA, last byte carries the callback id */
+	u8	cbid;		/* assigned when written, 0 otherwise */
+	u8	tx_status;	/* last SEND_DATA callback status */
+	zw_future_S *fut;	/* completed when the request finishes */
+	list_head parts;	/* messages carried in this MULTI_CMD frame */
 }zwave_msg_S;   
 
+struct zw_api_opts {
+	const char *capture;	/* record all serial traffic to this file */
+	u32 pool_size;		/* messages (and futures) preallocated, 0 for ZW_POOL_DEFAULT */
+};
+
 int     
 zw_api_init( const char *portname, zw_api_ctx_S *ctx );
 
+int
+zw_api_init_opts( const char *portname, zw_api_ctx_S *ctx, const struct zw_api_opts *opts );
+
+int
+zw_api_init_offline( zw_api_ctx_S *ctx );
+
+void
+zw_api_close( zw_api_ctx_S *ctx );
+
 void 
 zw_process_frame( zw_api_ctx_S *ctx, u8 *frame, int length );
 
 int
 zw_send_request( zw_api_ctx_S *ctx, u8 *buff, int len, int nodeid, int resp_req, int resp_id );
 
+int
+zw_send_request_prio( zw_api_ctx_S *ctx, u8 *buff, int len, int nodeid, int resp_req, int resp_id, int prio );
+
+zw_future_S *
+zw_send_request_async( zw_api_ctx_S *ctx, u8 *buff, int len, int nodeid, int resp_req, int resp_id,
+		       u8 report_cls, u8 report_cmd );
+
+int
+zw_api_report( zw_api_ctx_S *ctx, u8 nodeid, u8 cls, u8 cmd, int val );
+
+void
+zw_api_set_thread_prio( int prio );
+
+void
+zw_api_set_sleeping( zw_api_ctx_S *ctx, int nodeid, int sleeping );
+
+int
+zw_api_wakeup_flush( zw_api_ctx_S *ctx, int nodeid, u8 *buff, int len );
+
+void
+zw_api_set_multi_cmd( zw_api_ctx_S *ctx, int nodeid, int supported );
+
+int
+zw_api_get_prio_stats( zw_api_ctx_S *ctx, int prio, struct zw_prio_stats *stats );
+
+void
+zw_api_get_tx_stats( zw_api_ctx_S *ctx, struct zw_tx_stats *stats );
+
+void
+zw_api_get_transport_stats( zw_api_ctx_S *ctx, struct zw_transport_stats *stats );
+
+int
+zw_api_get_rtt( zw_api_ctx_S *ctx, int nodeid, struct zw_rtt *rtt );
+
+void
+zw_api_get_pool_stats( zw_api_ctx_S *ctx, struct zw_pool_stats *msgs, struct zw_pool_stats *futs );
+
 #endif /* _ZW_API_H_ */
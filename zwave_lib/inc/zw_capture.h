@@ -0,0 +1,82 @@
+//
+//  Created by Praveen Murali Nair on 09/07/2013.
+//  Copyright (c) 2013 Praveen M Nair. All rights reserved.
+//
+// 	Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are met:
+//      * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//      * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//      * Neither the name of the <organization> nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//      ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//      WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//      DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+//      DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//      (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//       LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//      ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef _ZW_CAPTURE_H_
+#define _ZW_CAPTURE_H_
+
+#include <pthread.h>
+#include "defs.h"
+
+/*
+ * Capture file layout (host byte order):
+ *   struct zw_cap_file_hdr
+ *   struct zw_cap_rec_hdr followed by len bytes, repeated
+ */
+#define ZW_CAP_MAGIC		"ZWCAP\0\0\1"
+#define ZW_CAP_VERSION		1
+#define ZW_CAP_RING_SZ		( 1 << 20 )
+
+#define ZW_CAP_RX		0
+#define ZW_CAP_TX		1
+
+struct zw_cap_file_hdr {
+	char	magic[ 8 ];
+	u32	version;
+	u32	reserved;
+	u64	mono_ns;	/* monotonic clock when the capture started */
+	u64	real_ns;	/* wall clock at the same instant */
+};
+
+struct zw_cap_rec_hdr {
+	u64	ts_ns;		/* monotonic */
+	u16	len;
+	u8	dir;
+	u8	flags;
+	u32	reserved;
+};
+
+struct zw_capture {
+	int		fd;
+	u8		*ring;
+	u64		head;		/* consumed by the writer */
+	u64		tail;		/* produced by the reader */
+	u64		dropped;	/* records lost because the ring was full */
+	int		stop;
+	pthread_t	writer;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+};
+
+struct zw_capture *
+zw_capture_open( const char *path );
+
+void
+zw_capture_add( struct zw_capture *cap, int dir, const u8 *buff, int len );
+
+void
+zw_capture_close( struct zw_capture *cap );
+
+#endif /* _ZW_CAPTURE_H_ */
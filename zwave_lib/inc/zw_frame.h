@@ -0,0 +1,88 @@
+//
+//  Created by Praveen Murali Nair on 09/07/2013.
+//  Copyright (c) 2013 Praveen M Nair. All rights reserved.
+//
+// 	Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are met:
+//      * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//      * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//      * Neither the name of the <organization> nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//      ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//      WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//      DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+//      DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//      (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//       LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//      ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef _ZW_FRAME_H_
+#define _ZW_FRAME_H_
+
+#include "defs.h"
+
+#define ZW_MAX_FRAME_SZ		( 2 + 255 )	/* SOF, LEN and up to 255 bytes */
+#define ZW_RX_BUF_SZ		2048
+#define ZW_RX_MAX_ITEMS		32
+
+enum zw_rx_type {
+	ZW_RX_ACK,
+	ZW_RX_NAK,
+	ZW_RX_CAN,
+	ZW_RX_FRAME,		/* complete frame with a valid checksum */
+	ZW_RX_BAD_FRAME,	/* complete frame with a bad checksum */
+};
+
+/*
+ * One parsed item. For frames, data points at the type byte inside the
+ * receive buffer and len excludes the checksum. The slice stays valid
+ * until the next call to zw_rx_space().
+ */
+struct zw_rx_item {
+	int	type;
+	u8	*data;
+	int	len;
+};
+
+/*
+ * Receive buffer for the serial stream. Bytes are appended at tail and
+ * parsed from head; the unparsed remainder is moved to the front before
+ * each read so that every frame handed out is contiguous.
+ */
+struct zw_rx_buf {
+	u8	data[ ZW_RX_BUF_SZ ];
+	int	head;
+	int	tail;
+	u32	garbage;	/* bytes skipped while resyncing */
+};
+
+u8
+zw_checksum( const u8 *buff, int len );
+
+void
+zw_rx_init( struct zw_rx_buf *rx );
+
+int
+zw_rx_space( struct zw_rx_buf *rx, u8 **space );
+
+void
+zw_rx_commit( struct zw_rx_buf *rx, int len );
+
+int
+zw_rx_parse( struct zw_rx_buf *rx, struct zw_rx_item *items, int max );
+
+int
+zw_rx_partial( struct zw_rx_buf *rx );
+
+void
+zw_rx_resync( struct zw_rx_buf *rx );
+
+#endif /* _ZW_FRAME_H_ */
@@ -0,0 +1,147 @@
+//
+//  Created by Praveen Murali Nair on 09/07/2013.
+//  Copyright (c) 2013 Praveen M Nair. All rights reserved.
+//
+// 	Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are met:
+//      * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//      * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//      * Neither the name of the <organization> nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//      ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//      WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//      DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+//      DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//      (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//       LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//      ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef _ZW_FUTURE_H_
+#define _ZW_FUTURE_H_
+
+#include <pthread.h>
+#include "defs.h"
+#include "genlist.h"
+
+#define ZW_WAIT_BUCKETS		64	/* power of two */
+
+struct zw_api_ctx;
+struct zw_future;
+
+/*
+ * Runs once, in the thread that completes the future (normally the
+ * reader). It must not block.
+ */
+typedef void (*zw_future_cb)( struct zw_future *fut, void *arg );
+
+/*
+ * Completion handle for one request, returned by zw_send_request_async().
+ * It completes with the transmit status of the request or, when a report
+ * was asked for, with the value decoded from that report.
+ *
+ * status is 0 on success, EIO when the request could not be delivered,
+ * ETIMEDOUT when the report never came and ECANCELED when the request was
+ * dropped before it was sent.
+ */
+typedef struct zw_future {
+	list_node list;		/* on its waiter table bucket */
+	struct zw_api_ctx *ctx;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int	refs;
+	int	completing;	/* status and val are final, callback running */
+	int	done;		/* callback run, waiters may return */
+	int	status;
+	int	val;		/* report value, or the transmit status */
+	u8	node_id;
+	u8	cls;		/* report awaited, 0 for transmit status only */
+	u8	cmd;
+	u8	listed;		/* in the waiter table, under the bucket lock */
+	u8	shared;		/* later gets may join it, under the bucket lock */
+	u64	deadline_ns;	/* report due by, 0 until the request is written */
+	zw_future_cb cb;
+	void	*cb_arg;
+} zw_future_S;
+
+/*
+ * Futures waiting for a report, hashed by (node, command class, command)
+ * so a report only locks and scans the bucket of its own key.
+ */
+struct zw_wait_bucket {
+	pthread_mutex_t lock;
+	list_head list;
+	u64	next_deadline_ns;	/* no armed future expires before this */
+};
+
+/*
+ * Futures are armed and expired by the reader alone, so it keeps the
+ * earliest deadline of the whole table without taking any bucket lock.
+ */
+struct zw_waiters {
+	struct zw_wait_bucket bucket[ ZW_WAIT_BUCKETS ];
+	u64	next_deadline_ns;	/* min of the buckets', reader only */
+};
+
+zw_future_S *
+zw_future_new( struct zw_api_ctx *ctx, u8 nodeid, u8 cls, u8 cmd );
+
+zw_future_S *
+zw_future_get( zw_future_S *fut );
+
+void
+zw_future_put( zw_future_S *fut );
+
+int
+zw_future_complete( zw_future_S *fut, int status, int val );
+
+int
+zw_future_done( zw_future_S *fut );
+
+int
+zw_future_wait( zw_future_S *fut, int timeout_ms, int *val );
+
+void
+zw_future_on_complete( zw_future_S *fut, zw_future_cb cb, void *arg );
+
+void
+zw_waiters_init( struct zw_waiters *w );
+
+void
+zw_waiters_add( struct zw_waiters *w, zw_future_S *fut );
+
+int
+zw_waiters_remove( struct zw_waiters *w, zw_future_S *fut );
+
+void
+zw_waiters_arm( struct zw_waiters *w, zw_future_S *fut, u64 deadline_ns );
+
+zw_future_S *
+zw_waiters_find( struct zw_waiters *w, u8 nodeid, u8 cls, u8 cmd );
+
+void
+zw_waiters_share( struct zw_waiters *w, zw_future_S *fut );
+
+void
+zw_waiters_unshare( struct zw_waiters *w, u8 nodeid, u8 cls, u8 cmd );
+
+int
+zw_waiters_report( struct zw_waiters *w, u8 nodeid, u8 cls, u8 cmd, int val );
+
+int
+zw_waiters_expire( struct zw_waiters *w, u64 now );
+
+int
+zw_waiters_fail( struct zw_waiters *w, int status );
+
+u64
+zw_waiters_next_deadline( struct zw_waiters *w );
+
+#endif /* _ZW_FUTURE_H_ */
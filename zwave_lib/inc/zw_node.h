@@ -39,8 +39,40 @@
 #define ZW_NODE_STATE_ON	255
 #define ZW_NODE_STATE_OFF	0
 
+#define ZW_NODE_MODE_LISTENING	0x80	/* protocol info capability byte */
+
+#define ZW_NODE_VALUES		4	/* command classes cached per node */
+
+#define ZW_GROUP_REPORT_WINDOW_MS	300	/* reports awaited after a group set */
+#define ZW_GROUP_POLL_MS		10
+
+/* How a cached value was learned */
+enum zw_value_src {
+	ZW_VALUE_REPORT,	/* the node sent it unasked */
+	ZW_VALUE_SET,		/* the node acknowledged a set to it */
+	ZW_VALUE_POLLED,	/* the node answered a get */
+};
+
+/* Last known value of one command class of a node */
+struct zw_node_value {
+	u64 when_ns;		/* zw_time_ns() it was learned, 0 if the slot is free */
+	int val;
+	u8 cls;
+	u8 src;			/* enum zw_value_src */
+};
+
+/*
+ * Nodes live in ctx->node_table, indexed by id, and ctx->node_map has a
+ * bit set for every id in it. Once created a node is never freed, so a
+ * pointer from zw_node_find() stays valid.
+ *
+ * Writers serialize on lock and bump seq around every change, odd while
+ * one is in progress. Readers on other threads don't lock: they copy the
+ * node with zw_node_snapshot(), which retries until seq is even and
+ * unchanged across the copy.
+ */
 struct zw_node {
-	list_node list;
+	u32 seq;
 	char name[ MAX_ZW_NODE_NAME ];
 	int id;
 	u8 mode;
@@ -51,17 +83,50 @@ struct zw_node {
 	u8 cclass;
 	u8 batt_level;
 	u8 state;
-	pthread_mutex_t lock;
+	struct zw_node_value values[ ZW_NODE_VALUES ];
+	pthread_mutex_t lock;	/* between writers only */
+};
+
+/* A consistent copy of a node's fields */
+struct zw_node_snapshot {
+	char name[ MAX_ZW_NODE_NAME ];
+	int id;
+	u8 mode;
+	u8 func;
+	u8 btype;
+	u8 gtype;
+	u8 stype;
+	u8 cclass;
+	u8 batt_level;
+	u8 state;
+	u32 seq;		/* changes whenever the node does */
+};
+
+/*
+ * Called after a node's name, state, battery level or type changed, or
+ * the node was removed, in the thread that changed it (normally the
+ * reader). It must not block.
+ */
+typedef void (*zw_node_change_cb)( zw_api_ctx_S *ctx, u8 id, void *arg );
+
+/* Outcome of zw_node_set_group() */
+struct zw_group_result {
+	int frames;		/* multicast or broadcast frames sent */
+	int confirmed;		/* nodes that reported the requested state */
+	int reported;		/* of those, nodes that did so unasked */
+	int followups;		/* nodes that needed a singlecast set */
+	int nfailed;
+	u8 failed[ MAX_ZWAVE_NODES ];	/* not confirmed, or not a listening switch */
 };
 
 int
-zw_node_set_batt_level( u8 id, u8 level );
+zw_node_set_batt_level( zw_api_ctx_S *ctx, u8 id, u8 level );
 
 int
-zw_node_set_state( u8 id, u8 state );
+zw_node_set_state( zw_api_ctx_S *ctx, u8 id, u8 state );
 
 int
-zw_node_set_label( u8 id, char *label );
+zw_node_set_label( zw_api_ctx_S *ctx, u8 id, char *label );
 
 void
 zw_node_wakeup_handler( zw_api_ctx_S *ctx, u8 nodeid );
@@ -70,11 +135,26 @@ int
 zw_node_get_version( zw_api_ctx_S *ctx, u8 id, void *resp );
 
 int
-zw_node_get_value( zw_api_ctx_S *ctx, u8 id, void *resp );
+zw_node_get_value( zw_api_ctx_S *ctx, u8 id, int max_age_ms, void *resp );
 
 int
 zw_node_set_value( zw_api_ctx_S *ctx, u8 id, void *value );
 
+zw_future_S *
+zw_node_get_value_async( zw_api_ctx_S *ctx, u8 id, int max_age_ms );
+
+void
+zw_node_cache_value( zw_api_ctx_S *ctx, u8 id, u8 cls, int val, int src );
+
+int
+zw_node_cached_value( zw_api_ctx_S *ctx, u8 id, u8 cls, int max_age_ms, struct zw_node_value *value );
+
+zw_future_S *
+zw_node_set_value_async( zw_api_ctx_S *ctx, u8 id, void *value );
+
+int
+zw_node_set_group( zw_api_ctx_S *ctx, const u8 *ids, int count, int state, struct zw_group_result *res );
+
 int
 zw_node_get_report( zw_api_ctx_S *ctx, u8 id, void *resp );
 
@@ -88,19 +168,35 @@ int
 zw_node_get_wakeup_interval( zw_api_ctx_S *ctx, u8 id, void *resp );
 
 void 
-zw_list_nodes();
+zw_list_nodes( zw_api_ctx_S *ctx );
+
+struct zw_node *
+zw_node_find( zw_api_ctx_S *ctx, int id );
+
+struct zw_node *
+zw_node_next( zw_api_ctx_S *ctx, int prev );
+
+void
+zw_node_snapshot( struct zw_node *zwnode, struct zw_node_snapshot *snap );
+
+void
+zw_node_on_change( zw_api_ctx_S *ctx, zw_node_change_cb cb, void *arg );
+
+int
+zw_node_snapshot_all( zw_api_ctx_S *ctx, struct zw_node_snapshot *snaps, int max );
 
-list_head *
-zw_get_node_list();
+/* every node in id order */
+#define zw_foreach_node( ctx, zwnode ) \
+	for ( zwnode = zw_node_next( ctx, 0 ); zwnode; zwnode = zw_node_next( ctx, zwnode->id ) )
 
 struct zw_node *
-create_zw_node( int id );
+create_zw_node( zw_api_ctx_S *ctx, int id );
 
 int
 register_zw_node( zw_api_ctx_S *ctx, const u8 *frame, int id );
 
 int
-unregister_zw_node( int id );
+unregister_zw_node( zw_api_ctx_S *ctx, int id );
 
 
 #endif /* ZW_NODE_H */
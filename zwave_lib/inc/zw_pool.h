@@ -0,0 +1,78 @@
+//
+//  Created by Praveen Murali Nair on 09/07/2013.
+//  Copyright (c) 2013 Praveen M Nair. All rights reserved.
+//
+// 	Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are met:
+//      * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//      * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//      * Neither the name of the <organization> nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//      ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//      WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//      DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+//      DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//      (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//       LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//      ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef _ZW_POOL_H_
+#define _ZW_POOL_H_
+
+#include <stddef.h>
+#include "defs.h"
+
+#define ZW_POOL_DEFAULT		256	/* objects per pool when not configured */
+
+/*
+ * Fixed-size object pool. Every object is allocated once, by
+ * zw_pool_init(), and get/put never touch the heap. The free list is a
+ * lock-free stack of object indexes, safe from any thread; the head
+ * carries a generation count next to the index so a pop can't succeed on
+ * a stale view of it (ABA). An empty pool fails the get with ENOBUFS
+ * rather than growing.
+ */
+struct zw_pool_stats {
+	u32 capacity;
+	u32 in_use;
+	u32 high_water;
+	u64 allocs;
+	u64 exhausted;		/* gets that found the pool empty */
+};
+
+struct zw_pool {
+	u8 *mem;
+	u32 *next;		/* free list link per object: index + 1, 0 ends it */
+	size_t size;
+	u32 capacity;
+	u64 head;		/* generation << 32 | index + 1 of the top object */
+	u32 in_use;
+	u32 high_water;
+	u64 allocs;
+	u64 exhausted;
+};
+
+int
+zw_pool_init( struct zw_pool *pool, size_t size, u32 capacity );
+
+void
+zw_pool_destroy( struct zw_pool *pool );
+
+void *
+zw_pool_get( struct zw_pool *pool );
+
+void
+zw_pool_put( struct zw_pool *pool, void *obj );
+
+void
+zw_pool_get_stats( struct zw_pool *pool, struct zw_pool_stats *stats );
+
+#endif /* _ZW_POOL_H_ */
@@ -0,0 +1,64 @@
+//
+//  Created by Praveen Murali Nair on 09/07/2013.
+//  Copyright (c) 2013 Praveen M Nair. All rights reserved.
+//
+// 	Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are met:
+//      * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//      * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//      * Neither the name of the <organization> nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//      ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//      WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//      DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+//      DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//      (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//       LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//      ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef _ZW_RING_H_
+#define _ZW_RING_H_
+
+#include "defs.h"
+
+/*
+ * Bounded multi-producer, single-consumer ring of pointers. Producers
+ * claim a slot with one compare-and-swap on the tail and publish it
+ * through the slot's sequence number, so neither side ever takes a lock
+ * and a slow producer only delays the slots behind its own. Only one
+ * thread may pop.
+ */
+struct zw_ring_slot {
+	u32 seq;
+	void *item;
+};
+
+struct zw_ring {
+	struct zw_ring_slot *slots;
+	u32 mask;
+	u32 tail __attribute__(( aligned( 64 ) ));	/* next slot a producer claims */
+	u32 head __attribute__(( aligned( 64 ) ));	/* next slot the consumer reads */
+	u32 full;		/* pushes that found no free slot */
+};
+
+int
+zw_ring_init( struct zw_ring *ring, u32 capacity );
+
+void
+zw_ring_destroy( struct zw_ring *ring );
+
+int
+zw_ring_push( struct zw_ring *ring, void *item );
+
+void *
+zw_ring_pop( struct zw_ring *ring );
+
+#endif /* _ZW_RING_H_ */
@@ -0,0 +1,108 @@
+//
+//  Created by Praveen Murali Nair on 09/07/2013.
+//  Copyright (c) 2013 Praveen M Nair. All rights reserved.
+//
+// 	Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are met:
+//      * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//      * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//      * Neither the name of the <organization> nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//      ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//      WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//      DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+//      DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//      (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//       LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//      ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef _ZW_TRANSPORT_H_
+#define _ZW_TRANSPORT_H_
+
+#include <pthread.h>
+#include "defs.h"
+#include "zw_capture.h"
+
+#define ZW_MAX_URI		128
+#define ZW_TX_BUF_SZ		1024
+
+struct zw_transport;
+struct addrinfo;
+
+/*
+ * A transport carries the raw Serial API byte stream. The tty backend
+ * talks to a local stick; the tcp backend connects to a remote serial
+ * server such as ser2net ("tcp://host:port", "tcp://[::1]:port").
+ */
+struct zw_transport_ops {
+	const char *scheme;
+	int (*open)( struct zw_transport *tp, const char *path );
+	int (*read)( struct zw_transport *tp, u8 *buff, int len );
+	int (*write)( struct zw_transport *tp, const u8 *buff, int len );
+	int (*poll_fd)( struct zw_transport *tp );
+	void (*close)( struct zw_transport *tp );
+};
+
+struct zw_transport_stats {
+	u64	rx_bytes;
+	u64	tx_bytes;
+	u64	rx_reads;
+	u64	tx_writes;
+	u64	rtt_last_ns;	/* frame flushed -> ACK received */
+	u64	rtt_avg_ns;
+	u64	rtt_max_ns;
+	u64	rtt_samples;
+	u32	reconnects;
+};
+
+struct zw_transport {
+	const struct zw_transport_ops *ops;
+	int	fd;
+	char	uri[ ZW_MAX_URI ];
+	char	path[ ZW_MAX_URI ];
+	struct addrinfo *addrs;	/* tcp: resolved once, reused to reconnect */
+	u8	txbuf[ ZW_TX_BUF_SZ ];
+	int	txlen;
+	int	tx_frame;	/* a request frame is in txbuf */
+	u64	tx_ns;		/* when the last request frame was flushed */
+	struct zw_capture *capture;	/* optional traffic capture */
+	pthread_mutex_t stats_lock;	/* stats are read from other threads */
+	struct zw_transport_stats stats;
+};
+
+int
+zw_transport_open( struct zw_transport *tp, const char *uri );
+
+int
+zw_transport_reopen( struct zw_transport *tp );
+
+int
+zw_transport_read( struct zw_transport *tp, u8 *buff, int len );
+
+int
+zw_transport_write( struct zw_transport *tp, const u8 *buff, int len );
+
+int
+zw_transport_flush( struct zw_transport *tp );
+
+int
+zw_transport_poll_fd( struct zw_transport *tp );
+
+void
+zw_transport_ack( struct zw_transport *tp );
+
+void
+zw_transport_get_stats( struct zw_transport *tp, struct zw_transport_stats *stats );
+
+void
+zw_transport_close( struct zw_transport *tp );
+
+#endif /* _ZW_TRANSPORT_H_ */
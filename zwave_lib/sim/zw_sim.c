@@ -0,0 +1,1110 @@
+//
+//  Created by Praveen Murali Nair on 09/07/2013.
+//  Copyright (c) 2013 Praveen M Nair. All rights reserved.
+//
+// 	Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are met:
+//      * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//      * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//      * Neither the name of the <organization> nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//      ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//      WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//      DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+//      DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//      (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//       LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//      ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+//
+// zwsim - a virtual Z-Wave Serial API controller.
+//
+// Speaks the controller side of the Serial API over a pty (or a tcp port
+// for the tcp transport) and simulates up to 231 slave nodes of the types
+// handled in src/classes: binary switches, binary sensors, battery powered
+// wake-up sensors and toggle switches. Per-node latency, frame loss,
+// NAK/CAN injection and unsolicited report rates are configurable so the
+// library and hzremote can be exercised at scale without a real stick.
+//
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <termios.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <math.h>
+
+#include "defs.h"
+#include "zw_frame.h"
+#include "zw_time.h"
+
+#define SIM_CTRL_NODE		1
+#define SIM_MAX_NODES		232
+#define SIM_HOME_ID		0xC0FFEE01
+#define SIM_AWAKE_NS		( 10 * ZW_NSEC_PER_SEC )
+#define SIM_CMD_MAX		44	/* longest command a node sends back */
+
+enum sim_type {
+	SIM_SWITCH,
+	SIM_SENSOR,
+	SIM_SLEEPER,
+	SIM_TOGGLE,
+	SIM_TYPE_MAX,
+};
+
+static const char *sim_type_names[ SIM_TYPE_MAX ] = {
+	"switch", "sensor", "sleeper", "toggle",
+};
+
+struct sim_node {
+	int	present;
+	int	type;
+	int	listening;
+	int	awake;
+	u8	value;
+	u8	batt;
+	int	wakeup_intvl;
+	u64	awake_until;
+	int	multi_cmd;	/* advertises and answers COMMAND_CLASS_MULTI_CMD */
+	/* behaviour */
+	int	latency_ms;
+	int	jitter_ms;
+	double	loss;		/* probability a SEND_DATA is not acked by the node */
+	double	nak;		/* probability the controller NAKs the host frame */
+	double	can;		/* probability the controller CANs the host frame */
+	double	reports;	/* unsolicited reports (or wake ups) per minute */
+	double	lifeline;	/* probability a switch reports a group set */
+};
+
+enum sim_ev_type {
+	SIM_EV_FRAME,		/* write a prepared frame to the host */
+	SIM_EV_REPORT,		/* node sends an unsolicited report / wakes up */
+	SIM_EV_SLEEP,		/* awake node goes back to sleep */
+};
+
+struct sim_event {
+	u64	at;
+	int	type;
+	int	node;
+	int	len;
+	u8	frame[ 64 ];
+};
+
+struct sim_stats {
+	u64	rx_frames;
+	u64	rx_bad;
+	u64	rx_acks;
+	u64	tx_frames;
+	u64	send_data;
+	u64	multicast;	/* SEND_DATA_MULTI and broadcast SEND_DATA */
+	u64	callbacks_ok;
+	u64	callbacks_fail;
+	u64	reports;
+	u64	naks;
+	u64	cans;
+};
+
+static struct sim_node nodes[ SIM_MAX_NODES + 1 ];
+static int nnodes = 231;
+
+static struct sim_event *heap;
+static int heap_len;
+static int heap_alloc;
+
+static struct sim_stats stats;
+static unsigned int seed = 1;
+static int host_fd = -1;
+static int timer_fd = -1;
+static int epoll_fd = -1;
+
+static double
+sim_rand( void )
+{
+	return (double)rand_r( &seed ) / ( (double)RAND_MAX + 1.0 );
+}
+
+static void
+heap_push( const struct sim_event *ev )
+{
+	int i, parent;
+
+	if ( heap_len == heap_alloc ) {
+		heap_alloc = heap_alloc ? heap_alloc * 2 : 1024;
+		heap = realloc( heap, heap_alloc * sizeof( *heap ) );
+		if ( !heap ) {
+			perror( "zwsim" );
+			exit( 1 );
+		}
+	}
+
+	i = heap_len++;
+	while ( i ) {
+		parent = ( i - 1 ) / 2;
+		if ( heap[ parent ].at <= ev->at ) break;
+		heap[ i ] = heap[ parent ];
+		i = parent;
+	}
+	heap[ i ] = *ev;
+}
+
+static void
+heap_pop( struct sim_event *ev )
+{
+	struct sim_event last;
+	int i = 0, child;
+
+	*ev = heap[ 0 ];
+	last = heap[ --heap_len ];
+	while ( ( child = 2 * i + 1 ) < heap_len ) {
+		if ( child + 1 < heap_len && heap[ child + 1 ].at < heap[ child ].at )
+			child++;
+		if ( last.at <= heap[ child ].at ) break;
+		heap[ i ] = heap[ child ];
+		i = child;
+	}
+	heap[ i ] = last;
+}
+
+static void
+sim_arm_timer( void )
+{
+	struct itimerspec its;
+
+	memset( &its, 0, sizeof( its ) );
+	if ( heap_len ) {
+		zw_ns_to_timespec( heap[ 0 ].at, &its.it_value );
+		if ( !its.it_value.tv_sec && !its.it_value.tv_nsec )
+			its.it_value.tv_nsec = 1;
+	}
+	timerfd_settime( timer_fd, TFD_TIMER_ABSTIME, &its, NULL );
+}
+
+static void
+sim_write( const u8 *buff, int len )
+{
+	int done = 0, rc;
+
+	if ( 0 > host_fd ) return;
+	while ( done < len ) {
+		rc = write( host_fd, buff + done, len - done );
+		if ( 0 > rc ) {
+			if ( EINTR == errno ) continue;
+			if ( EAGAIN == errno ) {
+				usleep( 100 );
+				continue;
+			}
+			return;
+		}
+		done += rc;
+	}
+}
+
+/* build SOF/LEN/type/body/checksum into ev->frame */
+static void
+sim_build( struct sim_event *ev, u8 type, const u8 *body, int len )
+{
+	ev->frame[ 0 ] = SOF;
+	ev->frame[ 1 ] = len + 2;
+	ev->frame[ 2 ] = type;
+	memcpy( ev->frame + 3, body, len );
+	ev->frame[ len + 3 ] = zw_checksum( ev->frame + 1, len + 2 );
+	ev->len = len + 4;
+}
+
+static void
+sim_queue_frame( u64 at, u8 type, const u8 *body, int len )
+{
+	struct sim_event ev;
+
+	memset( &ev, 0, sizeof( ev ) );
+	ev.at = at;
+	ev.type = SIM_EV_FRAME;
+	sim_build( &ev, type, body, len );
+	heap_push( &ev );
+}
+
+static void
+sim_respond( const u8 *body, int len )
+{
+	struct sim_event ev;
+
+	sim_build( &ev, RESPONSE, body, len );
+	sim_write( ev.frame, ev.len );
+	stats.tx_frames++;
+}
+
+static u64
+sim_node_delay( struct sim_node *n )
+{
+	u64 ms = n->latency_ms;
+
+	if ( n->jitter_ms ) ms += rand_r( &seed ) % ( n->jitter_ms + 1 );
+	return ms * ZW_NSEC_PER_MSEC;
+}
+
+static void
+sim_schedule_report( int id, u64 now )
+{
+	struct sim_event ev;
+	double per_ns;
+
+	if ( 0 >= nodes[ id ].reports ) return;
+
+	/* exponential inter-arrival times give a poisson report stream */
+	per_ns = 60.0 * ZW_NSEC_PER_SEC / nodes[ id ].reports;
+	memset( &ev, 0, sizeof( ev ) );
+	ev.at = now + (u64)( -log( 1.0 - sim_rand() ) * per_ns );
+	ev.type = SIM_EV_REPORT;
+	ev.node = id;
+	heap_push( &ev );
+}
+
+/* APPLICATION_COMMAND_HANDLER carrying a command from node id */
+static void
+sim_queue_command( u64 at, int id, u8 rxstatus, const u8 *cmd, int len )
+{
+	u8 body[ 4 + SIM_CMD_MAX ];
+
+	body[ 0 ] = FUNC_ID_APPLICATION_COMMAND_HANDLER;
+	body[ 1 ] = rxstatus;
+	body[ 2 ] = id;
+	body[ 3 ] = len;
+	memcpy( body + 4, cmd, len );
+	sim_queue_frame( at, REQUEST, body, len + 4 );
+	stats.reports++;
+}
+
+static u8
+sim_node_class( struct sim_node *n )
+{
+	switch ( n->type ) {
+	case SIM_SWITCH:	return COMMAND_CLASS_SWITCH_BINARY;
+	case SIM_TOGGLE:	return COMMAND_CLASS_SWITCH_TOGGLE_BINARY;
+	default:		return COMMAND_CLASS_SENSOR_BINARY;
+	}
+}
+
+static int
+sim_node_command( int id, const u8 *cmd, int len, u8 *reply );
+
+/*
+ * MULTI_CMD_ENCAP: count, then length and bytes per command. The replies
+ * go back the same way, in one frame.
+ */
+static int
+sim_node_multi_cmd( int id, const u8 *cmd, int len, u8 *reply )
+{
+	u8 one[ SIM_CMD_MAX ];
+	int off = 3, rlen = 3;
+	int i, clen, olen;
+
+	reply[ 0 ] = COMMAND_CLASS_MULTI_CMD;
+	reply[ 1 ] = MULTI_CMD_ENCAP;
+	reply[ 2 ] = 0;
+	for ( i = 0; i < cmd[ 2 ] && off < len; i++ ) {
+		clen = cmd[ off ];
+		if ( off + 1 + clen > len ) break;
+		if ( clen && COMMAND_CLASS_MULTI_CMD != cmd[ off + 1 ] ) {
+			olen = sim_node_command( id, cmd + off + 1, clen, one );
+			if ( olen && rlen + 1 + olen <= SIM_CMD_MAX ) {
+				reply[ rlen++ ] = olen;
+				memcpy( reply + rlen, one, olen );
+				rlen += olen;
+				reply[ 2 ]++;
+			}
+		}
+		off += 1 + clen;
+	}
+
+	return reply[ 2 ] ? rlen : 0;
+}
+
+/*
+ * Apply a command delivered to node id and return the length of the reply
+ * the node sends back (0 when it does not answer).
+ */
+static int
+sim_node_command( int id, const u8 *cmd, int len, u8 *reply )
+{
+	struct sim_node *n = &nodes[ id ];
+
+	if ( 2 > len ) return 0;
+
+	switch ( cmd[ 0 ] ) {
+	case COMMAND_CLASS_BASIC:
+	case COMMAND_CLASS_SWITCH_BINARY:
+	case COMMAND_CLASS_SWITCH_TOGGLE_BINARY:
+		if ( SIM_SWITCH != n->type && SIM_TOGGLE != n->type ) break;
+		if ( SWITCH_BINARY_SET == cmd[ 1 ] && 3 <= len ) {
+			n->value = cmd[ 2 ] ? 0xff : 0;
+			return 0;
+		}
+		if ( SWITCH_BINARY_GET == cmd[ 1 ] ) {
+			reply[ 0 ] = cmd[ 0 ];
+			reply[ 1 ] = SWITCH_BINARY_REPORT;
+			reply[ 2 ] = n->value;
+			return 3;
+		}
+		break;
+	case COMMAND_CLASS_SENSOR_BINARY:
+		if ( SENSOR_BINARY_GET == cmd[ 1 ] ) {
+			reply[ 0 ] = COMMAND_CLASS_SENSOR_BINARY;
+			reply[ 1 ] = SENSOR_BINARY_REPORT;
+			reply[ 2 ] = n->value;
+			return 3;
+		}
+		break;
+	case COMMAND_CLASS_BATTERY:
+		if ( BATTERY_GET == cmd[ 1 ] && SIM_SLEEPER == n->type ) {
+			reply[ 0 ] = COMMAND_CLASS_BATTERY;
+			reply[ 1 ] = BATTERY_REPORT;
+			reply[ 2 ] = n->batt;
+			return 3;
+		}
+		break;
+	case COMMAND_CLASS_WAKE_UP:
+		if ( SIM_SLEEPER != n->type ) break;
+		if ( WAKE_UP_INTERVAL_SET == cmd[ 1 ] && 5 <= len ) {
+			n->wakeup_intvl = ( cmd[ 2 ] << 16 ) | ( cmd[ 3 ] << 8 ) | cmd[ 4 ];
+			return 0;
+		}
+		if ( WAKE_UP_INTERVAL_GET == cmd[ 1 ] ) {
+			reply[ 0 ] = COMMAND_CLASS_WAKE_UP;
+			reply[ 1 ] = WAKE_UP_INTERVAL_REPORT;
+			reply[ 2 ] = ( n->wakeup_intvl >> 16 ) & 0xff;
+			reply[ 3 ] = ( n->wakeup_intvl >> 8 ) & 0xff;
+			reply[ 4 ] = n->wakeup_intvl & 0xff;
+			reply[ 5 ] = SIM_CTRL_NODE;
+			return 6;
+		}
+		if ( WAKE_UP_NO_MORE_INFORMATION == cmd[ 1 ] ) {
+			n->awake = 0;
+			return 0;
+		}
+		break;
+	case COMMAND_CLASS_SWITCH_ALL:
+		if ( SIM_SWITCH != n->type && SIM_TOGGLE != n->type ) break;
+		if ( SWITCH_ALL_ON == cmd[ 1 ] ) n->value = 0xff;
+		if ( SWITCH_ALL_OFF == cmd[ 1 ] ) n->value = 0;
+		return 0;
+	case COMMAND_CLASS_MULTI_CMD:
+		if ( n->multi_cmd && MULTI_CMD_ENCAP == cmd[ 1 ] && 3 <= len )
+			return sim_node_multi_cmd( id, cmd, len, reply );
+		break;
+	}
+	return 0;
+}
+
+/*
+ * A multicast or broadcast frame: every node in ids (all of them when ids
+ * is NULL) that hears it applies the command but nobody answers, bar
+ * switches with a lifeline that report their new state. The callback only
+ * says the controller sent it, after the slowest node's latency.
+ */
+static void
+sim_send_group( u8 func, const u8 *ids, int count, const u8 *cmd, int clen, int cbid, u64 now )
+{
+	u8 body[ 4 ];
+	u8 reply[ SIM_CMD_MAX ];
+	struct sim_node *n;
+	u64 delay, at = now;
+	int i, id;
+
+	stats.multicast++;
+	body[ 0 ] = func;
+	body[ 1 ] = 1;
+	sim_respond( body, 2 );
+
+	for ( i = 0; ids ? i < count : i < SIM_MAX_NODES; i++ ) {
+		id = ids ? ids[ i ] : i + 1;
+		if ( id > SIM_MAX_NODES || id == SIM_CTRL_NODE ) continue;
+		n = &nodes[ id ];
+		if ( !n->present ) continue;
+		delay = sim_node_delay( n );
+		if ( now + delay > at ) at = now + delay;
+		if ( !( n->listening || n->awake ) || sim_rand() < n->loss )
+			continue;
+		sim_node_command( id, cmd, clen, reply );
+		if ( ( SIM_SWITCH == n->type || SIM_TOGGLE == n->type ) && sim_rand() < n->lifeline ) {
+			reply[ 0 ] = sim_node_class( n );
+			reply[ 1 ] = SWITCH_BINARY_REPORT;
+			reply[ 2 ] = n->value;
+			sim_queue_command( now + delay, id, 0, reply, 3 );
+		}
+	}
+
+	if ( cbid ) {
+		body[ 0 ] = func;
+		body[ 1 ] = cbid;
+		body[ 2 ] = TRANSMIT_COMPLETE_OK;
+		sim_queue_frame( at, REQUEST, body, 3 );
+		stats.callbacks_ok++;
+	}
+}
+
+/*
+ * FUNC_ID_ZW_SEND_DATA_MULTI: count, node[count], len, command...,
+ * txoptions, callback id.
+ */
+static void
+sim_send_data_multi( const u8 *frame, int len, u64 now )
+{
+	int count = frame[ 2 ];
+	int clen, cbid = 0;
+
+	if ( 4 + count > len ) return;
+	clen = frame[ 3 + count ];
+	if ( 5 + count + clen > len ) return;
+	if ( 6 + count + clen <= len ) cbid = frame[ 5 + count + clen ];
+
+	sim_send_group( FUNC_ID_ZW_SEND_DATA_MULTI, frame + 3, count, frame + 4 + count, clen, cbid, now );
+}
+
+/*
+ * FUNC_ID_ZW_SEND_DATA: node, len, command..., txoptions [, callback id].
+ * The controller answers at once; the callback and any report from the
+ * node follow after the node's latency.
+ */
+static void
+sim_send_data( const u8 *frame, int len, u64 now )
+{
+	u8 body[ 16 ];
+	u8 reply[ SIM_CMD_MAX ];
+	int id = frame[ 2 ];
+	int clen = frame[ 3 ];
+	int cbid = 0;
+	int rlen = 0;
+	int delivered;
+	struct sim_node *n;
+	u64 at;
+
+	stats.send_data++;
+	if ( 6 + clen <= len ) cbid = frame[ 5 + clen ];
+
+	if ( NODE_BROADCAST == id ) {
+		sim_send_group( FUNC_ID_ZW_SEND_DATA, NULL, 0, frame + 4, clen, cbid, now );
+		return;
+	}
+
+	body[ 0 ] = FUNC_ID_ZW_SEND_DATA;
+	body[ 1 ] = 1;
+	sim_respond( body, 2 );
+
+	if ( id > SIM_MAX_NODES ) return;
+	n = &nodes[ id ];
+	at = now + sim_node_delay( n );
+
+	delivered = n->present && ( n->listening || n->awake ) && sim_rand() >= n->loss;
+	if ( delivered )
+		rlen = sim_node_command( id, frame + 4, clen, reply );
+
+	if ( cbid ) {
+		body[ 0 ] = FUNC_ID_ZW_SEND_DATA;
+		body[ 1 ] = cbid;
+		body[ 2 ] = delivered ? TRANSMIT_COMPLETE_OK : TRANSMIT_COMPLETE_NO_ACK;
+		sim_queue_frame( at, REQUEST, body, 3 );
+	}
+	if ( delivered ) stats.callbacks_ok++;
+	else             stats.callbacks_fail++;
+
+	if ( rlen )
+		sim_queue_command( at + ZW_NSEC_PER_MSEC, id, 0, reply, rlen );
+}
+
+static const u8 sim_generic_type[ SIM_TYPE_MAX ] = {
+	GENERIC_TYPE_SWITCH_BINARY, GENERIC_TYPE_SENSOR_BINARY,
+	GENERIC_TYPE_SENSOR_BINARY, GENERIC_TYPE_SWITCH_TOGGLE,
+};
+
+/*
+ * FUNC_ID_ZW_REQUEST_NODE_INFO: the controller answers at once, the node
+ * information frame follows as an APPLICATION_UPDATE after the node's
+ * latency: basic, generic and specific type, then the supported classes.
+ */
+static void
+sim_node_info( int id, u64 now )
+{
+	struct sim_node *n = ( id <= SIM_MAX_NODES ) ? &nodes[ id ] : NULL;
+	u8 body[ 16 ];
+	int len = 8;
+
+	body[ 0 ] = FUNC_ID_ZW_REQUEST_NODE_INFO;
+	body[ 1 ] = 1;
+	sim_respond( body, 2 );
+
+	body[ 0 ] = FUNC_ID_ZW_APPLICATION_UPDATE;
+	body[ 2 ] = id;
+	if ( !n || !n->present || !( n->listening || n->awake ) ) {
+		body[ 1 ] = UPDATE_STATE_NODE_INFO_REQ_FAILED;
+		body[ 2 ] = 0;
+		body[ 3 ] = 0;
+		sim_queue_frame( now + ( n ? sim_node_delay( n ) : 0 ), REQUEST, body, 4 );
+		return;
+	}
+	body[ 1 ] = UPDATE_STATE_NODE_INFO_RECEIVED;
+	body[ 4 ] = BASIC_TYPE_ROUTING_SLAVE;
+	body[ 5 ] = sim_generic_type[ n->type ];
+	body[ 6 ] = 1;
+	body[ 7 ] = sim_node_class( n );
+	if ( SIM_SLEEPER == n->type ) {
+		body[ len++ ] = COMMAND_CLASS_WAKE_UP;
+		body[ len++ ] = COMMAND_CLASS_BATTERY;
+	}
+	if ( n->multi_cmd ) body[ len++ ] = COMMAND_CLASS_MULTI_CMD;
+	body[ 3 ] = len - 4;
+	sim_queue_frame( now + sim_node_delay( n ), REQUEST, body, len );
+}
+
+static void
+sim_node_protocol_info( int id )
+{
+	u8 body[ 8 ];
+	struct sim_node *n = ( id <= SIM_MAX_NODES ) ? &nodes[ id ] : NULL;
+
+	memset( body, 0, sizeof( body ) );
+	body[ 0 ] = FUNC_ID_ZW_GET_NODE_PROTOCOL_INFO;
+	if ( id == SIM_CTRL_NODE ) {
+		body[ 1 ] = 0x80;
+		body[ 4 ] = BASIC_TYPE_STATIC_CONTROLLER;
+		body[ 5 ] = GENERIC_TYPE_STATIC_CONTROLLER;
+		body[ 6 ] = 1;
+	}
+	else if ( n && n->present ) {
+		body[ 1 ] = n->listening ? 0x80 : 0;
+		body[ 4 ] = BASIC_TYPE_ROUTING_SLAVE;
+		body[ 5 ] = sim_generic_type[ n->type ];
+		body[ 6 ] = 1;
+	}
+	sim_respond( body, 7 );
+}
+
+static void
+sim_init_data( void )
+{
+	u8 body[ 6 + MAGIC_LEN ];
+	int id;
+
+	memset( body, 0, sizeof( body ) );
+	body[ 0 ] = FUNC_ID_SERIAL_API_GET_INIT_DATA;
+	body[ 1 ] = 5;
+	body[ 2 ] = 0x08;	/* SIS */
+	body[ 3 ] = MAGIC_LEN;
+	for ( id = 1; id <= SIM_MAX_NODES; id++ ) {
+		if ( id == SIM_CTRL_NODE || nodes[ id ].present )
+			body[ 4 + ( id - 1 ) / 8 ] |= 1 << ( ( id - 1 ) % 8 );
+	}
+	body[ 4 + MAGIC_LEN ] = 5;
+	body[ 5 + MAGIC_LEN ] = 0;
+	sim_respond( body, sizeof( body ) );
+}
+
+static void
+sim_process_request( const u8 *frame, int len, u64 now )
+{
+	static const char version[] = "Z-Wave 2.78";
+	u8 body[ 48 ];
+
+	switch ( frame[ 1 ] ) {
+	case ZW_GET_VERSION:
+		body[ 0 ] = ZW_GET_VERSION;
+		memcpy( body + 1, version, sizeof( version ) );
+		body[ 1 + sizeof( version ) ] = 1;
+		sim_respond( body, 2 + sizeof( version ) );
+		break;
+	case ZW_MEMORY_GET_ID:
+		body[ 0 ] = ZW_MEMORY_GET_ID;
+		body[ 1 ] = ( SIM_HOME_ID >> 24 ) & 0xff;
+		body[ 2 ] = ( SIM_HOME_ID >> 16 ) & 0xff;
+		body[ 3 ] = ( SIM_HOME_ID >> 8 ) & 0xff;
+		body[ 4 ] = SIM_HOME_ID & 0xff;
+		body[ 5 ] = SIM_CTRL_NODE;
+		sim_respond( body, 6 );
+		break;
+	case FUNC_ID_SERIAL_API_GET_CAPABILITIES:
+		memset( body, 0xff, 41 );
+		body[ 0 ] = FUNC_ID_SERIAL_API_GET_CAPABILITIES;
+		body[ 1 ] = 1; body[ 2 ] = 2;
+		body[ 3 ] = 0x00; body[ 4 ] = 0x86;	/* manufacturer */
+		body[ 5 ] = 0x00; body[ 6 ] = 0x01;
+		body[ 7 ] = 0x00; body[ 8 ] = 0x5a;
+		sim_respond( body, 41 );
+		break;
+	case FUNC_ID_ZW_GET_SUC_NODE_ID:
+		body[ 0 ] = FUNC_ID_ZW_GET_SUC_NODE_ID;
+		body[ 1 ] = SIM_CTRL_NODE;
+		sim_respond( body, 2 );
+		break;
+	case FUNC_ID_SERIAL_API_GET_INIT_DATA:
+		sim_init_data();
+		break;
+	case FUNC_ID_ZW_GET_NODE_PROTOCOL_INFO:
+		if ( 3 <= len ) sim_node_protocol_info( frame[ 2 ] );
+		break;
+	case FUNC_ID_ZW_SEND_DATA:
+		if ( 5 <= len ) sim_send_data( frame, len, now );
+		break;
+	case FUNC_ID_ZW_SEND_DATA_MULTI:
+		if ( 3 <= len ) sim_send_data_multi( frame, len, now );
+		break;
+	case FUNC_ID_ZW_REQUEST_NODE_INFO:
+		if ( 3 <= len ) sim_node_info( frame[ 2 ], now );
+		break;
+	default:
+		body[ 0 ] = frame[ 1 ];
+		body[ 1 ] = 1;
+		sim_respond( body, 2 );
+		break;
+	}
+}
+
+/* node id of a SEND_DATA frame, 0 for anything else */
+static int
+sim_frame_node( const u8 *frame, int len )
+{
+	if ( REQUEST == frame[ 0 ] && FUNC_ID_ZW_SEND_DATA == frame[ 1 ] && 3 <= len &&
+	     frame[ 2 ] <= SIM_MAX_NODES )
+		return frame[ 2 ];
+	return 0;
+}
+
+static void
+sim_host_frame( const u8 *frame, int len, u64 now )
+{
+	struct sim_node *n = &nodes[ sim_frame_node( frame, len ) ];
+	u8 reply;
+
+	stats.rx_frames++;
+	if ( sim_rand() < n->nak ) {
+		reply = NAK;
+		stats.naks++;
+		sim_write( &reply, 1 );
+		return;
+	}
+	if ( sim_rand() < n->can ) {
+		reply = CAN;
+		stats.cans++;
+		sim_write( &reply, 1 );
+		return;
+	}
+
+	reply = ACK;
+	sim_write( &reply, 1 );
+	if ( REQUEST == frame[ 0 ] )
+		sim_process_request( frame, len, now );
+}
+
+static void
+sim_node_event( int id, u64 now )
+{
+	struct sim_node *n = &nodes[ id ];
+	struct sim_event ev;
+	u8 cmd[ 4 ];
+
+	switch ( n->type ) {
+	case SIM_SWITCH:
+	case SIM_TOGGLE:
+	case SIM_SENSOR:
+		/* local operation or a sensor trip */
+		n->value = n->value ? 0 : 0xff;
+		cmd[ 0 ] = sim_node_class( n );
+		cmd[ 1 ] = SWITCH_BINARY_REPORT;
+		cmd[ 2 ] = n->value;
+		sim_queue_command( now, id, 0, cmd, 3 );
+		break;
+	case SIM_SLEEPER:
+		n->awake = 1;
+		n->awake_until = now + SIM_AWAKE_NS;
+		if ( n->batt > 10 && sim_rand() < 0.1 ) n->batt--;
+		cmd[ 0 ] = COMMAND_CLASS_WAKE_UP;
+		cmd[ 1 ] = WAKE_UP_NOTIFICATION;
+		sim_queue_command( now, id, 0, cmd, 2 );
+
+		memset( &ev, 0, sizeof( ev ) );
+		ev.at = n->awake_until;
+		ev.type = SIM_EV_SLEEP;
+		ev.node = id;
+		heap_push( &ev );
+		break;
+	}
+	sim_schedule_report( id, now );
+}
+
+static void
+sim_run_events( void )
+{
+	struct sim_event ev;
+	u64 now = zw_time_ns();
+
+	while ( heap_len && heap[ 0 ].at <= now ) {
+		heap_pop( &ev );
+		switch ( ev.type ) {
+		case SIM_EV_FRAME:
+			sim_write( ev.frame, ev.len );
+			stats.tx_frames++;
+			break;
+		case SIM_EV_REPORT:
+			sim_node_event( ev.node, now );
+			break;
+		case SIM_EV_SLEEP:
+			if ( nodes[ ev.node ].awake_until <= now )
+				nodes[ ev.node ].awake = 0;
+			break;
+		}
+	}
+}
+
+static void
+sim_host_input( struct zw_rx_buf *rx )
+{
+	struct zw_rx_item items[ ZW_RX_MAX_ITEMS ];
+	u8 *space;
+	u8 nak = NAK;
+	u64 now;
+	int count, i, rc;
+
+	rc = zw_rx_space( rx, &space );
+	rc = read( host_fd, space, rc );
+	if ( 0 >= rc ) {
+		if ( 0 > rc && ( EAGAIN == errno || EINTR == errno ) ) return;
+		fprintf( stderr, "zwsim: host disconnected\n" );
+		epoll_ctl( epoll_fd, EPOLL_CTL_DEL, host_fd, NULL );
+		close( host_fd );
+		host_fd = -1;
+		return;
+	}
+	zw_rx_commit( rx, rc );
+	now = zw_time_ns();
+
+	do {
+		count = zw_rx_parse( rx, items, ZW_RX_MAX_ITEMS );
+		for ( i = 0; i < count; i++ ) {
+			switch ( items[ i ].type ) {
+			case ZW_RX_ACK:
+				stats.rx_acks++;
+				break;
+			case ZW_RX_FRAME:
+				sim_host_frame( items[ i ].data, items[ i ].len, now );
+				break;
+			case ZW_RX_BAD_FRAME:
+				stats.rx_bad++;
+				sim_write( &nak, 1 );
+				break;
+			}
+		}
+	} while ( ZW_RX_MAX_ITEMS == count );
+}
+
+static void
+sim_print_stats( void )
+{
+	fprintf( stderr, "zwsim: rx %llu (bad %llu, acks %llu) tx %llu send_data %llu multicast %llu "
+		 "cb ok %llu fail %llu reports %llu nak %llu can %llu\n",
+		 stats.rx_frames, stats.rx_bad, stats.rx_acks, stats.tx_frames,
+		 stats.send_data, stats.multicast, stats.callbacks_ok, stats.callbacks_fail,
+		 stats.reports, stats.naks, stats.cans );
+}
+
+static int
+sim_type_from_name( const char *name )
+{
+	int t;
+
+	for ( t = 0; t < SIM_TYPE_MAX; t++ )
+		if ( 0 == strcmp( name, sim_type_names[ t ] ) ) return t;
+	return -1;
+}
+
+static void
+sim_init_node( int id, int type, const struct sim_node *defaults )
+{
+	struct sim_node *n = &nodes[ id ];
+
+	*n = *defaults;
+	n->present = 1;
+	n->type = type;
+	n->listening = ( SIM_SLEEPER != type );
+	n->batt = 100;
+	n->wakeup_intvl = 3600;
+}
+
+/*
+ * "switch:60,sensor:15,sleeper:15,toggle:10" - share of nodes per type,
+ * assigned to consecutive node ids.
+ */
+static int
+sim_apply_mix( const char *mix, const struct sim_node *defaults )
+{
+	int weight[ SIM_TYPE_MAX ] = { 0 };
+	char *copy = strdup( mix ), *tok, *save = NULL, *colon;
+	int total = 0, t, k, acc, pos;
+
+	for ( tok = strtok_r( copy, ",", &save ); tok; tok = strtok_r( NULL, ",", &save ) ) {
+		colon = strchr( tok, ':' );
+		if ( colon ) *colon++ = 0;
+		t = sim_type_from_name( tok );
+		if ( 0 > t ) {
+			fprintf( stderr, "zwsim: unknown node type %s\n", tok );
+			free( copy );
+			return -1;
+		}
+		weight[ t ] = colon ? atoi( colon ) : 1;
+		total += weight[ t ];
+	}
+	free( copy );
+	if ( !total ) return -1;
+
+	for ( k = 0; k < nnodes; k++ ) {
+		pos = ( k * total ) / nnodes;
+		for ( t = 0, acc = 0; t < SIM_TYPE_MAX; t++ ) {
+			acc += weight[ t ];
+			if ( pos < acc ) break;
+		}
+		sim_init_node( SIM_CTRL_NODE + 1 + k, t, defaults );
+	}
+	return 0;
+}
+
+/*
+ * Per-node overrides, one node per line:
+ *   <id> <type> [latency_ms [loss [nak [can [reports_per_min]]]]]
+ */
+static int
+sim_load_nodes( const char *file, const struct sim_node *defaults )
+{
+	FILE *fp = fopen( file, "r" );
+	char line[ 256 ], type[ 32 ];
+	struct sim_node *n;
+	int id, t, fields;
+
+	if ( !fp ) {
+		perror( file );
+		return -1;
+	}
+	while ( fgets( line, sizeof( line ), fp ) ) {
+		if ( '#' == line[ 0 ] || '\n' == line[ 0 ] ) continue;
+		if ( 2 > sscanf( line, "%d %31s", &id, type ) ||
+		     id <= SIM_CTRL_NODE || id > SIM_MAX_NODES ||
+		     0 > ( t = sim_type_from_name( type ) ) ) {
+			fprintf( stderr, "zwsim: bad node line: %s", line );
+			continue;
+		}
+		sim_init_node( id, t, defaults );
+		n = &nodes[ id ];
+		fields = sscanf( line, "%*d %*s %d %lf %lf %lf %lf", &n->latency_ms,
+				 &n->loss, &n->nak, &n->can, &n->reports );
+		(void)fields;
+	}
+	fclose( fp );
+	return 0;
+}
+
+static int
+sim_open_pty( const char *link )
+{
+	struct termios tios;
+	char *slave;
+	int fd, sfd;
+
+	fd = posix_openpt( O_RDWR | O_NOCTTY );
+	if ( 0 > fd || grantpt( fd ) || unlockpt( fd ) || !( slave = ptsname( fd ) ) ) {
+		perror( "zwsim: pty" );
+		return -1;
+	}
+
+	/* keep a raw slave open so the master survives host reconnects */
+	sfd = open( slave, O_RDWR | O_NOCTTY );
+	if ( 0 <= sfd && 0 == tcgetattr( sfd, &tios ) ) {
+		cfmakeraw( &tios );
+		tcsetattr( sfd, TCSANOW, &tios );
+	}
+
+	if ( link ) {
+		unlink( link );
+		if ( symlink( slave, link ) ) perror( link );
+	}
+	printf( "%s\n", link ? link : slave );
+	fflush( stdout );
+	return fd;
+}
+
+static int
+sim_listen_tcp( int port )
+{
+	struct sockaddr_in addr;
+	int one = 1;
+	int fd = socket( AF_INET, SOCK_STREAM, 0 );
+
+	setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+	memset( &addr, 0, sizeof( addr ) );
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl( INADDR_ANY );
+	addr.sin_port = htons( port );
+	if ( bind( fd, (struct sockaddr *)&addr, sizeof( addr ) ) || listen( fd, 1 ) ) {
+		perror( "zwsim: listen" );
+		return -1;
+	}
+	printf( "tcp://127.0.0.1:%d\n", port );
+	fflush( stdout );
+	return fd;
+}
+
+static void
+sim_epoll_add( int fd )
+{
+	struct epoll_event ev;
+
+	memset( &ev, 0, sizeof( ev ) );
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	epoll_ctl( epoll_fd, EPOLL_CTL_ADD, fd, &ev );
+}
+
+static const char *usage_txt =
+"Call: zwsim [options]\n"
+"  -n, --nodes <n>        number of slave nodes (default 231)\n"
+"  -m, --mix <mix>        node types, e.g. switch:60,sensor:15,sleeper:15,toggle:10\n"
+"  -f, --file <file>      per-node config: <id> <type> [lat_ms [loss [nak [can [rpm]]]]]\n"
+"  -l, --latency <ms>     per-node radio latency (default 20)\n"
+"  -j, --jitter <ms>      random extra latency (default 0)\n"
+"  -L, --loss <p>         probability a node misses a frame (default 0)\n"
+"  -N, --nak <p>          probability the controller NAKs a host frame\n"
+"  -C, --can <p>          probability the controller CANs a host frame\n"
+"  -r, --reports <rpm>    unsolicited reports / wake ups per node per minute\n"
+"  -M, --multi-cmd        nodes advertise and answer COMMAND_CLASS_MULTI_CMD\n"
+"  -R, --lifeline <p>     probability a switch reports its state after a group set\n"
+"  -o, --link <path>      symlink the pty slave to <path>\n"
+"  -t, --tcp <port>       listen on tcp instead of a pty\n"
+"  -s, --stats <sec>      print counters every <sec> seconds\n"
+"  -S, --seed <n>         random seed\n";
+
+int main( int argc, char **argv )
+{
+	static const struct option long_opts[] = {
+		{ "nodes",	1, 0, 'n' }, { "mix",	  1, 0, 'm' },
+		{ "file",	1, 0, 'f' }, { "latency", 1, 0, 'l' },
+		{ "jitter",	1, 0, 'j' }, { "loss",	  1, 0, 'L' },
+		{ "nak",	1, 0, 'N' }, { "can",	  1, 0, 'C' },
+		{ "reports",	1, 0, 'r' }, { "link",	  1, 0, 'o' },
+		{ "tcp",	1, 0, 't' }, { "stats",	  1, 0, 's' },
+		{ "seed",	1, 0, 'S' }, { "multi-cmd", 0, 0, 'M' },
+		{ "lifeline",	1, 0, 'R' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct sim_node defaults;
+	struct epoll_event events[ 4 ];
+	struct zw_rx_buf rx;
+	const char *mix = "switch:60,sensor:15,sleeper:15,toggle:10";
+	const char *file = NULL, *link = NULL;
+	int tcp_port = 0, stats_sec = 0;
+	int listen_fd = -1;
+	u64 next_stats = 0, now;
+	int c, i, n, id;
+
+	memset( &defaults, 0, sizeof( defaults ) );
+	defaults.latency_ms = 20;
+
+	while ( ( c = getopt_long( argc, argv, "n:m:f:l:j:L:N:C:r:o:t:s:S:MR:", long_opts, NULL ) ) != -1 ) {
+		switch ( c ) {
+		case 'n': nnodes = atoi( optarg ); break;
+		case 'm': mix = optarg; break;
+		case 'f': file = optarg; break;
+		case 'l': defaults.latency_ms = atoi( optarg ); break;
+		case 'j': defaults.jitter_ms = atoi( optarg ); break;
+		case 'L': defaults.loss = atof( optarg ); break;
+		case 'N': defaults.nak = atof( optarg ); break;
+		case 'C': defaults.can = atof( optarg ); break;
+		case 'r': defaults.reports = atof( optarg ); break;
+		case 'o': link = optarg; break;
+		case 't': tcp_port = atoi( optarg ); break;
+		case 's': stats_sec = atoi( optarg ); break;
+		case 'S': seed = atoi( optarg ); break;
+		case 'M': defaults.multi_cmd = 1; break;
+		case 'R': defaults.lifeline = atof( optarg ); break;
+		default:
+			fprintf( stderr, "%s", usage_txt );
+			return 1;
+		}
+	}
+	if ( nnodes < 0 || nnodes > SIM_MAX_NODES - SIM_CTRL_NODE ) {
+		fprintf( stderr, "zwsim: nodes must be 0..%d\n", SIM_MAX_NODES - SIM_CTRL_NODE );
+		return 1;
+	}
+
+	if ( sim_apply_mix( mix, &defaults ) ) return 1;
+	if ( file && sim_load_nodes( file, &defaults ) ) return 1;
+
+	epoll_fd = epoll_create1( 0 );
+	timer_fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK );
+	sim_epoll_add( timer_fd );
+
+	if ( tcp_port ) {
+		listen_fd = sim_listen_tcp( tcp_port );
+		if ( 0 > listen_fd ) return 1;
+		sim_epoll_add( listen_fd );
+	}
+	else {
+		host_fd = sim_open_pty( link );
+		if ( 0 > host_fd ) return 1;
+		sim_epoll_add( host_fd );
+	}
+
+	zw_rx_init( &rx );
+	now = zw_time_ns();
+	for ( id = 1; id <= SIM_MAX_NODES; id++ )
+		if ( nodes[ id ].present ) sim_schedule_report( id, now );
+	if ( stats_sec ) next_stats = now + stats_sec * ZW_NSEC_PER_SEC;
+
+	while ( 1 ) {
+		sim_arm_timer();
+		n = epoll_wait( epoll_fd, events, 4, stats_sec ? 1000 : -1 );
+		for ( i = 0; i < n; i++ ) {
+			if ( events[ i ].data.fd == timer_fd ) {
+				u64 exp;
+				if ( read( timer_fd, &exp, sizeof( exp ) ) ) {}
+			}
+			else if ( events[ i ].data.fd == listen_fd ) {
+				int one = 1;
+				int fd = accept( listen_fd, NULL, NULL );
+				if ( 0 > fd ) continue;
+				if ( 0 <= host_fd ) {
+					close( fd );
+					continue;
+				}
+				setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+				host_fd = fd;
+				zw_rx_init( &rx );
+				sim_epoll_add( host_fd );
+			}
+			else if ( events[ i ].data.fd == host_fd ) {
+				sim_host_input( &rx );
+			}
+		}
+		sim_run_events();
+
+		if ( stats_sec && zw_time_ns() >= next_stats ) {
+			sim_print_stats();
+			next_stats += stats_sec * ZW_NSEC_PER_SEC;
+		}
+	}
+
+	return 0;
+}
@@ -46,18 +46,18 @@ batt_proc_msg( zw_api_ctx_S *ctx, const u8* frame, u8 nodeid )
 		if ((unsigned char)frame[7] == 0xff) {
 			SYSLOG_DEBUG( "Battery low warning from node %d", nodeid );
 		}
-		if ( 0 != zw_node_set_batt_level( nodeid, val ) )
+		if ( 0 != zw_node_set_batt_level( ctx, nodeid, val ) )
 			SYSLOG_DEBUG( "Setting node battery level failed" );
+		zw_api_report( ctx, nodeid, COMMAND_CLASS_BATTERY, BATTERY_REPORT, val );
 	}
 
 	return 0;
 }
 
-static int
-batt_get( zw_api_ctx_S *ctx, u8 nodeid, void *resp )
+static zw_future_S *
+batt_get_async( zw_api_ctx_S *ctx, u8 nodeid )
 {
 	u8 buff[1024];
-	int rc;
 
 	buff[0] = FUNC_ID_ZW_SEND_DATA;
 	buff[1] = nodeid;
@@ -65,18 +65,17 @@ batt_get( zw_api_ctx_S *ctx, u8 nodeid, void *resp )
 	buff[3] = COMMAND_CLASS_BATTERY;
 	buff[4] = BATTERY_GET;
 	buff[5] = TRANSMIT_OPTION_ACK | TRANSMIT_OPTION_AUTO_ROUTE;
-	buff[6] = 3;
-
-	rc = zw_send_request( ctx, buff, 7, nodeid, RESP_REQ, FUNC_ID_ZW_SEND_DATA );
 
-	return rc;
+	return zw_send_request_async( ctx, buff, 6, nodeid, RESP_REQ, FUNC_ID_ZW_SEND_DATA,
+				      COMMAND_CLASS_BATTERY, BATTERY_REPORT );
 }
 
 struct cmd_class batt = {
 	.name		= "Battery",
 	.type		= COMMAND_CLASS_BATTERY,
+	.report_cmd	= BATTERY_REPORT,
 	.process_msg	= batt_proc_msg,
-	.get		= batt_get,
+	.get_async	= batt_get_async,
 };
 
 static void __init_mod batt_init( void )
@@ -43,19 +43,19 @@ bin_sensor_proc_msg( zw_api_ctx_S *ctx, const u8* frame, u8 nodeid )
 	if (frame[6] == SENSOR_BINARY_REPORT) {
 		SYSLOG_DEBUG( "Got sensor report from node %i, level: %i",(unsigned char)frame[3],(unsigned char)frame[7]);
 		val = frame[ 7 ];
-		if ( 0 != zw_node_set_state( nodeid, val ) )
+		if ( 0 != zw_node_set_state( ctx, nodeid, val ) )
 			SYSLOG_DEBUG( "Setting node bin sensor state failed" );
+		zw_api_report( ctx, nodeid, COMMAND_CLASS_SENSOR_BINARY, SENSOR_BINARY_REPORT, val );
 
 	}
 
 	return 0;
 }
 
-static int
-bin_sensor_get( zw_api_ctx_S *ctx, u8 nodeid, void *resp )
+static zw_future_S *
+bin_sensor_get_async( zw_api_ctx_S *ctx, u8 nodeid )
 {
 	u8 buff[1024];
-	int rc;
 
 	buff[0] = FUNC_ID_ZW_SEND_DATA;
 	buff[1] = nodeid;
@@ -63,19 +63,18 @@ bin_sensor_get( zw_api_ctx_S *ctx, u8 nodeid, void *resp )
 	buff[3] = COMMAND_CLASS_SENSOR_BINARY;
 	buff[4] = SENSOR_BINARY_GET;
 	buff[5] = TRANSMIT_OPTION_ACK | TRANSMIT_OPTION_AUTO_ROUTE;
-	buff[6] = 3;
-
-	rc = zw_send_request( ctx, buff, 7, nodeid, RESP_REQ, FUNC_ID_ZW_SEND_DATA );
 
-	return rc;
+	return zw_send_request_async( ctx, buff, 6, nodeid, RESP_REQ, FUNC_ID_ZW_SEND_DATA,
+				      COMMAND_CLASS_SENSOR_BINARY, SENSOR_BINARY_REPORT );
 }
 
 
 struct cmd_class bin_sensor = {
 	.name		= "BinarySensor",
 	.type		= COMMAND_CLASS_SENSOR_BINARY,
+	.report_cmd	= SENSOR_BINARY_REPORT,
 	.process_msg	= bin_sensor_proc_msg,
-	.get		= bin_sensor_get,
+	.get_async	= bin_sensor_get_async,
 };
 
 static void __init_mod bin_sensor_init( void )
@@ -33,11 +33,6 @@
 #include "zw_node.h"
 #include "log.h"
 
-static pthread_mutex_t val_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t sw_value = PTHREAD_COND_INITIALIZER;
-
-static int sw_val;
-
 static int 
 bin_sw_proc_msg( zw_api_ctx_S *ctx, const u8* frame, u8 nodeid )
 {
@@ -61,25 +56,19 @@ bin_sw_proc_msg( zw_api_ctx_S *ctx, const u8* frame, u8 nodeid )
 		goto out;
 	}
 
-	
-	pthread_mutex_lock( &val_lock );
-	if ( 0 != zw_node_set_state( nodeid, val ) )
+	if ( 0 != zw_node_set_state( ctx, nodeid, val ) )
 		SYSLOG_DEBUG( "Setting node bin switch state failed" );
-	sw_val = val;
-	pthread_cond_broadcast( &sw_value );
-	pthread_mutex_unlock( &val_lock );
+	if ((unsigned char)frame[6] == SWITCH_BINARY_REPORT)
+		zw_api_report( ctx, nodeid, COMMAND_CLASS_SWITCH_BINARY, SWITCH_BINARY_REPORT, val );
 
 out:
 	return 0;
 }
 
-static int 
-bin_sw_get( zw_api_ctx_S *ctx, u8 nodeid, void *resp )
+static zw_future_S *
+bin_sw_get_async( zw_api_ctx_S *ctx, u8 nodeid )
 {
         u8 buff[1024];
-	int rc;
-	int *value = (int *)resp;
-	struct timespec ts;
 
         buff[0] = FUNC_ID_ZW_SEND_DATA;
         buff[1] = nodeid;
@@ -87,23 +76,13 @@ bin_sw_get( zw_api_ctx_S *ctx, u8 nodeid, void *resp )
         buff[3] = COMMAND_CLASS_SWITCH_BINARY;
         buff[4] = SWITCH_BINARY_GET;
         buff[5] = TRANSMIT_OPTION_ACK | TRANSMIT_OPTION_AUTO_ROUTE;
-        buff[6] = 3;
-
-        rc = zw_send_request( ctx, buff, 7, 3, RESP_REQ, FUNC_ID_ZW_SEND_DATA );
-
-	pthread_mutex_lock( &val_lock );	
-
-	clock_gettime(CLOCK_REALTIME, &ts);
-	ts.tv_sec += 5;
-        rc = pthread_cond_timedwait(&sw_value, &val_lock, &ts);
-	*value = sw_val;	
-	pthread_mutex_unlock( &val_lock );	
 
-	return rc;
+        return zw_send_request_async( ctx, buff, 6, nodeid, RESP_REQ, FUNC_ID_ZW_SEND_DATA,
+				      COMMAND_CLASS_SWITCH_BINARY, SWITCH_BINARY_REPORT );
 }
 
-static int 
-bin_sw_set( zw_api_ctx_S *ctx, u8 nodeid, void *value )
+static zw_future_S *
+bin_sw_set_async( zw_api_ctx_S *ctx, u8 nodeid, void *value )
 {
         u8 buff[1024];
 	int level = *(int *)value;
@@ -116,22 +95,16 @@ bin_sw_set( zw_api_ctx_S *ctx, u8 nodeid, void *value )
         buff[5] = level;
         buff[6] = TRANSMIT_OPTION_ACK | TRANSMIT_OPTION_AUTO_ROUTE;
 
-        return zw_send_request( ctx, buff, 7, 3, RESP_REQ, FUNC_ID_ZW_SEND_DATA );
-}
-
-static int 
-bin_sw_report( zw_api_ctx_S *ctx, u8 nodeid, void *resp )
-{
-	return bin_sw_get( ctx, nodeid, resp );
+        return zw_send_request_async( ctx, buff, 7, nodeid, RESP_REQ, FUNC_ID_ZW_SEND_DATA, 0, 0 );
 }
 
 struct cmd_class bin_sw = {
         .name		= "BinarySwitch",
 	.type		= COMMAND_CLASS_SWITCH_BINARY,
+	.report_cmd	= SWITCH_BINARY_REPORT,
 	.process_msg	= bin_sw_proc_msg,
-	.get		= bin_sw_get,
-	.set		= bin_sw_set,
-	.report		= bin_sw_report
+	.get_async	= bin_sw_get_async,
+	.set_async	= bin_sw_set_async,
 };
 
 static void __init_mod bin_sw_init( void )
@@ -142,7 +115,5 @@ static void __init_mod bin_sw_init( void )
 static void __exit_mod bin_sw_exit( void )
 {
 	unregister_cmd_class( &bin_sw );
-	pthread_cond_destroy( &sw_value );
-	pthread_mutex_destroy( &val_lock );
 }
 
@@ -30,12 +30,9 @@
 #include "module.h"
 #include "cmd_class.h"
 #include "zw_api.h"
+#include "zw_node.h"
 #include "log.h"
 
-static pthread_mutex_t val_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t tsw_value = PTHREAD_COND_INITIALIZER;
-int tsw_val = -1;
-
 static int
 toggle_sw_proc_msg( zw_api_ctx_S *ctx, const u8* frame, u8 nodeid )
 {
@@ -59,22 +56,19 @@ toggle_sw_proc_msg( zw_api_ctx_S *ctx, const u8* frame, u8 nodeid )
 		goto out;
 	}
 
-	pthread_mutex_lock( &val_lock );
-	tsw_val = val;
-	pthread_cond_broadcast( &tsw_value );
-	pthread_mutex_unlock( &val_lock );
+	if ( 0 != zw_node_set_state( ctx, nodeid, val ) )
+		SYSLOG_DEBUG( "Setting node toggle switch state failed" );
+	if ((unsigned char)frame[6] == SWITCH_TOGGLE_BINARY_REPORT)
+		zw_api_report( ctx, nodeid, COMMAND_CLASS_SWITCH_TOGGLE_BINARY, SWITCH_TOGGLE_BINARY_REPORT, val );
 
 out:
 	return 0;
 }
 
-static int
-toggle_sw_get( zw_api_ctx_S *ctx, u8 nodeid, void *resp )
+static zw_future_S *
+toggle_sw_get_async( zw_api_ctx_S *ctx, u8 nodeid )
 {
 	u8 buff[1024];
-	int rc;
-	int *value = (int *)resp;
-	struct timespec ts;
 
 	buff[0] = FUNC_ID_ZW_SEND_DATA;
 	buff[1] = nodeid;
@@ -82,23 +76,13 @@ toggle_sw_get( zw_api_ctx_S *ctx, u8 nodeid, void *resp )
 	buff[3] = COMMAND_CLASS_SWITCH_TOGGLE_BINARY;
 	buff[4] = SWITCH_TOGGLE_BINARY_GET;
 	buff[5] = TRANSMIT_OPTION_ACK | TRANSMIT_OPTION_AUTO_ROUTE;
-	buff[6] = 3;
-
-	rc = zw_send_request( ctx, buff, 7, 3, RESP_REQ, FUNC_ID_ZW_SEND_DATA );
-
-	pthread_mutex_lock( &val_lock );
-
-	clock_gettime(CLOCK_REALTIME, &ts);
-	ts.tv_sec += 5;
-	rc = pthread_cond_timedwait(&tsw_value, &val_lock, &ts);
-	*value = tsw_val;
-	pthread_mutex_unlock( &val_lock );
 
-	return rc;
+	return zw_send_request_async( ctx, buff, 6, nodeid, RESP_REQ, FUNC_ID_ZW_SEND_DATA,
+				      COMMAND_CLASS_SWITCH_TOGGLE_BINARY, SWITCH_TOGGLE_BINARY_REPORT );
 }
 
-static int
-toggle_sw_set( zw_api_ctx_S *ctx, u8 nodeid, void *value )
+static zw_future_S *
+toggle_sw_set_async( zw_api_ctx_S *ctx, u8 nodeid, void *value )
 {
 	u8 buff[1024];
 	int level = *(int *)value;
@@ -111,22 +95,16 @@ toggle_sw_set( zw_api_ctx_S *ctx, u8 nodeid, void *value )
 	buff[5] = level;
 	buff[6] = TRANSMIT_OPTION_ACK | TRANSMIT_OPTION_AUTO_ROUTE;
 
-	return zw_send_request( ctx, buff, 7, 3, RESP_REQ, FUNC_ID_ZW_SEND_DATA );
-}
-
-static int
-toggle_sw_report( zw_api_ctx_S *ctx, u8 nodeid, void *resp )
-{
-	return toggle_sw_get( ctx, nodeid, resp );
+	return zw_send_request_async( ctx, buff, 7, nodeid, RESP_REQ, FUNC_ID_ZW_SEND_DATA, 0, 0 );
 }
 
 struct cmd_class toggle_sw = {
 	.name		= "ToggleSwitch",
 	.type		= COMMAND_CLASS_SWITCH_TOGGLE_BINARY,
+	.report_cmd	= SWITCH_TOGGLE_BINARY_REPORT,
 	.process_msg	= toggle_sw_proc_msg,
-	.get		= toggle_sw_get,
-	.set		= toggle_sw_set,
-	.report		= toggle_sw_report
+	.get_async	= toggle_sw_get_async,
+	.set_async	= toggle_sw_set_async,
 };
 
 static void __init_mod toggle_sw_init( void )
@@ -137,8 +115,6 @@ static void __init_mod toggle_sw_init( void )
 static void __exit_mod toggle_sw_exit( void )
 {
 	unregister_cmd_class( &toggle_sw );
-	pthread_cond_destroy( &tsw_value );
-	pthread_mutex_destroy( &val_lock );
 }
 
 
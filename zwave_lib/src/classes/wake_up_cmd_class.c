@@ -38,6 +38,7 @@ static int
 wake_up_proc_msg( zw_api_ctx_S *ctx, const u8* frame, u8 nodeid )
 {
         u8 buff[1024];
+	int interval;
 
 	SYSLOG_DEBUG( "COMMAND_CLASS_WAKE_UP - processing message");
 	// 0x1 0x8 0x0 0x4 0x4 0x2 0x2 0x84 0x7 0x74 (#########t)
@@ -49,7 +50,7 @@ wake_up_proc_msg( zw_api_ctx_S *ctx, const u8* frame, u8 nodeid )
 		if (frame[2] & RECEIVE_STATUS_TYPE_BROAD ) {
 			SYSLOG_DEBUG( "Got broadcast wakeup from node %i, doing WAKE_UP_INTERVAL_SET",frame[3]);
 		} else {
-			SYSLOG_DEBUG( "Got unicast wakeup from node %i, doing WAKE_UP_NO_MORE_INFORMATION",frame[3]);
+			SYSLOG_DEBUG( "Got unicast wakeup from node %i, sending held commands and WAKE_UP_NO_MORE_INFORMATION",frame[3]);
 			// send to sleep
 			buff[0]=FUNC_ID_ZW_SEND_DATA;
 			buff[1]=frame[3]; // destination
@@ -57,18 +58,21 @@ wake_up_proc_msg( zw_api_ctx_S *ctx, const u8* frame, u8 nodeid )
 			buff[3]=COMMAND_CLASS_WAKE_UP;
 			buff[4]=WAKE_UP_NO_MORE_INFORMATION;
 			buff[5]=TRANSMIT_OPTION_ACK | TRANSMIT_OPTION_AUTO_ROUTE;
-			zw_send_request( ctx, buff, 6, nodeid, RESP_REQ, FUNC_ID_ZW_SEND_DATA );
+			zw_api_wakeup_flush( ctx, nodeid, buff, 6 );
 		}
 
+	} else if (frame[6] == WAKE_UP_INTERVAL_REPORT) {
+		interval = ( frame[7] << 16 ) | ( frame[8] << 8 ) | frame[9];
+		SYSLOG_DEBUG( "Wakeup interval of node %d is %d seconds", nodeid, interval );
+		zw_api_report( ctx, nodeid, COMMAND_CLASS_WAKE_UP, WAKE_UP_INTERVAL_REPORT, interval );
 	} else {
 		SYSLOG_DEBUG( "%i received from node %d", frame[6], nodeid );
 	}
-	fflush(stdout);
 	return 0;
 }
 
-static int 
-wake_up_set( zw_api_ctx_S *ctx, u8 nodeid, void *value )
+static zw_future_S *
+wake_up_set_async( zw_api_ctx_S *ctx, u8 nodeid, void *value )
 {
         u8 buff[1024];
 	int interval = *(int *)value;
@@ -84,14 +88,13 @@ wake_up_set( zw_api_ctx_S *ctx, u8 nodeid, void *value )
         buff[7] = (u8)( interval & 0xff );
         buff[8] = ctx->node_id;
         buff[9] = TRANSMIT_OPTION_ACK | TRANSMIT_OPTION_AUTO_ROUTE;
-	buff[10] = 3;
 
 	SYSLOG_DEBUG( "wake_up_set: %d %x %x %x", interval, buff[5], buff[6], buff[7]  );
-        return zw_send_request( ctx, buff, 11, nodeid, RESP_REQ, FUNC_ID_ZW_SEND_DATA );
+        return zw_send_request_async( ctx, buff, 10, nodeid, RESP_REQ, FUNC_ID_ZW_SEND_DATA, 0, 0 );
 }
 
-static int 
-wake_up_get( zw_api_ctx_S *ctx, u8 nodeid, void *value )
+static zw_future_S *
+wake_up_get_async( zw_api_ctx_S *ctx, u8 nodeid )
 {
         u8 buff[1024];
 
@@ -101,18 +104,19 @@ wake_up_get( zw_api_ctx_S *ctx, u8 nodeid, void *value )
         buff[3] = COMMAND_CLASS_WAKE_UP;
         buff[4] = WAKE_UP_INTERVAL_GET;
         buff[5] = TRANSMIT_OPTION_ACK | TRANSMIT_OPTION_AUTO_ROUTE;
-        buff[6] = 3;
 
-        return zw_send_request( ctx, buff, 6, nodeid, RESP_REQ, FUNC_ID_ZW_SEND_DATA );
+        return zw_send_request_async( ctx, buff, 6, nodeid, RESP_REQ, FUNC_ID_ZW_SEND_DATA,
+				      COMMAND_CLASS_WAKE_UP, WAKE_UP_INTERVAL_REPORT );
 }
 
 
 struct cmd_class wake_up = {
         .name		= "WakeUp",
 	.type		= COMMAND_CLASS_WAKE_UP,
+	.report_cmd	= WAKE_UP_INTERVAL_REPORT,
 	.process_msg	= wake_up_proc_msg,
-	.set		= wake_up_set,
-	.get		= wake_up_get,
+	.set_async	= wake_up_set_async,
+	.get_async	= wake_up_get_async,
 };
 
 static void __init_mod wake_up_init( void )
@@ -27,16 +27,20 @@
 //      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 //
 #include <stdio.h>
+#include <string.h>
 #include "cmd_class.h"
 #include "log.h"
 
-LIST_HEAD( cmd_classes );
+/* registered classes by their command class byte */
+static struct cmd_class *cmd_classes[ 256 ];
 
 void print_cmd_classes()
 {
-	list_node *node = NULL;
-	list_foreach(node, (&cmd_classes)) {
-		SYSLOG_DEBUG( "CmdClass: %s", ((struct cmd_class *)node)->name );
+	int i;
+
+	for ( i = 0; i < 256; i++ ) {
+		if ( cmd_classes[ i ] )
+			SYSLOG_DEBUG( "CmdClass: %s", cmd_classes[ i ]->name );
 	}
 }
 
@@ -172,9 +176,6 @@ cc_process_unimplemented_msg( const u8 *frame )
 			SYSLOG_DEBUG( "COMMAND_CLASS_THERMOSTAT_MODE - ");
 			break;
 			;;
-		case COMMAND_CLASS_MULTI_CMD:
-			SYSLOG_DEBUG( "COMMAND_CLASS_MULTI_CMD - ");
-			break;
 		default:
 			SYSLOG_WARN( "Function not implemented - unhandled command class: %x",(unsigned char)frame[5]);
 			break;
@@ -183,13 +184,45 @@ cc_process_unimplemented_msg( const u8 *frame )
 	return 0;
 }
 
+/*
+ * MULTI_CMD_ENCAP: count, then length and bytes per command. Each command
+ * is handed to its class as if it had arrived in a frame of its own.
+ * Parsing stops at the end of the frame received, whatever its length
+ * byte claims.
+ */
+static int
+cc_process_multi_cmd( zw_api_ctx_S *ctx, const u8* frame, int length, u8 nodeid )
+{
+	u8 inner[ ZW_MAX_FRAME_SZ ];
+	int end = 5 + frame[ 4 ];
+	int off = 8;
+	int i, clen;
+
+	if ( 8 > length || MULTI_CMD_ENCAP != frame[ 6 ] ) return -1;
+	if ( end > length ) end = length;
+
+	for ( i = 0; i < frame[ 7 ] && off < end; i++ ) {
+		clen = frame[ off ];
+		if ( !clen || off + 1 + clen > end ) break;
+		memset( inner, 0, sizeof( inner ) );
+		memcpy( inner, frame, 4 );
+		inner[ 4 ] = clen;
+		memcpy( inner + 5, frame + off + 1, clen );
+		off += 1 + clen;
+		if ( COMMAND_CLASS_MULTI_CMD == inner[ 5 ] ) continue;
+		cc_process_msg( ctx, inner, 5 + clen, nodeid );
+	}
+	SYSLOG_DEBUG( "COMMAND_CLASS_MULTI_CMD - %d of %d command(s) from node %d", i, frame[ 7 ], nodeid );
+
+	return 0;
+}
+
+/* frame is length bytes, from the type byte up to the checksum */
 int
-cc_process_msg( zw_api_ctx_S *ctx, const u8* frame, u8 nodeid )
+cc_process_msg( zw_api_ctx_S *ctx, const u8* frame, int length, u8 nodeid )
 {
-	list_node *node = NULL;
 	struct cmd_class *cmd_cls = NULL;
 	int rc = -1;
-	int cls_found = 0;
 
 	switch ( frame[ 5 ] ) {
 		case COMMAND_CLASS_CONTROLLER_REPLICATION:
@@ -197,112 +230,237 @@ cc_process_msg( zw_api_ctx_S *ctx, const u8* frame, u8 nodeid )
 		case COMMAND_CLASS_VERSION:
 			rc = cc_process_generic_msg( ctx, frame );
 			goto out;
+		case COMMAND_CLASS_MULTI_CMD:
+			rc = cc_process_multi_cmd( ctx, frame, length, nodeid );
+			goto out;
 		default:
 			break;
 	}
 
-	list_foreach( node, (&cmd_classes) ) {
-		cmd_cls = (struct cmd_class *)node;
-		if ( cmd_cls->type == frame[ 5 ] ) {
-			if ( cmd_cls->process_msg )
-				rc = cmd_cls->process_msg( ctx, frame, nodeid );
-			else
-				SYSLOG_WARN( "CmdCLass: %s does not register process msg", cmd_cls->name );
-			cls_found = 1;
-			break;
-		}
-	}
-
-	if( !cls_found ) cc_process_unimplemented_msg( frame );
+	cmd_cls = cmd_classes[ frame[ 5 ] ];
+	if ( !cmd_cls )
+		cc_process_unimplemented_msg( frame );
+	else if ( cmd_cls->process_msg )
+		rc = cmd_cls->process_msg( ctx, frame, nodeid );
+	else
+		SYSLOG_WARN( "CmdCLass: %s does not register process msg", cmd_cls->name );
 out:
 	return rc;
 }
 
+static inline struct cmd_class *
+cc_find( const u8 cls_type )
+{
+	return cmd_classes[ cls_type ];
+}
+
 int
 cc_version( zw_api_ctx_S *ctx, u8 nodeid, const u8 cls_type, void *resp )
 {
-	list_node *node = NULL;
-	struct cmd_class *cmd_cls = NULL;
+	struct cmd_class *cmd_cls = cc_find( cls_type );
 	int rc = -1;
 
-	list_foreach( node, (&cmd_classes) ) {
-		cmd_cls = (struct cmd_class *)node;
-		if ( cmd_cls->type == cls_type ) {
-			if ( cmd_cls->version )
-				rc = cmd_cls->version( ctx, nodeid, resp );
-			else
-				SYSLOG_WARN( "CmdCLass: %s does not register version", cmd_cls->name );
-			break;
+	if ( !cmd_cls ) goto out;
+
+	if ( cmd_cls->version )
+		rc = cmd_cls->version( ctx, nodeid, resp );
+	else
+		SYSLOG_WARN( "CmdCLass: %s does not register version", cmd_cls->name );
+out:
+	return rc;
+}
+
+/*
+ * Single flight: while a get for the same report from the node is still
+ * pending, further gets share its future instead of going on the air
+ * again. cc_lock makes the lookup and the send one step.
+ */
+zw_future_S *
+cc_get_async( zw_api_ctx_S *ctx, u8 nodeid, const u8 cls_type )
+{
+	struct cmd_class *cmd_cls = cc_find( cls_type );
+	zw_future_S *fut;
+
+	if ( !cmd_cls ) return NULL;
+	if ( !cmd_cls->get_async ) {
+		SYSLOG_WARN( "CmdCLass: %s does not register get_async", cmd_cls->name );
+		return NULL;
+	}
+
+	pthread_mutex_lock( &ctx->cc_lock );
+	fut = zw_waiters_find( &ctx->waiters, nodeid, cls_type, cmd_cls->report_cmd );
+	if ( fut ) {
+		ctx->cc_stats.coalesced++;
+		SYSLOG_DEBUG( "%s get for node %d joins the one in flight", cmd_cls->name, nodeid );
+	}
+	else {
+		fut = cmd_cls->get_async( ctx, nodeid );
+		if ( fut ) {
+			zw_waiters_share( &ctx->waiters, fut );
+			ctx->cc_stats.gets++;
 		}
 	}
-	return rc;
+	pthread_mutex_unlock( &ctx->cc_lock );
+
+	return fut;
+}
+
+void
+cc_get_stats( zw_api_ctx_S *ctx, struct zw_cc_stats *stats )
+{
+	pthread_mutex_lock( &ctx->cc_lock );
+	*stats = ctx->cc_stats;
+	pthread_mutex_unlock( &ctx->cc_lock );
 }
 
+/*
+ * A get queued before a set may report the old value, so gets issued
+ * after the set must not join it.
+ */
+zw_future_S *
+cc_set_async( zw_api_ctx_S *ctx, u8 nodeid, const u8 cls_type, void *val )
+{
+	struct cmd_class *cmd_cls = cc_find( cls_type );
+	zw_future_S *fut;
+
+	if ( !cmd_cls ) return NULL;
+	if ( !cmd_cls->set_async ) {
+		SYSLOG_WARN( "CmdCLass: %s does not register set_async", cmd_cls->name );
+		return NULL;
+	}
+
+	pthread_mutex_lock( &ctx->cc_lock );
+	zw_waiters_unshare( &ctx->waiters, nodeid, cls_type, cmd_cls->report_cmd );
+	fut = cmd_cls->set_async( ctx, nodeid, val );
+	pthread_mutex_unlock( &ctx->cc_lock );
+
+	return fut;
+}
+
+/*
+ * One frame that sets several nodes at once: BASIC_SET in a
+ * SEND_DATA_MULTI to the count nodes in ids (up to CC_MULTICAST_MAX), or
+ * a SWITCH_ALL broadcast when broadcast is set, in which case ids lists
+ * the nodes expected to follow it. classes[ i ] is the class node ids[ i ]
+ * reports its state with; as in cc_set_async(), later gets don't join
+ * ones queued before the frame. Nodes don't acknowledge a multicast or a
+ * broadcast, so the future only tells that the controller sent it.
+ */
+zw_future_S *
+cc_set_group_async( zw_api_ctx_S *ctx, const u8 *ids, const u8 *classes, int count, int val, int broadcast )
+{
+	u8 buff[ 16 + CC_MULTICAST_MAX ];
+	struct cmd_class *cmd_cls;
+	zw_future_S *fut;
+	int len = 0;
+	int i;
+
+	if ( !broadcast && ( 0 >= count || CC_MULTICAST_MAX < count ) ) return NULL;
+
+	if ( broadcast ) {
+		buff[ len++ ] = FUNC_ID_ZW_SEND_DATA;
+		buff[ len++ ] = NODE_BROADCAST;
+		buff[ len++ ] = 2;
+		buff[ len++ ] = COMMAND_CLASS_SWITCH_ALL;
+		buff[ len++ ] = val ? SWITCH_ALL_ON : SWITCH_ALL_OFF;
+	}
+	else {
+		buff[ len++ ] = FUNC_ID_ZW_SEND_DATA_MULTI;
+		buff[ len++ ] = count;
+		memcpy( buff + len, ids, count );
+		len += count;
+		buff[ len++ ] = 3;
+		buff[ len++ ] = COMMAND_CLASS_BASIC;
+		buff[ len++ ] = BASIC_SET;
+		buff[ len++ ] = val;
+	}
+	buff[ len++ ] = TRANSMIT_OPTION_AUTO_ROUTE;
+
+	pthread_mutex_lock( &ctx->cc_lock );
+	for ( i = 0; i < count; i++ ) {
+		cmd_cls = cc_find( classes[ i ] );
+		if ( cmd_cls )
+			zw_waiters_unshare( &ctx->waiters, ids[ i ], classes[ i ], cmd_cls->report_cmd );
+	}
+	fut = zw_send_request_async( ctx, buff, len, broadcast ? NODE_BROADCAST : 0, RESP_REQ,
+				     buff[ 0 ], 0, 0 );
+	pthread_mutex_unlock( &ctx->cc_lock );
+
+	return fut;
+}
+
+/* Blocks until the report comes in, up to CC_GET_TIMEOUT_MS */
 int
 cc_get( zw_api_ctx_S *ctx, u8 nodeid, const u8 cls_type, void *resp )
 {
-	list_node *node = NULL;
-	struct cmd_class *cmd_cls = NULL;
+	struct cmd_class *cmd_cls = cc_find( cls_type );
+	zw_future_S *fut;
 	int rc = -1;
 
-	list_foreach( node, (&cmd_classes) ) {
-		cmd_cls = (struct cmd_class *)node;
-		if ( cmd_cls->type == cls_type ) {
-			if ( cmd_cls->get )
-				rc = cmd_cls->get( ctx, nodeid, resp );
-			else
-				SYSLOG_WARN( "CmdCLass: %s does not register get", cmd_cls->name );
-			break;
-		}
+	if ( !cmd_cls ) goto out;
+
+	if ( cmd_cls->get_async ) {
+		fut = cc_get_async( ctx, nodeid, cls_type );
+		if ( !fut ) goto out;
+		rc = zw_future_wait( fut, CC_GET_TIMEOUT_MS, (int *)resp );
+		zw_future_put( fut );
 	}
+	else if ( cmd_cls->get )
+		rc = cmd_cls->get( ctx, nodeid, resp );
+	else
+		SYSLOG_WARN( "CmdCLass: %s does not register get", cmd_cls->name );
+out:
 	return rc;
 }
 
+/*
+ * Queues the command and returns without waiting for it to go out. Goes
+ * through cc_set_async() so that later gets don't join earlier ones.
+ */
 int
 cc_set( zw_api_ctx_S *ctx, u8 nodeid, const u8 cls_type, void *val )
 {
-	list_node *node = NULL;
-	struct cmd_class *cmd_cls = NULL;
+	struct cmd_class *cmd_cls = cc_find( cls_type );
+	zw_future_S *fut;
 	int rc = -1;
 
-	list_foreach( node, (&cmd_classes) ) {
-		cmd_cls = (struct cmd_class *)node;
-		if ( cmd_cls->type == cls_type ) {
-			if ( cmd_cls->set )
-				rc = cmd_cls->set( ctx, nodeid, val );
-			else
-				SYSLOG_WARN( "CmdCLass: %s does not register set", cmd_cls->name );
-			break;
-		}
+	if ( !cmd_cls ) goto out;
+
+	if ( cmd_cls->set_async ) {
+		fut = cc_set_async( ctx, nodeid, cls_type, val );
+		if ( !fut ) goto out;
+		zw_future_put( fut );
+		rc = 0;
 	}
+	else if ( cmd_cls->set )
+		rc = cmd_cls->set( ctx, nodeid, val );
+	else
+		SYSLOG_WARN( "CmdCLass: %s does not register set", cmd_cls->name );
+out:
 	return rc;
 }
 
 int
 cc_report( zw_api_ctx_S *ctx, u8 nodeid, const u8 cls_type, void *resp )
 {
-	list_node *node = NULL;
-	struct cmd_class *cmd_cls = NULL;
-	int rc = -1;
+	struct cmd_class *cmd_cls = cc_find( cls_type );
 
-	list_foreach( node, (&cmd_classes) ) {
-		cmd_cls = (struct cmd_class *)node;
-		if ( cmd_cls->type == cls_type ) {
-			if ( cmd_cls->report )
-				rc = cmd_cls->report( ctx, nodeid, resp );
-			else
-				SYSLOG_WARN( "CmdCLass: %s does not register report", cmd_cls->name );
-			break;
-		}
-	}
-	return rc;
+	if ( !cmd_cls ) return -1;
+	if ( cmd_cls->report )
+		return cmd_cls->report( ctx, nodeid, resp );
+
+	return cc_get( ctx, nodeid, cls_type, resp );
 }
 
+/* Registration runs from the module constructors, before any frame */
 int 
 register_cmd_class( struct cmd_class *ccls )
 {
 	int rc = 1;
-	list_add((list_node *)&cmd_classes, (list_node *)ccls);
+
+	if ( cmd_classes[ ccls->type ] )
+		SYSLOG_WARN( "CmdClass: %s replaces %s", ccls->name, cmd_classes[ ccls->type ]->name );
+	cmd_classes[ ccls->type ] = ccls;
 	print_cmd_classes();
 	return rc;
 }
@@ -311,7 +469,9 @@ int
 unregister_cmd_class( struct cmd_class *ccls)
 {
 	int rc = 1;
-	list_remove((list_node *)&cmd_classes, (list_node *)ccls);
+
+	if ( cmd_classes[ ccls->type ] == ccls )
+		cmd_classes[ ccls->type ] = NULL;
 	print_cmd_classes();
 	return rc;
 }
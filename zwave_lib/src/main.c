@@ -30,9 +30,17 @@
 #include "zw_api.h"
 #include "zw_node.h"
 
-int main( )
+#ifdef __MACH__
+#define DEFAULT_PORT	"/dev/tty.SLAB_USBtoUART"
+#else
+#define DEFAULT_PORT	"/dev/ttyUSB0"
+#endif
+
+int main( int argc, char **argv )
 {
 	zw_api_ctx_S ctx;
+	const char *port = ( argc > 1 ) ? argv[ 1 ] : DEFAULT_PORT;
+	struct zw_api_opts opts = { .capture = ( argc > 2 ) ? argv[ 2 ] : NULL };
 	int rc;
 	int val;
 	int opt;
@@ -41,18 +49,14 @@ int main( )
 	fflush(stdout);
 	print_cmd_classes();
 
-#ifdef __MACH__
-	rc = zw_api_init( "/dev/tty.SLAB_USBtoUART", &ctx );
-#else
-	rc = zw_api_init( "/dev/ttyUSB0", &ctx );
-#endif
+	rc = zw_api_init_opts( port, &ctx, &opts );
 	if ( rc ) {
 		printf("zWave API Init failed\n");
 		return 1;
 	}
 
 	sleep(3);
-	zw_list_nodes();
+	zw_list_nodes( &ctx );
 	
         do {
 
@@ -67,10 +71,11 @@ int main( )
 		printf("8. Get sensor interval\n");
                 printf("9. Exit\n");
 
-                scanf( "%d", &opt );
+                if ( EOF == scanf( "%d", &opt ) )
+			opt = 9;
                 switch( opt ) {
                 case 1:
-                        zw_list_nodes();
+                        zw_list_nodes( &ctx );
                         break;
                 case 2:
 			val = 255;
@@ -81,11 +86,11 @@ int main( )
 			zw_node_set_value( &ctx, 3, (void *)&val );
                         break;
                 case 4:
-        		zw_node_get_value( &ctx, 3, (void *)&val );
+        		zw_node_get_value( &ctx, 3, 0, (void *)&val );
 			printf("\n$$$$$$ Switch Value: %d\n", val);
                         break;
                 case 5:
-        		zw_node_get_value( &ctx, 4, (void *)&val );
+        		zw_node_get_value( &ctx, 4, 0, (void *)&val );
 			printf("\n$$$$$$ Sensor State Value: %d\n", val);
                         break;
                 case 6:
@@ -108,6 +113,9 @@ int main( )
                 }
 
         } while(opt != 9);
+
+	/* finishes the capture file too */
+	zw_api_close( &ctx );
 /*
 	sleep(3);
 	zw_node_get_value( zw_port, 3, (void *)&val );
@@ -30,162 +30,540 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <stdio.h>
-#include <termios.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <sys/ioctl.h>
 #include <stdlib.h>
-#include <sys/file.h>
 #include <string.h>
 #include <math.h>
+#include <errno.h>
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #include "zw_api.h"
+#include "zw_frame.h"
+#include "zw_transport.h"
+#include "zw_time.h"
 #include "zw_node.h"
 #include "cmd_class.h"
 #include "log.h"
 
-LIST_HEAD( msg_list );
-LIST_HEAD( ack_wait_list );
-LIST_HEAD( resp_wait_list );
-pthread_mutex_t list_lock;
+#define ZW_MAX_EVENTS		4
+#define ZW_MSG_MAX_RETRY	2
+
+#define ZW_ACK_TIMEOUT_NS	( 1600 * ZW_NSEC_PER_MSEC )	/* Serial API host spec */
+#define ZW_BYTE_TIMEOUT_NS	( 150 * ZW_NSEC_PER_MSEC )	/* between bytes of a frame, ditto */
+#define ZW_RTO_INIT_NS		( 5 * ZW_NSEC_PER_SEC )	/* until the first sample */
+#define ZW_RTO_MIN_NS		( 100 * ZW_NSEC_PER_MSEC )
+#define ZW_RTO_MAX_NS		( 5 * ZW_NSEC_PER_SEC )
+#define ZW_HOLDOFF_BASE_NS	( 1 * ZW_NSEC_PER_SEC )
+#define ZW_HOLDOFF_MAX_SHIFT	6			/* 64 seconds */
+#define ZW_REPORT_TIMEOUT_NS	( 5 * ZW_NSEC_PER_SEC )	/* after the request is written */
+#define ZW_RECONNECT_NS		( 1 * ZW_NSEC_PER_SEC )	/* between attempts to reopen the port */
+
+/* how long a message may wait before it overtakes higher priorities */
+static const u64 zw_prio_aging_ns[ ZW_PRIO_COUNT ] = {
+	[ ZW_PRIO_INTERACTIVE ]	= 0,
+	[ ZW_PRIO_NORMAL ]	= 2 * ZW_NSEC_PER_SEC,
+	[ ZW_PRIO_BACKGROUND ]	= 10 * ZW_NSEC_PER_SEC,
+};
+
+static __thread int zw_thread_prio = ZW_PRIO_NORMAL;
+
+enum {
+	ZW_EV_PORT = 1,
+	ZW_EV_WAKE,
+	ZW_EV_TIMER,
+};
 
 static int 
-zw_open_port( const char *portname, int *port )
+zw_write_port( zw_api_ctx_S *ctx, u8 *buff, const int len )
 {
-        struct termios tios;
-	int rc = -1;
+        int rc = -1;
 
-	*port = open( portname, O_RDWR | O_NOCTTY );
-        if ( *port < 0) {
-		perror( portname );
-		goto out;
-	}
- 
-        if ( flock( *port, LOCK_EX | LOCK_NB ) < 0 ) {
-		perror( portname );
-                close( *port );
-                goto out;
+        rc = zw_transport_write( &ctx->tp, buff, len );
+        if ( len != rc ) {
+		SYSLOG_FAULT( "zw_write_port: failed to queue %d bytes", len );
         }
-        tios.c_cflag = CS8 | CREAD | CLOCAL;
 
-        tios.c_cc[VMIN] = 1; 
-        tios.c_cc[VTIME] = 0;
+        return rc;
+}
 
-        cfsetispeed( &tios, BAUDRATE );
-        cfsetospeed( &tios, BAUDRATE );
+static void 
+zw_print_line( unsigned char *buff, int len )
+{
+	char line[ 3 * ZW_MAX_FRAME_SZ + 1 ];
+	int idx = 0;
 
-        tios.c_lflag = 0;
+	if ( !( setlogmask( 0 ) & LOG_MASK( LOG_DEBUG ) ) ) return;
 
-        tios.c_iflag = IGNBRK;
-        tios.c_oflag = 0;
+	line[ 0 ] = 0;
+	for ( idx = 0; idx < len && idx < ZW_MAX_FRAME_SZ; idx++ )
+		snprintf( line + 3 * idx, 4, "%02X ", buff[ idx ] );
+	SYSLOG_DEBUG( "%s", line );
+}
 
-	tcflush( *port, TCIOFLUSH );
-        if ( 0 > tcsetattr( *port, TCSANOW, &tios ) ) {
-		perror( portname );
-                close( *port );
-		goto out;
-        }
+/*
+ * Only SEND_DATA travels to the node; everything else is answered by the
+ * controller and is timed against slot 0.
+ */
+static struct zw_rtt *
+zw_rtt_get( zw_api_ctx_S *ctx, zwave_msg_S *req )
+{
+	if ( FUNC_ID_ZW_SEND_DATA != req->cmd[ 3 ] ||
+	     0 >= req->node_id || MAX_ZWAVE_NODES <= req->node_id )
+		return &ctx->rtt[ 0 ];
 
-        usleep ( 1000 );  
-	tcflush( *port, TCIOFLUSH );
-	rc = 0;
+	return &ctx->rtt[ req->node_id ];
+}
+
+static void
+zw_rtt_init( struct zw_rtt *rtt )
+{
+	memset( rtt, 0, sizeof( *rtt ) );
+	rtt->rto_ns = ZW_RTO_INIT_NS;
+}
+
+/*
+ * SRTT and RTTVAR with gains of 1/8 and 1/4 and RTO = SRTT + 4 * RTTVAR.
+ * Retransmitted requests are not sampled (Karn) since we can't tell which
+ * copy was answered, but any answer ends the backoff.
+ */
+static void
+zw_rtt_sample( zw_api_ctx_S *ctx, zwave_msg_S *req, u64 now )
+{
+	struct zw_rtt *rtt = zw_rtt_get( ctx, req );
+	u64 sample = now - req->ts_ns;
+	u64 delta;
+
+	pthread_mutex_lock( &ctx->stats_lock );
+	rtt->backoff = 0;
+	rtt->holdoff_ns = 0;
+	if ( req->retry ) goto out;
+
+	if ( !rtt->samples++ ) {
+		rtt->srtt_ns = sample;
+		rtt->rttvar_ns = sample / 2;
+	}
+	else {
+		delta = ( sample > rtt->srtt_ns ) ? sample - rtt->srtt_ns : rtt->srtt_ns - sample;
+		rtt->rttvar_ns = rtt->rttvar_ns - ( rtt->rttvar_ns >> 2 ) + ( delta >> 2 );
+		rtt->srtt_ns = rtt->srtt_ns - ( rtt->srtt_ns >> 3 ) + ( sample >> 3 );
+	}
+
+	rtt->rto_ns = rtt->srtt_ns + 4 * rtt->rttvar_ns;
+	if ( ZW_RTO_MIN_NS > rtt->rto_ns ) rtt->rto_ns = ZW_RTO_MIN_NS;
+	if ( ZW_RTO_MAX_NS < rtt->rto_ns ) rtt->rto_ns = ZW_RTO_MAX_NS;
 out:
-        return rc;
+	pthread_mutex_unlock( &ctx->stats_lock );
 }
 
+/*
+ * Double the RTO and hold the node back for 1, 2, 4 ... 64 seconds. The
+ * controller itself is never held back.
+ */
+static void
+zw_rtt_timeout( zw_api_ctx_S *ctx, zwave_msg_S *req, u64 now )
+{
+	struct zw_rtt *rtt = zw_rtt_get( ctx, req );
+	int shift;
+
+	pthread_mutex_lock( &ctx->stats_lock );
+	rtt->timeouts++;
+	rtt->rto_ns *= 2;
+	if ( ZW_RTO_MAX_NS < rtt->rto_ns ) rtt->rto_ns = ZW_RTO_MAX_NS;
+	if ( rtt != &ctx->rtt[ 0 ] ) {
+		shift = ( ZW_HOLDOFF_MAX_SHIFT < rtt->backoff ) ? ZW_HOLDOFF_MAX_SHIFT : rtt->backoff;
+		rtt->holdoff_ns = now + ( ZW_HOLDOFF_BASE_NS << shift );
+		rtt->backoff++;
+	}
+	pthread_mutex_unlock( &ctx->stats_lock );
+}
 
-static int 
-zw_read_port( int port, u8 *buff, int len, long timeout )
+/* Anything heard from a node proves it is reachable again */
+static void
+zw_rtt_node_alive( zw_api_ctx_S *ctx, u8 nodeid )
 {
-        int bytes = 0;
-        struct timeval tv;
-        fd_set fds;
-	int rc;
+	struct zw_rtt *rtt = &ctx->rtt[ nodeid ];
 
-        while ( bytes < len ) {
-                FD_ZERO( &fds );
-                FD_SET( port, &fds );
-                tv.tv_sec = 0;
-                tv.tv_usec = 100000;
+	if ( !nodeid || !rtt->backoff ) return;
 
-		rc = select( FD_SETSIZE, &fds, NULL, NULL, &tv );
-		if ( 0 > rc ) perror("zw_read_port");
-                if( 0 >= rc ) {
-                        return bytes;
-                }
+	pthread_mutex_lock( &ctx->stats_lock );
+	rtt->backoff = 0;
+	rtt->holdoff_ns = 0;
+	pthread_mutex_unlock( &ctx->stats_lock );
+}
 
-                bytes += read( port, buff + bytes, len - bytes );
-        }
+int
+zw_api_get_rtt( zw_api_ctx_S *ctx, int nodeid, struct zw_rtt *rtt )
+{
+	if ( 0 > nodeid || MAX_ZWAVE_NODES <= nodeid ) return -1;
+
+	pthread_mutex_lock( &ctx->stats_lock );
+	*rtt = ctx->rtt[ nodeid ];
+	pthread_mutex_unlock( &ctx->stats_lock );
 
-        return bytes;
+	return 0;
 }
 
-static int 
-zw_write_port( const int port, u8 *buff, const int len )
+void
+zw_api_get_pool_stats( zw_api_ctx_S *ctx, struct zw_pool_stats *msgs, struct zw_pool_stats *futs )
 {
-        int rc = -1;
+	if ( msgs ) zw_pool_get_stats( &ctx->msg_pool, msgs );
+	if ( futs ) zw_pool_get_stats( &ctx->fut_pool, futs );
+}
 
-        rc = write( port, buff, len );
-        if ( len != rc ) {
-		perror( "zw_write_port" );
-                goto out;
-        }
+void
+zw_api_set_thread_prio( int prio )
+{
+	if ( ZW_PRIO_INTERACTIVE <= prio && ZW_PRIO_COUNT > prio )
+		zw_thread_prio = prio;
+}
 
-        tcflush( port, TCIOFLUSH );
+int
+zw_api_get_prio_stats( zw_api_ctx_S *ctx, int prio, struct zw_prio_stats *stats )
+{
+	if ( ZW_PRIO_INTERACTIVE > prio || ZW_PRIO_COUNT <= prio ) return -1;
 
-out:
-        return rc;
+	pthread_mutex_lock( &ctx->stats_lock );
+	*stats = ctx->prio_stats[ prio ];
+	pthread_mutex_unlock( &ctx->stats_lock );
+
+	return 0;
 }
 
-static void 
-zw_print_line( unsigned char *buff, int len )
+/*
+ * Callback ids roll over 1..255; 0 means "no callback" to the controller.
+ * A fresh id per transaction tells a late callback from the current one.
+ */
+static u8
+zw_alloc_cbid( zw_api_ctx_S *ctx )
 {
-	int idx = 0;
-	while( idx < len ) SYSLOG_DEBUG( "%02X ", buff[ idx++ ] );
+	u8 id = ctx->next_cbid++;
+
+	if ( !ctx->next_cbid ) ctx->next_cbid = 1;
+	return id;
 }
 
-static u8 
-zw_checksum( const u8 *buff, int len )
+void
+zw_api_get_tx_stats( zw_api_ctx_S *ctx, struct zw_tx_stats *stats )
 {
-        int csum = 0xff;
-	int i;
+	pthread_mutex_lock( &ctx->stats_lock );
+	*stats = ctx->tx_stats;
+	pthread_mutex_unlock( &ctx->stats_lock );
+}
+
+/* Bytes moved and the frame -> ACK round trip of the port */
+void
+zw_api_get_transport_stats( zw_api_ctx_S *ctx, struct zw_transport_stats *stats )
+{
+	zw_transport_get_stats( &ctx->tp, stats );
+}
+
+/* Complete a future and drop the reference the waiter table held */
+static void
+zw_fut_finish( zw_api_ctx_S *ctx, zw_future_S *fut, int status, int val )
+{
+	int listed = zw_waiters_remove( &ctx->waiters, fut );
+
+	zw_future_complete( fut, status, val );
+	if ( listed ) zw_future_put( fut );
+}
+
+/* The report clock starts, or restarts on a retry, when the request is written */
+static void
+zw_fut_arm( zw_api_ctx_S *ctx, zw_future_S *fut, u64 now )
+{
+	if ( !fut || !fut->cls ) return;
+
+	zw_waiters_arm( &ctx->waiters, fut, now + ZW_REPORT_TIMEOUT_NS );
+}
+
+/*
+ * A command class decoded a report: complete every future waiting for it
+ * and cache the value, as polled if someone asked for it. Returns how
+ * many were waiting.
+ */
+int
+zw_api_report( zw_api_ctx_S *ctx, u8 nodeid, u8 cls, u8 cmd, int val )
+{
+	int waiting;
+
+	if ( !cls ) return 0;
+
+	waiting = zw_waiters_report( &ctx->waiters, nodeid, cls, cmd, val );
+	zw_node_cache_value( ctx, nodeid, cls, val, waiting ? ZW_VALUE_POLLED : ZW_VALUE_REPORT );
+
+	return waiting;
+}
+
+/*
+ * Release a message. Its future completes with status, unless the request
+ * went through and the future is still waiting for the node's report.
+ */
+static void
+zw_msg_free( zw_api_ctx_S *ctx, zwave_msg_S *req, int status )
+{
+	zw_future_S *fut = req->fut;
+	zwave_msg_S *part;
+
+	/* commands carried in a MULTI_CMD frame share its fate */
+	while ( !list_empty( &req->parts ) ) {
+		part = (zwave_msg_S *)list_pop_front( &req->parts );
+		part->tx_status = req->tx_status;
+		zw_msg_free( ctx, part, status );
+	}
+	if ( fut ) {
+		if ( status || !fut->cls )
+			zw_fut_finish( ctx, fut, status, status ? req->tx_status : TRANSMIT_COMPLETE_OK );
+		zw_future_put( fut );
+	}
+	zw_pool_put( &ctx->msg_pool, req );
+}
+
+/*
+ * A first transmission of a plain SEND_DATA to a node that takes
+ * MULTI_CMD_ENCAP, so it can carry or ride along with other commands.
+ * Wake up commands keep their own frame and encapsulation doesn't nest.
+ */
+static int
+zw_msg_batchable( zw_api_ctx_S *ctx, zwave_msg_S *req )
+{
+	u8 cls = req->cmd[ 6 ];
 
-        for( i = 0; i < len; i++ )
-		csum ^= buff[ i ];
+	if ( !req->want_cb || req->retry || FUNC_ID_ZW_SEND_DATA != req->cmd[ 3 ] || !req->cmd[ 5 ] )
+		return 0;
+	if ( 0 >= req->node_id || MAX_ZWAVE_NODES <= req->node_id || !ctx->multi_cmd[ req->node_id ] )
+		return 0;
+	if ( !list_empty( &req->parts ) )
+		return 0;
 
-        return csum;
+	return COMMAND_CLASS_WAKE_UP != cls && COMMAND_CLASS_MULTI_CMD != cls;
 }
 
+/*
+ * Oldest message of one priority whose node isn't being held back. Held
+ * messages, and batchable ones still inside their window, update the time
+ * the reader has to wake up for them, and hold back everything queued
+ * behind them for the same node so that nothing goes out of order. An
+ * interactive message doesn't wait for the window: a lone one has nothing
+ * to wait for, and a wake up flush is queued in one go.
+ */
+static zwave_msg_S *
+zw_first_eligible( zw_api_ctx_S *ctx, int prio, u64 now )
+{
+	u32 held[ MAX_ZWAVE_NODES / 32 ];
+	list_node *node = NULL;
+	zwave_msg_S *req;
+	int id;
+	u64 ready;
+
+	memset( held, 0, sizeof( held ) );
+	list_foreach( node, (&ctx->msg_list[ prio ]) ) {
+		req = (zwave_msg_S *)node;
+		id = ( 0 <= req->node_id && MAX_ZWAVE_NODES > req->node_id ) ? req->node_id : 0;
+		if ( held[ id / 32 ] & ( 1U << ( id % 32 ) ) )
+			continue;
+		ready = zw_rtt_get( ctx, req )->holdoff_ns;
+		if ( ZW_PRIO_INTERACTIVE != prio && ready < req->enq_ns + ZW_BATCH_WINDOW_NS &&
+		     zw_msg_batchable( ctx, req ) )
+			ready = req->enq_ns + ZW_BATCH_WINDOW_NS;
+		if ( ready <= now )
+			return req;
+		if ( id ) held[ id / 32 ] |= 1U << ( id % 32 );
+		if ( !ctx->next_holdoff_ns || ready < ctx->next_holdoff_ns )
+			ctx->next_holdoff_ns = ready;
+	}
+
+	return NULL;
+}
+
+/* Take a message off the send queue and account for the time it waited */
+static void
+zw_msg_dequeued( zw_api_ctx_S *ctx, zwave_msg_S *req, u64 now, int aged )
+{
+	struct zw_prio_stats *st = &ctx->prio_stats[ req->prio ];
+	u64 wait;
+
+	list_del( (list_node *)req );
+	pthread_mutex_lock( &ctx->stats_lock );
+	st->queued--;
+	if ( !req->retry ) {
+		wait = now - req->enq_ns;
+		st->sent++;
+		st->wait_total_ns += wait;
+		if ( wait > st->wait_max_ns ) st->wait_max_ns = wait;
+		st->aged += aged;
+	}
+	pthread_mutex_unlock( &ctx->stats_lock );
+}
+
+/*
+ * Fold the other commands queued for req's node into req, which becomes
+ * one MULTI_CMD_ENCAP frame: count, then length and bytes per command.
+ * The carried messages move to req->parts and finish with it. Called
+ * before the callback id is filled in.
+ */
+static void
+zw_msg_batch( zw_api_ctx_S *ctx, zwave_msg_S *req, u64 now )
+{
+	u8 payload[ ZW_MULTI_CMD_MAX ];
+	list_node *node, *next;
+	list_head *head;
+	zwave_msg_S *part;
+	int plen, clen, count, prio;
+	u8 txopt;
+
+	if ( !zw_msg_batchable( ctx, req ) ) return;
+
+	clen = req->cmd[ 5 ];
+	if ( 4 + clen > ZW_MULTI_CMD_MAX ) return;
+	payload[ 0 ] = COMMAND_CLASS_MULTI_CMD;
+	payload[ 1 ] = MULTI_CMD_ENCAP;
+	payload[ 3 ] = clen;
+	memcpy( payload + 4, req->cmd + 6, clen );
+	plen = 4 + clen;
+	count = 1;
+
+	for ( prio = ZW_PRIO_INTERACTIVE; prio < ZW_PRIO_COUNT; prio++ ) {
+		head = &ctx->msg_list[ prio ];
+		for ( node = head->next; node != head; node = next ) {
+			next = node->next;
+			part = (zwave_msg_S *)node;
+			clen = part->cmd[ 5 ];
+			if ( part->node_id != req->node_id )
+				continue;
+			/* what can't ride along keeps its place, and so does what follows it */
+			if ( plen + 1 + clen > ZW_MULTI_CMD_MAX || !zw_msg_batchable( ctx, part ) )
+				break;
+			zw_msg_dequeued( ctx, part, now, 0 );
+			list_add( &req->parts, node );
+			payload[ plen++ ] = clen;
+			memcpy( payload + plen, part->cmd + 6, clen );
+			plen += clen;
+			count++;
+		}
+	}
+	if ( 1 == count ) return;
+
+	pthread_mutex_lock( &ctx->stats_lock );
+	ctx->tx_stats.batched += count - 1;
+	pthread_mutex_unlock( &ctx->stats_lock );
+	payload[ 2 ] = count;
+	txopt = req->cmd[ 6 + req->cmd[ 5 ] ];
+	req->cmd[ 5 ] = plen;
+	memcpy( req->cmd + 6, payload, plen );
+	req->cmd[ 6 + plen ] = txopt;
+	req->cmd[ 7 + plen ] = 0;
+	req->len = 9 + plen;
+	req->cmd[ 1 ] = req->len - 2;
+}
+
+/*
+ * Move the transaction on and time what it waits for next. The ACK is
+ * the controller's alone and has a fixed limit; a response and the
+ * callback are timed against the destination's RTO.
+ */
+static void
+zw_tx_enter( zw_api_ctx_S *ctx, int state, u64 now )
+{
+	ctx->tx_state = state;
+	if ( ZW_TX_WAIT_ACK == state )
+		ctx->tx_deadline_ns = now + ZW_ACK_TIMEOUT_NS;
+	else
+		ctx->tx_deadline_ns = now + zw_rtt_get( ctx, ctx->tx )->rto_ns;
+}
+
+/* End the transaction and hand its message back to the caller */
+static zwave_msg_S *
+zw_tx_take( zw_api_ctx_S *ctx )
+{
+	zwave_msg_S *req = ctx->tx;
+
+	ctx->tx = NULL;
+	ctx->tx_state = ZW_TX_IDLE;
+	ctx->tx_deadline_ns = 0;
+	return req;
+}
+
+/*
+ * Send the next message: anything that has aged past its limit first,
+ * lowest priority first since it has waited the longest, then strictly
+ * by priority. When every queued message is held back, remember when the
+ * first one becomes eligible so the reader can sleep until then.
+ */
 static int 
-zw_send_first_message( )
+zw_send_first_message( zw_api_ctx_S *ctx )
 {
 	zwave_msg_S *req = NULL;
+	list_node *node = NULL;
+	u64 now = zw_time_ns();
+	int aged = 0;
+	int prio;
+
+	ctx->next_holdoff_ns = 0;
+	for ( prio = ZW_PRIO_COUNT - 1; !req && prio > ZW_PRIO_INTERACTIVE; prio-- ) {
+		req = zw_first_eligible( ctx, prio, now );
+		if ( req && zw_prio_aging_ns[ prio ] > now - req->enq_ns )
+			req = NULL;
+	}
+	for ( prio = ZW_PRIO_INTERACTIVE; req && prio < req->prio; prio++ )
+		aged |= !list_empty( &ctx->msg_list[ prio ] );
+	for ( prio = ZW_PRIO_INTERACTIVE; !req && prio < ZW_PRIO_COUNT; prio++ )
+		req = zw_first_eligible( ctx, prio, now );
+
+	if ( req ) {
+		ctx->next_holdoff_ns = 0;
+		zw_msg_dequeued( ctx, req, now, aged );
+		zw_msg_batch( ctx, req, now );
+	}
 
-	if ( list_empty( &msg_list ) )return 0;
+	if ( !req ) return 0;
 
-	req = (zwave_msg_S *)list_pop_front( &msg_list );
-	if ( !req ) return 1;	
+	if ( req->want_cb ) {
+		req->cbid = zw_alloc_cbid( ctx );
+		req->cmd[ req->len - 2 ] = req->cbid;
+		req->cmd[ req->len - 1 ] = zw_checksum( req->cmd + 1, req->len - 2 );
+	}
 
-	zw_write_port( req->port, req->cmd, req->len );
+	req->ts_ns = now;
+	zw_fut_arm( ctx, req->fut, now );
+	list_foreach( node, (&req->parts) )
+		zw_fut_arm( ctx, ((zwave_msg_S *)node)->fut, now );
+	zw_write_port( ctx, req->cmd, req->len );
 
-	list_add((list_node *)&ack_wait_list, (list_node *)req);
+	ctx->tx = req;
+	zw_tx_enter( ctx, ZW_TX_WAIT_ACK, now );
 
 	return 0;
 }
 
+static void
+zw_wakeup_reader( zw_api_ctx_S *ctx )
+{
+	u64 one = 1;
+
+	if ( sizeof( one ) != write( ctx->wake_fd, &one, sizeof( one ) ) && EAGAIN != errno )
+		perror( "zw_wakeup_reader" );
+}
+
 int 
 zw_send_request( zw_api_ctx_S *ctx, u8 *buff, int len, int nodeid, int resp_req, int resp_id )
+{
+	return zw_send_request_prio( ctx, buff, len, nodeid, resp_req, resp_id, ZW_PRIO_DEFAULT );
+}
+
+/* NULL with errno ENOBUFS when every message of the pool is in use */
+static zwave_msg_S *
+zw_msg_new( zw_api_ctx_S *ctx, u8 *buff, int len, int nodeid, int resp_req, int resp_id, int prio )
 {
 	zwave_msg_S *req;
 	int index = 0;
 	int i;
 
-	pthread_mutex_lock (&list_lock);
-	req = calloc( 1, sizeof( zwave_msg_S ) );
+	req = zw_pool_get( &ctx->msg_pool );
 	if ( !req ) {
-		SYSLOG_FAULT("calloc failed");
-		return 1;
+		SYSLOG_DEBUG( "message pool exhausted, request for node %d refused", nodeid );
+		return NULL;
 	}
 	req->cmd[ index++ ] = SOF;
 	req->cmd[ index++ ] = len + 2 ;
@@ -193,48 +571,436 @@ zw_send_request( zw_api_ctx_S *ctx, u8 *buff, int len, int nodeid, int resp_req,
 
 	for (i=0; i<len;i++ ) req->cmd[index++] = buff[i];
 
+	/*
+	 * SEND_DATA is func, node, n, command[n], tx options, callback id.
+	 * SEND_DATA_MULTI is func, count, node[count], n, command[n], tx
+	 * options, callback id. The callback id is filled in when the message
+	 * is written, whether or not the caller left room for it.
+	 */
+	if ( FUNC_ID_ZW_SEND_DATA == buff[ 0 ] && 3 <= len ) {
+		if ( len == 4 + buff[ 2 ] )
+			req->cmd[ index++ ] = 0, len++;
+		if ( len == 5 + buff[ 2 ] )
+			req->want_cb = 1;
+	}
+	if ( FUNC_ID_ZW_SEND_DATA_MULTI == buff[ 0 ] && 2 <= len && 3 + buff[ 1 ] <= len ) {
+		if ( len == 4 + buff[ 1 ] + buff[ 2 + buff[ 1 ] ] )
+			req->cmd[ index++ ] = 0, len++;
+		if ( len == 5 + buff[ 1 ] + buff[ 2 + buff[ 1 ] ] )
+			req->want_cb = 1;
+	}
+
+	req->cmd[ 1 ] = len + 2;
 	req->cmd[ index ] = zw_checksum( req->cmd + 1, len + 2 );
-	req->port = ctx->port;
 	req->len = len + 4;
 	req->node_id = nodeid;
 	req->resp_req = resp_req;
 	req->resp_id = resp_id;
-	req->ts = time( &req->ts );	
 	req->retry = 0;
+	req->tx_status = TRANSMIT_COMPLETE_FAIL;
+	list_init( &req->parts );
+	if ( ZW_PRIO_INTERACTIVE > prio || ZW_PRIO_COUNT <= prio )
+		prio = zw_thread_prio;
+	req->prio = prio;
+	req->enq_ns = zw_time_ns();
+
+	return req;
+}
+
+static struct zw_mailbox *
+zw_mailbox_get( zw_api_ctx_S *ctx, zwave_msg_S *req )
+{
+	if ( FUNC_ID_ZW_SEND_DATA != req->cmd[ 3 ] ||
+	     0 >= req->node_id || MAX_ZWAVE_NODES <= req->node_id )
+		return NULL;
+
+	return &ctx->mailbox[ req->node_id ];
+}
+
+/*
+ * Hold a command for a sleeping node. A command already waiting in the
+ * mailbox isn't queued twice (it takes over the future of the duplicate
+ * if it has none), and when the mailbox is full the oldest command gives
+ * way. Returns the message to release, if any.
+ */
+static zwave_msg_S *
+zw_mailbox_add( struct zw_mailbox *mbox, zwave_msg_S *req )
+{
+	list_node *node = NULL;
+	zwave_msg_S *old;
 
-	list_add((list_node *)&msg_list, (list_node *)req);
-	pthread_mutex_unlock (&list_lock);
+	list_foreach( node, (&mbox->msgs) ) {
+		old = (zwave_msg_S *)node;
+		if ( old->len != req->len || memcmp( old->cmd, req->cmd, req->len ) )
+			continue;
+		if ( old->fut && req->fut )
+			continue;
+		if ( !old->fut ) {
+			old->fut = req->fut;
+			req->fut = NULL;
+		}
+		return req;
+	}
+
+	old = NULL;
+	if ( ZW_MAILBOX_MAX <= mbox->count ) {
+		old = (zwave_msg_S *)list_pop_front( &mbox->msgs );
+		SYSLOG_WARN( "Mailbox for node %d full, dropping oldest command", old->node_id );
+		mbox->count--;
+		mbox->dropped++;
+	}
+
+	list_add((list_node *)&mbox->msgs, (list_node *)req);
+	mbox->count++;
+
+	return old;
+}
+
+/*
+ * Reader side of a submission: queue the message, or hold it in the
+ * mailbox of a sleeping node.
+ */
+static void
+zw_msg_accept( zw_api_ctx_S *ctx, zwave_msg_S *req )
+{
+	struct zw_mailbox *mbox;
+	zwave_msg_S *drop;
+
+	mbox = zw_mailbox_get( ctx, req );
+	if ( mbox && mbox->sleeping ) {
+		drop = zw_mailbox_add( mbox, req );
+		if ( drop ) zw_msg_free( ctx, drop, ECANCELED );
+		return;
+	}
+	list_add((list_node *)&ctx->msg_list[ req->prio ], (list_node *)req);
+	pthread_mutex_lock( &ctx->stats_lock );
+	ctx->prio_stats[ req->prio ].queued++;
+	pthread_mutex_unlock( &ctx->stats_lock );
+}
+
+/* Everything producers pushed since the last wake up; fails while the port is down */
+static void
+zw_drain_submissions( zw_api_ctx_S *ctx )
+{
+	zwave_msg_S *req;
+
+	__atomic_exchange_n( &ctx->submit_wake, 0, __ATOMIC_ACQ_REL );
+	while ( ( req = zw_ring_pop( &ctx->submit ) ) ) {
+		if ( ctx->port_down )
+			zw_msg_free( ctx, req, EIO );
+		else
+			zw_msg_accept( ctx, req );
+	}
+}
+
+/*
+ * Hand a new message to the reader. The ring is the only way in from
+ * other threads; only the first push after the reader last drained it
+ * pays for the wake fd.
+ */
+static int
+zw_msg_submit( zw_api_ctx_S *ctx, zwave_msg_S *req )
+{
+	if ( zw_ring_push( &ctx->submit, req ) ) {
+		SYSLOG_DEBUG( "submission ring full, request for node %d refused", req->node_id );
+		zw_msg_free( ctx, req, ENOBUFS );
+		errno = ENOBUFS;
+		return -1;
+	}
+	if ( !__atomic_exchange_n( &ctx->submit_wake, 1, __ATOMIC_ACQ_REL ) )
+		zw_wakeup_reader( ctx );
 
 	return 0;
 }
 
-static void 
-zw_purge_first_resp_wait_list( u8 resp_id )
+/*
+ * Returns 0 once the request is queued, 1 when it can't be: the context
+ * is offline, or errno is ENOBUFS because the message pool is used up.
+ */
+int
+zw_send_request_prio( zw_api_ctx_S *ctx, u8 *buff, int len, int nodeid, int resp_req, int resp_id, int prio )
 {
-	zwave_msg_S *req = NULL;
-	if ( list_empty( &resp_wait_list ) ) {
-		SYSLOG_FAULT("FATAL: No msgs in resp wait Q");
-		goto out;
+	zwave_msg_S *req;
+
+	if ( ctx->offline ) {
+		ctx->offline_sends++;
+		return 1;
 	}
 
-	req = (zwave_msg_S *)list_front( &resp_wait_list );
-	if ( !req ) { 
-		SYSLOG_FAULT("FATAL: Failed to pop msg from the resp wait Q");
-		goto out;
+	req = zw_msg_new( ctx, buff, len, nodeid, resp_req, resp_id, prio );
+	if ( !req || zw_msg_submit( ctx, req ) ) return 1;
+
+	return 0;
+}
+
+/*
+ * Queue a request and return a future for it, or NULL on failure. With
+ * report_cls set the future completes with the value of the report the
+ * node sends back, otherwise with the transmit status. The caller owns a
+ * reference and drops it with zw_future_put(). errno is ENOBUFS when the
+ * message or future pool is used up: too much is queued, back off.
+ */
+zw_future_S *
+zw_send_request_async( zw_api_ctx_S *ctx, u8 *buff, int len, int nodeid, int resp_req, int resp_id,
+		       u8 report_cls, u8 report_cmd )
+{
+	zwave_msg_S *req;
+	zw_future_S *fut;
+
+	if ( ctx->offline ) {
+		ctx->offline_sends++;
+		return NULL;
+	}
+
+	fut = zw_future_new( ctx, nodeid, report_cls, report_cmd );
+	if ( !fut ) return NULL;
+
+	req = zw_msg_new( ctx, buff, len, nodeid, resp_req, resp_id, ZW_PRIO_DEFAULT );
+	if ( !req ) {
+		zw_future_put( fut );
+		return NULL;
+	}
+
+	req->fut = zw_future_get( fut );
+	if ( report_cls )
+		zw_waiters_add( &ctx->waiters, fut );
+
+	if ( zw_msg_submit( ctx, req ) ) {
+		zw_future_put( fut );
+		errno = ENOBUFS;
+		return NULL;
+	}
+
+	return fut;
+}
+
+/* Reader thread only, like the other per-node transmit state */
+void
+zw_api_set_sleeping( zw_api_ctx_S *ctx, int nodeid, int sleeping )
+{
+	if ( 0 >= nodeid || MAX_ZWAVE_NODES <= nodeid ) return;
+
+	ctx->mailbox[ nodeid ].sleeping = sleeping;
+}
+
+/* Set from the node information frame, see zw_msg_batch(); reader only */
+void
+zw_api_set_multi_cmd( zw_api_ctx_S *ctx, int nodeid, int supported )
+{
+	if ( 0 >= nodeid || MAX_ZWAVE_NODES <= nodeid ) return;
+
+	ctx->multi_cmd[ nodeid ] = !!supported;
+}
+
+/*
+ * The node is awake: put everything held for it, followed by buff
+ * (normally WAKE_UP_NO_MORE_INFORMATION), at the very front of the send
+ * queue so it goes out back to back while the radio is on. Called by the
+ * reader when it decodes the WAKE_UP_NOTIFICATION.
+ */
+int
+zw_api_wakeup_flush( zw_api_ctx_S *ctx, int nodeid, u8 *buff, int len )
+{
+	struct zw_mailbox *mbox;
+	zwave_msg_S *last;
+	list_node *node = NULL;
+	list_head batch;
+	u32 count;
+
+	if ( ctx->offline ) {
+		ctx->offline_sends++;
+		return 1;
+	}
+
+	/* the wake up handler has just submitted its GETs; file them first */
+	zw_drain_submissions( ctx );
+
+	last = zw_msg_new( ctx, buff, len, nodeid, RESP_REQ, FUNC_ID_ZW_SEND_DATA, ZW_PRIO_INTERACTIVE );
+	if ( !last ) return 1;
+
+	list_init( &batch );
+	mbox = zw_mailbox_get( ctx, last );
+	count = 0;
+	if ( mbox ) {
+		list_splice_head( &batch, &mbox->msgs );
+		count = mbox->count;
+		mbox->count = 0;
+	}
+	list_add( &batch, (list_node *)last );
+	list_foreach( node, (&batch) ) {
+		((zwave_msg_S *)node)->prio = ZW_PRIO_INTERACTIVE;
+		((zwave_msg_S *)node)->enq_ns = last->enq_ns;
 	}
+	list_splice_head( &ctx->msg_list[ ZW_PRIO_INTERACTIVE ], &batch );
+	pthread_mutex_lock( &ctx->stats_lock );
+	ctx->prio_stats[ ZW_PRIO_INTERACTIVE ].queued += count + 1;
+	pthread_mutex_unlock( &ctx->stats_lock );
+
+	SYSLOG_DEBUG( "Node %d awake, sending %u held commands", nodeid, count );
+
+	return 0;
+}
+
+static const char *zw_tx_state_names[] = {
+	[ ZW_TX_IDLE ]		= "idle",
+	[ ZW_TX_WAIT_ACK ]	= "ACK",
+	[ ZW_TX_WAIT_RESP ]	= "response",
+	[ ZW_TX_WAIT_CB ]	= "callback",
+};
 
-	if ( req->resp_id == resp_id ) {
-		list_remove( &resp_wait_list, (list_node *)req );
-		free( req );
+static void
+zw_tx_drop( zw_api_ctx_S *ctx, zwave_msg_S *req )
+{
+	SYSLOG_FAULT( "Trashing message; retry(%d)", req->retry);
+	zw_msg_free( ctx, req, EIO );
+}
+
+/*
+ * Queue a message that failed on the wire again, or drop it once it is
+ * out of retries. It must already have been taken off tx.
+ */
+static void
+zw_retry_or_drop( zw_api_ctx_S *ctx, zwave_msg_S *req )
+{
+	if ( ZW_MSG_MAX_RETRY <= req->retry ) {
+		zw_tx_drop( ctx, req );
+		return;
 	}
+
+	req->cbid = 0;
+	req->retry++;
+	SYSLOG_WARN( "Requeuing message");
+	list_add((list_node *)&ctx->msg_list[ req->prio ], (list_node *)req);
+	pthread_mutex_lock( &ctx->stats_lock );
+	ctx->prio_stats[ req->prio ].queued++;
+	pthread_mutex_unlock( &ctx->stats_lock );
+}
+
+static void
+zw_tx_done( zw_api_ctx_S *ctx, zwave_msg_S *req )
+{
+	zw_rtt_sample( ctx, req, zw_time_ns() );
+	zw_msg_free( ctx, req, 0 );
+}
+
+/* WAIT_ACK: the controller took the frame */
+static void
+zw_tx_on_ack( zw_api_ctx_S *ctx )
+{
+	zwave_msg_S *req = ctx->tx;
+
+	SYSLOG_DEBUG( "ACK received" );
+	zw_transport_ack( &ctx->tp );
+	if ( ZW_TX_WAIT_ACK != ctx->tx_state ) {
+		SYSLOG_DEBUG( "ACK while %s", zw_tx_state_names[ ctx->tx_state ] );
+		return;
+	}
+
+	if ( req->resp_req )
+		zw_tx_enter( ctx, ZW_TX_WAIT_RESP, zw_time_ns() );
+	else if ( req->cbid )
+		zw_tx_enter( ctx, ZW_TX_WAIT_CB, zw_time_ns() );
 	else
-		SYSLOG_DEBUG("Not purging wait Q: Response ID did not match");
-out:
-	return;
+		zw_tx_done( ctx, zw_tx_take( ctx ) );
+}
+
+/*
+ * WAIT_ACK: the controller refused the frame (NAK) or was sending one of
+ * its own (CAN). Write it again rather than wait out the ACK timeout.
+ */
+static void
+zw_tx_on_nak( zw_api_ctx_S *ctx, const char *what )
+{
+	SYSLOG_DEBUG( "%s received", what );
+	if ( ZW_TX_WAIT_ACK != ctx->tx_state ) return;
+
+	zw_retry_or_drop( ctx, zw_tx_take( ctx ) );
+}
+
+/*
+ * WAIT_RESP: a response only completes the request waiting for exactly
+ * that function. An accepted SEND_DATA then waits for its callback.
+ */
+static void
+zw_tx_on_response( zw_api_ctx_S *ctx, u8 *frame )
+{
+	zwave_msg_S *req = ctx->tx;
+
+	if ( ZW_TX_WAIT_RESP != ctx->tx_state ) {
+		SYSLOG_DEBUG("Unsolicited response 0x%x", frame[1]);
+		return;
+	}
+	if ( req->resp_id != frame[1] ) {
+		SYSLOG_DEBUG("Response 0x%x does not match pending 0x%x", frame[1], req->resp_id);
+		return;
+	}
+
+	if ( !req->cbid ) {
+		zw_tx_done( ctx, zw_tx_take( ctx ) );
+		return;
+	}
+
+	if ( !frame[2] ) {
+		SYSLOG_WARN( "SEND_DATA to node %d rejected by the controller", req->node_id );
+		pthread_mutex_lock( &ctx->stats_lock );
+		ctx->tx_stats.failed++;
+		pthread_mutex_unlock( &ctx->stats_lock );
+		zw_retry_or_drop( ctx, zw_tx_take( ctx ) );
+		return;
+	}
+
+	zw_tx_enter( ctx, ZW_TX_WAIT_CB, zw_time_ns() );
 }
 
+/*
+ * WAIT_CB: SEND_DATA callback, [ func, callback id, transmit status ].
+ * An id other than the one in flight is left over from a transaction we
+ * already gave up on.
+ */
 static void
-zw_process_resp_FUNC_ID_ZW_GET_SUC_NODE_ID( zw_api_ctx_S *ctx, u8 *frame )
+zw_tx_on_callback( zw_api_ctx_S *ctx, u8 cbid, u8 status )
+{
+	zwave_msg_S *req = ctx->tx;
+
+	if ( !req || !req->cbid || req->cbid != cbid ) {
+		SYSLOG_DEBUG( "Callback %d for no pending transaction", cbid );
+		pthread_mutex_lock( &ctx->stats_lock );
+		ctx->tx_stats.late_callbacks++;
+		pthread_mutex_unlock( &ctx->stats_lock );
+		return;
+	}
+
+	zw_tx_take( ctx );
+	req->tx_status = status;
+
+	pthread_mutex_lock( &ctx->stats_lock );
+	if ( TRANSMIT_COMPLETE_OK == status )
+		ctx->tx_stats.ok++;
+	else if ( TRANSMIT_COMPLETE_NO_ACK == status )
+		ctx->tx_stats.no_ack++;
+	else
+		ctx->tx_stats.failed++;
+	pthread_mutex_unlock( &ctx->stats_lock );
+
+	if ( TRANSMIT_COMPLETE_OK == status ) {
+		zw_tx_done( ctx, req );
+		return;
+	}
+
+	SYSLOG_WARN( "SEND_DATA to node %d failed, transmit status %d", req->node_id, status );
+	zw_rtt_timeout( ctx, req, zw_time_ns() );
+	zw_retry_or_drop( ctx, req );
+}
+
+/*
+ * Handlers for frames from the controller, one table per frame type
+ * indexed by the function id and filled in at compile time. A response
+ * handler runs before the response is matched against the transaction.
+ */
+typedef void (*zw_frame_fn)( zw_api_ctx_S *ctx, u8 *frame, int length );
+
+static void
+zw_process_resp_FUNC_ID_ZW_GET_SUC_NODE_ID( zw_api_ctx_S *ctx, u8 *frame, int length )
 {
 	u8 buff[512];
 
@@ -260,7 +1026,7 @@ zw_process_resp_FUNC_ID_ZW_GET_SUC_NODE_ID( zw_api_ctx_S *ctx, u8 *frame )
 }
 
 static void
-zw_process_resp_FUNC_ID_SERIAL_API_GET_INIT_DATA( zw_api_ctx_S *ctx, u8 *frame )
+zw_process_resp_FUNC_ID_SERIAL_API_GET_INIT_DATA( zw_api_ctx_S *ctx, u8 *frame, int length )
 {
 	u8 buff[512];
 	if (frame[4] == MAGIC_LEN) {
@@ -272,7 +1038,7 @@ zw_process_resp_FUNC_ID_SERIAL_API_GET_INIT_DATA( zw_api_ctx_S *ctx, u8 *frame )
 					buff[0]=FUNC_ID_ZW_GET_NODE_PROTOCOL_INFO;
 					buff[1]=nodeid;
 					SYSLOG_INFO("Requesting protocol info for: %d", nodeid);
-					create_zw_node( nodeid );
+					create_zw_node( ctx, nodeid );
 					zw_send_request( ctx, buff , 2, nodeid, RESP_REQ, FUNC_ID_ZW_GET_NODE_PROTOCOL_INFO );
 				}
 			}
@@ -281,23 +1047,19 @@ zw_process_resp_FUNC_ID_SERIAL_API_GET_INIT_DATA( zw_api_ctx_S *ctx, u8 *frame )
 }
 
 static void
-zw_process_resp_FUNC_ID_ZW_GET_NODE_PROTOCOL_INFO( zw_api_ctx_S *ctx, u8 *frame )
+zw_process_resp_FUNC_ID_ZW_GET_NODE_PROTOCOL_INFO( zw_api_ctx_S *ctx, u8 *frame, int length )
 {
 	// test if node is valid
 	if (frame[6] != 0) {
 
 		zwave_msg_S *req = NULL;
-		if ( list_empty( &resp_wait_list ) )
+		if ( ZW_TX_WAIT_RESP != ctx->tx_state )
 		{
-			SYSLOG_FAULT("FATAL: No msgs in resp wait Q");
+			SYSLOG_FAULT("FATAL: No request waiting for the response");
 		}
 		else {
-			req = (zwave_msg_S *)list_front( &resp_wait_list );
-			if ( !req ) {
-				SYSLOG_FAULT("FATAL: Failed to get msg from the resp wait Q");
-			}
-			else
-				register_zw_node( ctx, frame, req->node_id );
+			req = ctx->tx;
+			register_zw_node( ctx, frame, req->node_id );
 		}
 
 		if (((unsigned char)frame[2]) & (0x01 << 7)) {
@@ -314,392 +1076,566 @@ zw_process_resp_FUNC_ID_ZW_GET_NODE_PROTOCOL_INFO( zw_api_ctx_S *ctx, u8 *frame
 		if (((unsigned char)frame[3]) & (0x01 << 5)) {
 			SYSLOG_DEBUG( "250ms frequent listening slave");
 		}
-		switch (frame[5]) {
-			case BASIC_TYPE_CONTROLLER:
-				printf( "BASIC TYPE: Controller");
-				break;
-			;;
-			case BASIC_TYPE_STATIC_CONTROLLER:
-				printf( "BASIC TYPE: Static Controller");
-				break;
-			;;
-			case BASIC_TYPE_SLAVE:
-				printf( "BASIC TYPE: Slave");
-				break;
-			;;
-			case BASIC_TYPE_ROUTING_SLAVE:
-				printf( "BASIC TYPE: Routing Slave");
-				break;
-			;;
-			default:
-				printf( "BASIC TYPE: %x",frame[5]);
-				break;
-			;;
-		}
-		switch ((unsigned char)frame[6]) {
-			case GENERIC_TYPE_GENERIC_CONTROLLER:
-				printf( "GENERIC TYPE: Generic Controller");
-				break;
-			;;
-			case GENERIC_TYPE_STATIC_CONTROLLER:
-				printf( "GENERIC TYPE: Static Controller");
-				break;
-			;;
-			case GENERIC_TYPE_THERMOSTAT:
-				printf( "GENERIC TYPE: Thermostat");
-				break;
-			;;
-			case GENERIC_TYPE_SWITCH_MULTILEVEL:
-				printf( "GENERIC TYPE: Multilevel Switch");
-				break;
-			;;
-			case GENERIC_TYPE_SWITCH_REMOTE:
-				printf( "GENERIC TYPE: Remote Switch");
-				break;
-			;;
-			case GENERIC_TYPE_SWITCH_BINARY:
-				printf( "GENERIC TYPE: Binary Switch");
-				break;
-			;;
-			case GENERIC_TYPE_SENSOR_BINARY:
-				printf( "GENERIC TYPE: Sensor Binary");
-				break;
-			case GENERIC_TYPE_WINDOW_COVERING:
-				printf( "GENERIC TYPE: Window Covering");
-				break;
-			;;
-			case GENERIC_TYPE_SENSOR_MULTILEVEL:
-				printf( "GENERIC TYPE: Sensor Multilevel");
-				break;
-			;;
-			case GENERIC_TYPE_SENSOR_ALARM:
-				printf( "GENERIC TYPE: Sensor Alarm");
-				break;
-			;;
-			default:
-				printf( "GENERIC TYPE: 0x%x",frame[6]);
-				break;
-			;;
-
-		}
-		printf( "SPECIFIC TYPE: 0x%x",frame[7]);
+		SYSLOG_DEBUG( "BASIC TYPE: 0x%x GENERIC TYPE: 0x%x SPECIFIC TYPE: 0x%x",
+			      frame[5], frame[6], frame[7] );
 
 	} else {
-		printf("Invalid generic class (0x%x), ignoring device",(unsigned char)frame[6]);
+		SYSLOG_DEBUG("Invalid generic class (0x%x), ignoring device",(unsigned char)frame[6]);
 	}
 
 }
 
+static void
+zw_process_resp_ZW_MEMORY_GET_ID( zw_api_ctx_S *ctx, u8 *frame, int length )
+{
+	SYSLOG_INFO( "Home id: 0x%02x%02x%02x%02x, our node id: %d",
+		     frame[2], frame[3], frame[4], frame[5], frame[6] );
+	ctx->node_id = frame[ 6 ];
+}
+
+static void
+zw_process_resp_FUNC_ID_SERIAL_API_GET_CAPABILITIES( zw_api_ctx_S *ctx, u8 *frame, int length )
+{
+	SYSLOG_INFO( "SerAppV:%i,r%i,Manf %i,Typ %i,Prod %i", frame[2], frame[3],
+		     ( frame[4] << 8 ) + frame[5], ( frame[6] << 8 ) + frame[7], ( frame[8] << 8 ) + frame[9] );
+}
+
+static void
+zw_process_resp_ZW_GET_VERSION( zw_api_ctx_S *ctx, u8 *frame, int length )
+{
+	SYSLOG_INFO( "ZWave Version: %c.%c%c", frame[9], frame[11], frame[12] );
+}
+
+/* SEND_DATA and SEND_DATA_MULTI callback: [ func, callback id, status ] */
+static void
+zw_process_req_FUNC_ID_ZW_SEND_DATA( zw_api_ctx_S *ctx, u8 *frame, int length )
+{
+	zw_tx_on_callback( ctx, frame[2], frame[3] );
+}
+
+static void
+zw_process_req_FUNC_ID_APPLICATION_COMMAND_HANDLER( zw_api_ctx_S *ctx, u8 *frame, int length )
+{
+	zw_rtt_node_alive( ctx, frame[3] );
+	if ( COMMAND_CLASS_WAKE_UP == frame[5] )
+		zw_node_wakeup_handler( ctx, frame[3] );
+
+	cc_process_msg( ctx, frame, length, frame[3] );
+}
+
+static void
+zw_process_req_FUNC_ID_ZW_APPLICATION_UPDATE( zw_api_ctx_S *ctx, u8 *frame, int length )
+{
+	u8 tempbuf[512];
+	int multi, i;
+
+	switch((unsigned char)frame[2]) {
+		case UPDATE_STATE_NODE_INFO_RECEIVED:
+			SYSLOG_DEBUG( "FUNC_ID_ZW_APPLICATION_UPDATE:UPDATE_STATE_NODE_INFO_RECEIVED received from node %d",(unsigned int)frame[3]);
+			/* basic, generic and specific type, then the supported classes */
+			multi = 0;
+			for ( i = 8; i < 5 + frame[ 4 ] && i < length; i++ )
+				multi |= ( COMMAND_CLASS_MULTI_CMD == frame[ i ] );
+			zw_api_set_multi_cmd( ctx, frame[ 3 ], multi );
+			switch((unsigned char)frame[5]) {
+				case BASIC_TYPE_ROUTING_SLAVE:
+				case BASIC_TYPE_SLAVE:
+					switch(frame[6]) {
+						case GENERIC_TYPE_SWITCH_MULTILEVEL:
+							tempbuf[0] = FUNC_ID_ZW_SEND_DATA;
+							tempbuf[1] = frame[3];
+							tempbuf[2] = 0x02;
+							tempbuf[3] = COMMAND_CLASS_SWITCH_MULTILEVEL;
+							tempbuf[4] = SWITCH_MULTILEVEL_GET;
+							tempbuf[5] = TRANSMIT_OPTION_ACK | TRANSMIT_OPTION_AUTO_ROUTE;
+							zw_send_request ( ctx, tempbuf, 6, frame[3], RESP_REQ, FUNC_ID_ZW_SEND_DATA );
+							tempbuf[0] = FUNC_ID_ZW_SEND_DATA;
+							tempbuf[1] = frame[3];
+							tempbuf[2] = 0x02;
+							tempbuf[3] = COMMAND_CLASS_BASIC;
+							tempbuf[4] = BASIC_GET;
+							tempbuf[5] = TRANSMIT_OPTION_ACK | TRANSMIT_OPTION_AUTO_ROUTE;
+							zw_send_request( ctx, tempbuf,6, frame[3], RESP_REQ, FUNC_ID_ZW_SEND_DATA );
+							break;
+						case GENERIC_TYPE_SWITCH_BINARY:
+							tempbuf[0] = FUNC_ID_ZW_SEND_DATA;
+							tempbuf[1] = frame[3];
+							tempbuf[2] = 0x02;
+							tempbuf[3] = COMMAND_CLASS_BASIC;
+							tempbuf[4] = BASIC_GET;
+							tempbuf[5] = TRANSMIT_OPTION_ACK | TRANSMIT_OPTION_AUTO_ROUTE;
+							zw_send_request( ctx, tempbuf, 6, frame[3], RESP_REQ, FUNC_ID_ZW_SEND_DATA );
+							break;
+						default:
+							break;
+						;;
+					}
+				default:
+					break;
+				;;
+			}
+			break;
+		case UPDATE_STATE_NODE_INFO_REQ_FAILED:
+			SYSLOG_DEBUG( "FUNC_ID_ZW_APPLICATION_UPDATE:UPDATE_STATE_NODE_INFO_REQ_FAILED received");
+			break;
+	        case UPDATE_STATE_NEW_ID_ASSIGNED:
+			SYSLOG_INFO( "** Network change **: ID %d was assigned to a new Z-Wave node",(unsigned char)frame[3]);
+			break;
+		case UPDATE_STATE_DELETE_DONE:
+			SYSLOG_INFO( "** Network change **: Z-Wave node %d was removed",(unsigned char)frame[3]);
+			break;
+		;;
+		default:
+			break;
+		;;
+	}
+}
+
+static const zw_frame_fn zw_resp_handlers[ 256 ] = {
+	[ FUNC_ID_ZW_GET_SUC_NODE_ID ]		= zw_process_resp_FUNC_ID_ZW_GET_SUC_NODE_ID,
+	[ ZW_MEMORY_GET_ID ]			= zw_process_resp_ZW_MEMORY_GET_ID,
+	[ FUNC_ID_SERIAL_API_GET_INIT_DATA ]	= zw_process_resp_FUNC_ID_SERIAL_API_GET_INIT_DATA,
+	[ FUNC_ID_ZW_GET_NODE_PROTOCOL_INFO ]	= zw_process_resp_FUNC_ID_ZW_GET_NODE_PROTOCOL_INFO,
+	[ FUNC_ID_SERIAL_API_GET_CAPABILITIES ]	= zw_process_resp_FUNC_ID_SERIAL_API_GET_CAPABILITIES,
+	[ ZW_GET_VERSION ]			= zw_process_resp_ZW_GET_VERSION,
+};
+
+static const zw_frame_fn zw_req_handlers[ 256 ] = {
+	[ FUNC_ID_ZW_SEND_DATA ]		= zw_process_req_FUNC_ID_ZW_SEND_DATA,
+	[ FUNC_ID_ZW_SEND_DATA_MULTI ]		= zw_process_req_FUNC_ID_ZW_SEND_DATA,
+	[ FUNC_ID_APPLICATION_COMMAND_HANDLER ]	= zw_process_req_FUNC_ID_APPLICATION_COMMAND_HANDLER,
+	[ FUNC_ID_ZW_APPLICATION_UPDATE ]	= zw_process_req_FUNC_ID_ZW_APPLICATION_UPDATE,
+};
+
 void 
 zw_process_frame( zw_api_ctx_S *ctx, u8 *frame, int length )
 {
-	u8 tempbuf[512];
+	zw_frame_fn fn;
 
-	if (frame[0] == RESPONSE) {
-		switch ((unsigned char)frame[1]) {
-			case FUNC_ID_ZW_GET_SUC_NODE_ID:
-				printf("\nGot reply to GET_SUC_NODE_ID, node: %d",frame[2]);
-				zw_process_resp_FUNC_ID_ZW_GET_SUC_NODE_ID( ctx, frame );
-				break;
-			;;
-			case ZW_GET_ROUTING_INFO:
-				printf("\nGot reply to ZW_GET_ROUTING_INFO:");
-				break;
-			;;
-			case ZW_MEMORY_GET_ID:
-				printf("\nGot reply to ZW_MEMORY_GET_ID:");
-				printf("\nHome id: 0x%02x%02x%02x%02x, our node id: %d",(unsigned char) frame[2],(unsigned char) frame[3],(unsigned char)frame[4],(unsigned char)frame[5],(unsigned char)frame[6]);
-				ctx->node_id = frame[ 6 ];
-				break;
-			;;
-			case ZW_MEM_GET_BUFFER:
-				printf("\nGot reply to ZW_MEM_GET_BUFFER");
-				break;
-			;;
-			case ZW_MEM_PUT_BUFFER:
-				printf("\nGot reply to ZW_MEM_PUT_BUFFER");
-				break;
-			;;
-			case FUNC_ID_SERIAL_API_GET_INIT_DATA:
-				printf("\nGot reply to FUNC_ID_SERIAL_API_GET_INIT_DATA:");
-				zw_process_resp_FUNC_ID_SERIAL_API_GET_INIT_DATA( ctx, frame );
-				break;
-			;;
-			case FUNC_ID_ZW_GET_NODE_PROTOCOL_INFO:
-				printf("\nGot reply to FUNC_ID_ZW_GET_NODE_PROTOCOL_INFO:");
-				zw_process_resp_FUNC_ID_ZW_GET_NODE_PROTOCOL_INFO( ctx, frame );
-				break;
-			;;
-			case FUNC_ID_ZW_REQUEST_NODE_INFO:
-				printf( "\nGot reply to FUNC_ID_ZW_REQUEST_NODE_INFO:");
-				break;
-			;;
-			case FUNC_ID_ZW_SEND_DATA:
-				switch(frame[2]) {
-					case 1:
-						printf("\nZW_SEND delivered to Z-Wave stack");
-						break;
-					case 0:
-						printf( "\nERROR: ZW_SEND could not be delivered to Z-Wave stack");
-						break;
-					default:
-						printf( "\nERROR: ZW_SEND Response is invalid!");
-				}
+	if ( RESPONSE == frame[0] ) {
+		fn = zw_resp_handlers[ frame[1] ];
+		if ( fn ) fn( ctx, frame, length );
+		zw_tx_on_response( ctx, frame );
+	}
+	else if ( REQUEST == frame[0] ) {
+		fn = zw_req_handlers[ frame[1] ];
+		if ( fn ) fn( ctx, frame, length );
+	}
+}
 
-				break;
-			case FUNC_ID_SERIAL_API_GET_CAPABILITIES:
-				printf( "\nGot reply to FUNC_ID_SERIAL_API_GET_CAPABILITIES:");
-				printf("\nSerAppV:%i,r%i,Manf %i,Typ %i,Prod %i",(unsigned char)frame[2],(unsigned char)frame[3], ((unsigned char)frame[4]<<8) + (unsigned char)frame[5],((unsigned char)frame[6]<<8) + (unsigned char)frame[7],((unsigned char)frame[8]<<8) + (unsigned char)frame[9]);	
-				break;
-			case ZW_GET_VERSION:
-				printf( "\nGot reply to ZW_VERSION:");
-				printf("\nZWave Version: %c.%c%c",(unsigned char)frame[9],(unsigned char)frame[11],(unsigned char)frame[12]);	
-				break;
-			default:
-				printf( "\nTODO: handle response for 0x%x ",(unsigned char)frame[1]);
-				break;
-			;;
+/*
+ * Arm the timer fd for the deadline of the message we are waiting on, a
+ * held back node, a report, the rest of an incomplete frame or the next
+ * attempt to reopen a lost port, whichever comes first. It is disarmed
+ * when nothing is outstanding so an idle reader never wakes up.
+ */
+static void
+zw_arm_timer( zw_api_ctx_S *ctx )
+{
+	struct itimerspec its;
+	u64 deadline = 0;
+	u64 report;
+
+	memset( &its, 0, sizeof( its ) );
+	if ( ZW_TX_IDLE != ctx->tx_state )
+		deadline = ctx->tx_deadline_ns;
+	else if ( ctx->next_holdoff_ns )
+		deadline = ctx->next_holdoff_ns;
+
+	report = zw_waiters_next_deadline( &ctx->waiters );
+	if ( report && ( !deadline || report < deadline ) )
+		deadline = report;
+	if ( ctx->rx_stall_ns && ( !deadline || ctx->rx_stall_ns < deadline ) )
+		deadline = ctx->rx_stall_ns;
+	if ( ctx->port_down && ( !deadline || ctx->reconnect_ns < deadline ) )
+		deadline = ctx->reconnect_ns;
+	if ( deadline )
+		zw_ns_to_timespec( deadline, &its.it_value );
+
+	if ( 0 > timerfd_settime( ctx->timer_fd, TFD_TIMER_ABSTIME, &its, NULL ) )
+		perror( "zw_arm_timer" );
+}
+
+/*
+ * Whatever tx waits on is overdue. A missing ACK is the controller's and
+ * doesn't count against the node; a missing response or callback does.
+ */
+static void
+zw_tx_on_timeout( zw_api_ctx_S *ctx, u64 now )
+{
+	int state = ctx->tx_state;
+	zwave_msg_S *req;
+
+	if ( ZW_TX_IDLE == state || now < ctx->tx_deadline_ns ) return;
+
+	req = zw_tx_take( ctx );
+	SYSLOG_WARN( "Msg for node %d; no %s after %llu ms", req->node_id,
+			zw_tx_state_names[ state ],
+			(unsigned long long)( ( now - req->ts_ns ) / ZW_NSEC_PER_MSEC ) );
+
+	if ( ZW_TX_WAIT_ACK != state )
+		zw_rtt_timeout( ctx, req, now );
+	if ( ZW_TX_WAIT_CB == state ) {
+		pthread_mutex_lock( &ctx->stats_lock );
+		ctx->tx_stats.cb_timeouts++;
+		pthread_mutex_unlock( &ctx->stats_lock );
+	}
+
+	/*
+	 * A missing RESPONSE is retried like a missing ACK, as before the
+	 * transaction machine: the controller answers every function it
+	 * takes, so silence means the frame was lost on its side.
+	 */
+	zw_retry_or_drop( ctx, req );
+}
+
+static int
+zw_epoll_add( zw_api_ctx_S *ctx, int fd, u32 tag )
+{
+	struct epoll_event ev;
+
+	memset( &ev, 0, sizeof( ev ) );
+	ev.events = EPOLLIN;
+	ev.data.u32 = tag;
+	if ( 0 > epoll_ctl( ctx->epoll_fd, EPOLL_CTL_ADD, fd, &ev ) ) {
+		perror( "zw_epoll_add" );
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The port went away (tcp peer closed, usb stick unplugged). The reader
+ * carries on from its timer until zw_port_retry() gets it back: whatever
+ * is in flight or queued fails with EIO, as does everything submitted
+ * meanwhile, and futures waiting for the report to a request already
+ * written give up, so no caller sits out its own timeout. Held mailbox
+ * commands are kept for the wake up, and so are their futures.
+ */
+static void
+zw_port_lost( zw_api_ctx_S *ctx, u64 now )
+{
+	zwave_msg_S *req;
+	int prio, count;
+
+	SYSLOG_FAULT( "Lost connection to %s, reconnecting", ctx->tp.uri );
+	epoll_ctl( ctx->epoll_fd, EPOLL_CTL_DEL, zw_transport_poll_fd( &ctx->tp ), NULL );
+	zw_rx_init( &ctx->rx );
+	ctx->rx_stall_ns = 0;
+	ctx->port_down = 1;
+	ctx->reconnect_ns = now + ZW_RECONNECT_NS;
+
+	if ( ctx->tx )
+		zw_msg_free( ctx, zw_tx_take( ctx ), EIO );
+	for ( prio = ZW_PRIO_INTERACTIVE; prio < ZW_PRIO_COUNT; prio++ ) {
+		while ( !list_empty( &ctx->msg_list[ prio ] ) ) {
+			req = (zwave_msg_S *)list_pop_front( &ctx->msg_list[ prio ] );
+			pthread_mutex_lock( &ctx->stats_lock );
+			ctx->prio_stats[ prio ].queued--;
+			pthread_mutex_unlock( &ctx->stats_lock );
+			zw_msg_free( ctx, req, EIO );
 		}
+	}
+	zw_drain_submissions( ctx );
 
-		zw_purge_first_resp_wait_list( frame[1] );
-	} else if (frame[0] == REQUEST) {
+	count = zw_waiters_fail( &ctx->waiters, EIO );
+	if ( count )
+		SYSLOG_WARN( "%d report(s) abandoned", count );
+}
 
-		switch (frame[1]) {
-			case FUNC_ID_ZW_SEND_DATA:
-			{
-				printf("\nZW_SEND Response with callback %i received",(unsigned char)frame[2]);
-			}
-			break;
-			case FUNC_ID_ZW_ADD_NODE_TO_NETWORK:
-				printf( "\nFUNC_ID_ZW_ADD_NODE_TO_NETWORK:");
-				break;
-			case FUNC_ID_ZW_REMOVE_NODE_FROM_NETWORK:
-				printf( "\nFUNC_ID_ZW_REMOVE_NODE_FROM_NETWORK:");
-				break;
+/* Try to reopen a lost port, once every ZW_RECONNECT_NS */
+static void
+zw_port_retry( zw_api_ctx_S *ctx, u64 now )
+{
+	if ( !ctx->port_down || now < ctx->reconnect_ns ) return;
 
-			case FUNC_ID_APPLICATION_COMMAND_HANDLER:
-				printf( "\nFUNC_ID_APPLICATION_COMMAND_HANDLER:");
-				if ( COMMAND_CLASS_WAKE_UP == frame[5] )
-					zw_node_wakeup_handler( ctx, frame[3] );
+	if ( zw_transport_reopen( &ctx->tp ) ||
+	     zw_epoll_add( ctx, zw_transport_poll_fd( &ctx->tp ), ZW_EV_PORT ) ) {
+		/* the attempt itself may have taken a while */
+		ctx->reconnect_ns = zw_time_ns() + ZW_RECONNECT_NS;
+		return;
+	}
 
-				cc_process_msg( ctx, frame, frame[3] );
+	ctx->port_down = 0;
+	SYSLOG_INFO( "Reconnected to %s", ctx->tp.uri );
+}
+
+/*
+ * Handle every complete item in the receive buffer. ACK/NAK replies for
+ * all frames in the batch are written together before the frames are
+ * dispatched. A frame left incomplete must be finished within the byte
+ * timeout of the last read.
+ */
+static void
+zw_handle_frames( zw_api_ctx_S *ctx, u64 now )
+{
+	struct zw_rx_item items[ ZW_RX_MAX_ITEMS ];
+	u8 replies[ ZW_RX_MAX_ITEMS ];
+	int nreplies;
+	int count, i;
+
+	do {
+		count = zw_rx_parse( &ctx->rx, items, ZW_RX_MAX_ITEMS );
+
+		nreplies = 0;
+		for ( i = 0; i < count; i++ ) {
+			if ( ZW_RX_FRAME == items[ i ].type )
+				replies[ nreplies++ ] = ACK;
+			else if ( ZW_RX_BAD_FRAME == items[ i ].type )
+				replies[ nreplies++ ] = NAK;
+		}
+		if ( nreplies ) {
+			zw_write_port( ctx, replies, nreplies );
+			zw_transport_flush( &ctx->tp );
+		}
+
+		for ( i = 0; i < count; i++ ) {
+			switch( items[ i ].type ) {
+			case ZW_RX_ACK:
+				zw_tx_on_ack( ctx );
 				break;
-			;;
-			case FUNC_ID_ZW_APPLICATION_UPDATE:
-				switch((unsigned char)frame[2]) {
-					case UPDATE_STATE_NODE_INFO_RECEIVED:
-						printf( "FUNC_ID_ZW_APPLICATION_UPDATE:UPDATE_STATE_NODE_INFO_RECEIVED received from node %d - ",(unsigned int)frame[3]);
-						switch((unsigned char)frame[5]) {
-							case BASIC_TYPE_ROUTING_SLAVE:
-							case BASIC_TYPE_SLAVE:
-								//printf( "BASIC_TYPE_SLAVE:");
-								switch(frame[6]) {
-									case GENERIC_TYPE_SWITCH_MULTILEVEL:
-										printf( "GENERIC_TYPE_SWITCH_MULTILEVE");
-										tempbuf[0] = FUNC_ID_ZW_SEND_DATA;
-										tempbuf[1] = frame[3];
-										tempbuf[2] = 0x02;
-										tempbuf[3] = COMMAND_CLASS_SWITCH_MULTILEVEL;
-										tempbuf[4] = SWITCH_MULTILEVEL_GET;
-										tempbuf[5] = TRANSMIT_OPTION_ACK | TRANSMIT_OPTION_AUTO_ROUTE;
-										zw_send_request ( ctx, tempbuf, 6, frame[3], RESP_REQ, FUNC_ID_ZW_SEND_DATA );
-										tempbuf[0] = FUNC_ID_ZW_SEND_DATA;
-										tempbuf[1] = frame[3];
-										tempbuf[2] = 0x02;
-										tempbuf[3] = COMMAND_CLASS_BASIC;
-										tempbuf[4] = BASIC_GET;
-										tempbuf[5] = TRANSMIT_OPTION_ACK | TRANSMIT_OPTION_AUTO_ROUTE;
-										zw_send_request( ctx, tempbuf,6, frame[3], RESP_REQ, FUNC_ID_ZW_SEND_DATA );
-										break;
-									case GENERIC_TYPE_SWITCH_BINARY:
-										printf( "GENERIC_TYPE_SWITCH_BINARY");
-										tempbuf[0] = FUNC_ID_ZW_SEND_DATA;
-										tempbuf[1] = frame[3];
-										tempbuf[2] = 0x02;
-										tempbuf[3] = COMMAND_CLASS_BASIC;
-										tempbuf[4] = BASIC_GET;
-										tempbuf[5] = TRANSMIT_OPTION_ACK | TRANSMIT_OPTION_AUTO_ROUTE;
-										zw_send_request( ctx, tempbuf, 6, frame[3], RESP_REQ, FUNC_ID_ZW_SEND_DATA );
-										break;
-									case GENERIC_TYPE_SWITCH_REMOTE:
-										printf( "GENERIC_TYPE_SWITCH_REMOTE");
-										break;
-									case GENERIC_TYPE_SENSOR_MULTILEVEL:
-										printf( "GENERIC_TYPE_SENSOR_MULTILEVEL");
-										break;
-									;;
-									default:
-										printf( "unhandled class");
-										break;
-									;;
-								}
-							default:
-								break;
-							;;
-						}
-						break;
-					case UPDATE_STATE_NODE_INFO_REQ_FAILED:
-						printf( "FUNC_ID_ZW_APPLICATION_UPDATE:UPDATE_STATE_NODE_INFO_REQ_FAILED received");
-						break;
-				        case UPDATE_STATE_NEW_ID_ASSIGNED:
-					{
-						printf( "** Network change **: ID %d was assigned to a new Z-Wave node",(unsigned char)frame[3]);
-					}
-						break;
-					case UPDATE_STATE_DELETE_DONE:
-						printf( "** Network change **: Z-Wave node %d was removed",(unsigned char)frame[3]);
-						break;
-					;;
-					default:
-						break;
-					;;
-				}	
+			case ZW_RX_NAK:
+				zw_tx_on_nak( ctx, "NAK" );
+				break;
+			case ZW_RX_CAN:
+				zw_tx_on_nak( ctx, "CAN" );
+				break;
+			case ZW_RX_FRAME:
+				zw_print_line( items[ i ].data, items[ i ].len );
+				zw_process_frame( ctx, items[ i ].data, items[ i ].len );
 				break;
-			;;
-			default:
-			;;
+			case ZW_RX_BAD_FRAME:
+				SYSLOG_WARN( "Dropped frame with bad checksum" );
+				break;
+			}
+		}
+	} while ( ZW_RX_MAX_ITEMS == count );
 
+	ctx->rx_stall_ns = zw_rx_partial( &ctx->rx ) ? now + ZW_BYTE_TIMEOUT_NS : 0;
+}
 
-		}
+/* Pull everything the port has into the receive buffer with a single read */
+static void
+zw_read_frames( zw_api_ctx_S *ctx )
+{
+	u8 *space;
+	int rc;
 
-	} else {
-		// should not happen
+	rc = zw_rx_space( &ctx->rx, &space );
+	rc = zw_transport_read( &ctx->tp, space, rc );
+	if ( 0 > rc && ( EAGAIN == errno || EINTR == errno ) )
+		return;
+	if ( 0 >= rc ) {
+		if ( 0 > rc ) perror( "zw_read_frames" );
+		zw_port_lost( ctx, zw_time_ns() );
+		return;
 	}
-	fflush(stdout);
-	return;
+	zw_rx_commit( &ctx->rx, rc );
+
+	zw_handle_frames( ctx, zw_time_ns() );
 }
 
-static int 
-zw_wait_list_empty()
+/*
+ * A SOF with a length whose bytes never arrived (line noise, a stick
+ * reset mid frame): give up on it rather than wait for bytes that belong
+ * to the frames after it.
+ */
+static void
+zw_rx_on_timeout( zw_api_ctx_S *ctx, u64 now )
 {
-	return ( list_empty( &ack_wait_list ) && list_empty( &resp_wait_list ) );
+	if ( !ctx->rx_stall_ns || now < ctx->rx_stall_ns ) return;
+
+	SYSLOG_WARN( "Incomplete frame timed out, resyncing" );
+	zw_rx_resync( &ctx->rx );
+	zw_handle_frames( ctx, now );
+}
+
+static void
+zw_check_timeouts( zw_api_ctx_S *ctx )
+{
+	u64 now = zw_time_ns();
+	u64 expirations;
+	int count;
+
+	if ( 0 > read( ctx->timer_fd, &expirations, sizeof( expirations ) ) && EAGAIN != errno )
+		perror( "zw_check_timeouts" );
+
+	count = zw_waiters_expire( &ctx->waiters, now );
+	if ( count )
+		SYSLOG_WARN( "%d report(s) timed out", count );
+
+	zw_tx_on_timeout( ctx, now );
+	zw_rx_on_timeout( ctx, now );
+	zw_port_retry( ctx, now );
 }
 
+/*
+ * The reader is the Serial API actor: it owns the port, the send queues
+ * and the one transaction in flight. It sleeps in epoll until the port
+ * has data, a producer signals the wake fd from zw_send_request() or the
+ * deadline of the current state expires, and writes the next queued
+ * message whenever the transaction machine is back to idle.
+ */
 static void *
 zw_reader_thread( void *arg )
 {
 	zw_api_ctx_S *ctx = (zw_api_ctx_S *)arg;
-        int port = ctx->port;
-        int rc = 0;
-        u8 buffer [256];
-	int flen = 0;
-	zwave_msg_S *req = NULL;
-
-	while( 1 ) {
-		memset( buffer, 0, 256 );
-		rc = zw_read_port( port, buffer, 1, 100 );
-		if ( 1 != rc ) { 
-			if ( zw_wait_list_empty() ) {
-				rc = zw_send_first_message( );
-				if ( rc ) {
-					SYSLOG_FAULT( "sending message failed" );
-				}
-			}
-			else  {
-				time_t now;
-				int ack_wait = 0;
-				if ( !list_empty( &ack_wait_list ) ) {
-					SYSLOG_WARN("Ack Wait list not empty");
-					req = (zwave_msg_S *)list_pop_front( &ack_wait_list );
-					ack_wait = 1;
-				}
-				else if ( !list_empty( &resp_wait_list ) ) {
-					SYSLOG_WARN("Resp Wait list not empty");
-					req = (zwave_msg_S *)list_pop_front( &resp_wait_list );
-				}
-				now = time( &now );
-				if ( req && ( 5 <= ( now - req->ts ) ) ) {
-					SYSLOG_WARN( "Msg for node %d; wait more than 5 seconds", req->node_id );
-					if ( ack_wait && !req->retry ) {
-						req->retry = 1;
-						SYSLOG_WARN( "Requeuing message");
-						pthread_mutex_lock (&list_lock);
-						list_add((list_node *)&msg_list, (list_node *)req);
-						pthread_mutex_unlock (&list_lock);
-					}
-					else {	
-						SYSLOG_FAULT( "Trashing message; retry(%d)", req->retry);
-						free( req );
-					}
-				}	
+	struct epoll_event events[ ZW_MAX_EVENTS ];
+	u64 wakeups;
+	int rc = 0;
+	int i, n;
+
+	/* whatever the reader queues by itself is discovery and polling */
+	zw_api_set_thread_prio( ZW_PRIO_BACKGROUND );
+
+	while( !__atomic_load_n( &ctx->stop, __ATOMIC_ACQUIRE ) ) {
+		zw_drain_submissions( ctx );
+		if ( ZW_TX_IDLE == ctx->tx_state && !ctx->port_down ) {
+			rc = zw_send_first_message( ctx );
+			if ( rc ) {
+				SYSLOG_FAULT( "sending message failed" );
 			}
-		
+		}
+		zw_transport_flush( &ctx->tp );
+		zw_arm_timer( ctx );
+
+		n = epoll_wait( ctx->epoll_fd, events, ZW_MAX_EVENTS, -1 );
+		if ( 0 > n ) {
+			if ( EINTR != errno ) perror( "zw_reader_thread" );
 			continue;
 		}
 
-		switch( buffer[ 0 ] ) {
-		case ACK:
-			SYSLOG_DEBUG( "ACK received" );
-			if ( list_empty( &ack_wait_list ) ) {
-				SYSLOG_FAULT("FATAL: No msgs in ack wait Q");
+		for ( i = 0; i < n; i++ ) {
+			switch( events[ i ].data.u32 ) {
+			case ZW_EV_PORT:
+				zw_read_frames( ctx );
 				break;
-			}
-
-			req = (zwave_msg_S *)list_pop_front( &ack_wait_list );
-			if ( !req ) { 
-				SYSLOG_FAULT("FATAL: Failed to pop msg from the ack wait Q");
+			case ZW_EV_WAKE:
+				if ( 0 > read( ctx->wake_fd, &wakeups, sizeof( wakeups ) ) && EAGAIN != errno )
+					perror( "zw_reader_thread" );
 				break;
-			}
-			if ( req->resp_req ) {
-				list_add((list_node *)&resp_wait_list, (list_node *)req);
-				break;	
-			}
-
-			free( req );
-			break;
-		case NAK:
-			SYSLOG_DEBUG( "NAK received" );
-			break;
-		case CAN:
-			SYSLOG_DEBUG( "CAN received" );
-			break;
-		case SOF:
-			SYSLOG_DEBUG( "SOF received" );
-			rc = zw_read_port( port, buffer + 1, 1, 100 );
-			if ( 1 != rc ) {
-				SYSLOG_FAULT( "read framelen failed/timedout %d", rc );
+			case ZW_EV_TIMER:
+				zw_check_timeouts( ctx );
 				break;
 			}
-			flen = buffer[ 1 ];
-			SYSLOG_DEBUG(" Framelen: %d", flen);
-			rc = zw_read_port( port, buffer + 2, flen, 100 );
-			if ( flen != rc ) {
-				SYSLOG_FAULT( "read frame failed/timedout %d", rc );
-				break;
-			}
-			zw_print_line( buffer, flen );
-			buffer[0] = ACK; 
-			zw_write_port( port, buffer, 1 );
-			zw_process_frame( ctx, buffer + 2, flen - 2 );
-			fflush(stdout);
-			break;
-		default:
-			SYSLOG_WARN( "Unknown Frame Type received: %02x", buffer[ 0 ] );
 		}
 	}
 
 	return NULL;
 }
 
+static int
+zw_api_ctx_init( zw_api_ctx_S *ctx, u32 pool_size )
+{
+	int i;
+
+	for ( i = 0; i < ZW_PRIO_COUNT; i++ )
+		list_init( &ctx->msg_list[ i ] );
+	ctx->tx_state = ZW_TX_IDLE;
+	ctx->next_cbid = 1;
+	for ( i = 0; i < MAX_ZWAVE_NODES; i++ )
+		list_init( &ctx->mailbox[ i ].msgs );
+	pthread_mutex_init( &ctx->stats_lock, NULL );
+	for ( i = 0; i < MAX_ZWAVE_NODES; i++ )
+		zw_rtt_init( &ctx->rtt[ i ] );
+	zw_waiters_init( &ctx->waiters );
+	pthread_mutex_init( &ctx->cc_lock, NULL );
+
+	/* every message in the ring is from the pool, so a push can't find it full */
+	if ( zw_pool_init( &ctx->msg_pool, sizeof( zwave_msg_S ), pool_size ) ||
+	     zw_pool_init( &ctx->fut_pool, sizeof( zw_future_S ), pool_size ) ||
+	     zw_ring_init( &ctx->submit, ctx->msg_pool.capacity ) )
+		return -1;
+
+	return 0;
+}
+
+/* Undo zw_api_ctx_init(), also after it failed half way */
+static void
+zw_api_ctx_destroy( zw_api_ctx_S *ctx )
+{
+	zw_ring_destroy( &ctx->submit );
+	zw_pool_destroy( &ctx->fut_pool );
+	zw_pool_destroy( &ctx->msg_pool );
+}
+
 int 
 zw_api_init( const char *portname, zw_api_ctx_S *ctx )
+{
+	return zw_api_init_opts( portname, ctx, NULL );
+}
+
+/*
+ * Set up a context with no port or reader thread, used to feed captured
+ * traffic through zw_process_frame(). Requests are counted and dropped.
+ */
+int
+zw_api_init_offline( zw_api_ctx_S *ctx )
+{
+	memset( ctx, 0, sizeof( *ctx ) );
+	ctx->node_id = -1;
+	ctx->offline = 1;
+	ctx->tp.fd = -1;
+	pthread_mutex_init( &ctx->tp.stats_lock, NULL );
+	zw_rx_init( &ctx->rx );
+	return zw_api_ctx_init( ctx, 0 );
+}
+
+int
+zw_api_init_opts( const char *portname, zw_api_ctx_S *ctx, const struct zw_api_opts *opts )
 {
 	int rc = -1;
 	unsigned char buffer[256];
-	pthread_t readThread;
 
+	memset( ctx, 0, sizeof( *ctx ) );
 	ctx->node_id = -1;
-	rc = zw_open_port ( portname, &ctx->port );	
+	ctx->tp.fd = -1;
+	ctx->epoll_fd = -1;
+	ctx->wake_fd = -1;
+	ctx->timer_fd = -1;
+	zw_rx_init( &ctx->rx );
+	rc = zw_api_ctx_init( ctx, opts ? opts->pool_size : 0 );
+	if ( rc ) {
+		SYSLOG_FAULT("Failed to allocate message pools");
+		goto err_ctx;
+	}
+	rc = zw_transport_open( &ctx->tp, portname );
 	if ( rc ) {
 		SYSLOG_FAULT("Failed to open port");
-		goto out;
+		goto err_ctx;
+	}
+
+	if ( opts && opts->capture ) {
+		ctx->tp.capture = zw_capture_open( opts->capture );
+		if ( !ctx->tp.capture )
+			SYSLOG_FAULT( "Failed to start capture to %s", opts->capture );
 	}
 
-	pthread_mutex_init(&list_lock, NULL);
+	ctx->epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+	ctx->wake_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+	ctx->timer_fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+	if ( 0 > ctx->epoll_fd || 0 > ctx->wake_fd || 0 > ctx->timer_fd ) {
+		SYSLOG_FAULT("Failed to create reader event fds");
+		rc = -1;
+		goto err_fds;
+	}
+
+	if ( zw_epoll_add( ctx, zw_transport_poll_fd( &ctx->tp ), ZW_EV_PORT ) ||
+	     zw_epoll_add( ctx, ctx->wake_fd, ZW_EV_WAKE ) ||
+	     zw_epoll_add( ctx, ctx->timer_fd, ZW_EV_TIMER ) ) {
+		SYSLOG_FAULT("Failed to register reader event fds");
+		rc = -1;
+		goto err_fds;
+	}
 
         buffer[0] = 0x15; //NAK
-        write( ctx->port, buffer, 1 );
-        pthread_create( &readThread, NULL, zw_reader_thread, (void*)ctx );
+        zw_write_port( ctx, buffer, 1 );
+        zw_transport_flush( &ctx->tp );
+        if ( pthread_create( &ctx->reader, NULL, zw_reader_thread, (void*)ctx ) ) {
+		SYSLOG_FAULT("Failed to start reader thread");
+		rc = -1;
+		goto err_fds;
+	}
 
         buffer[0] = ZW_GET_VERSION;
         zw_send_request( ctx, buffer , 1, 0, RESP_REQ, ZW_GET_VERSION );
@@ -717,9 +1653,47 @@ zw_api_init( const char *portname, zw_api_ctx_S *ctx )
         zw_send_request( ctx, buffer , 1, 0, RESP_REQ, FUNC_ID_SERIAL_API_GET_INIT_DATA );
 
 	rc = 0;
-
+	goto out;
+
+	/* a failed context holds nothing, and zw_api_close() leaves it alone */
+err_fds:
+	if ( 0 <= ctx->timer_fd ) close( ctx->timer_fd );
+	if ( 0 <= ctx->wake_fd ) close( ctx->wake_fd );
+	if ( 0 <= ctx->epoll_fd ) close( ctx->epoll_fd );
+	ctx->timer_fd = ctx->wake_fd = ctx->epoll_fd = -1;
+	zw_capture_close( ctx->tp.capture );
+	ctx->tp.capture = NULL;
+	zw_transport_close( &ctx->tp );
+err_ctx:
+	zw_api_ctx_destroy( ctx );
+	ctx->offline = 1;
 out:
         return rc;
 }
 	
 
+
+/*
+ * Stop the reader and close the port, then finish the capture so that
+ * everything up to the last frame written reaches the file. Requests
+ * still queued are abandoned and later ones are refused as if offline;
+ * meant for shutdown.
+ */
+void
+zw_api_close( zw_api_ctx_S *ctx )
+{
+	if ( !ctx->offline ) {
+		__atomic_store_n( &ctx->stop, 1, __ATOMIC_RELEASE );
+		zw_wakeup_reader( ctx );
+		pthread_join( ctx->reader, NULL );
+
+		zw_transport_close( &ctx->tp );
+		close( ctx->epoll_fd );
+		close( ctx->wake_fd );
+		close( ctx->timer_fd );
+	}
+
+	zw_capture_close( ctx->tp.capture );
+	ctx->tp.capture = NULL;
+	ctx->offline = 1;
+}
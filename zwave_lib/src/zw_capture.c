@@ -0,0 +1,200 @@
+//
+//  Created by Praveen Murali Nair on 09/07/2013.
+//  Copyright (c) 2013 Praveen M Nair. All rights reserved.
+//
+// 	Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are met:
+//      * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//      * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//      * Neither the name of the <organization> nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//      ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//      WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//      DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+//      DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//      (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//       LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//      ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "zw_capture.h"
+#include "zw_time.h"
+#include "log.h"
+
+static int
+zw_capture_write_all( int fd, const u8 *buff, u64 len )
+{
+	ssize_t rc;
+
+	while ( len ) {
+		rc = write( fd, buff, len );
+		if ( 0 > rc ) {
+			if ( EINTR == errno ) continue;
+			return -1;
+		}
+		buff += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+/*
+ * The writer owns everything between head and tail. The reader thread only
+ * takes the lock long enough to copy a record in, so disk stalls never
+ * reach the serial path.
+ */
+static void *
+zw_capture_writer( void *arg )
+{
+	struct zw_capture *cap = (struct zw_capture *)arg;
+	u64 head, tail, off, chunk;
+	int stop;
+
+	while ( 1 ) {
+		pthread_mutex_lock( &cap->lock );
+		while ( cap->head == cap->tail && !cap->stop )
+			pthread_cond_wait( &cap->cond, &cap->lock );
+		head = cap->head;
+		tail = cap->tail;
+		stop = cap->stop;
+		pthread_mutex_unlock( &cap->lock );
+
+		while ( head < tail ) {
+			off = head % ZW_CAP_RING_SZ;
+			chunk = tail - head;
+			if ( chunk > ZW_CAP_RING_SZ - off ) chunk = ZW_CAP_RING_SZ - off;
+			if ( zw_capture_write_all( cap->fd, cap->ring + off, chunk ) ) {
+				SYSLOG_FAULT( "capture: write failed, stopping capture" );
+				pthread_mutex_lock( &cap->lock );
+				cap->stop = 1;
+				pthread_mutex_unlock( &cap->lock );
+				return NULL;
+			}
+			head += chunk;
+		}
+
+		pthread_mutex_lock( &cap->lock );
+		cap->head = head;
+		pthread_mutex_unlock( &cap->lock );
+
+		if ( stop && head == tail ) break;
+	}
+	return NULL;
+}
+
+static void
+zw_capture_copy( struct zw_capture *cap, const void *data, u64 len )
+{
+	u64 off = cap->tail % ZW_CAP_RING_SZ;
+	u64 first = ZW_CAP_RING_SZ - off;
+
+	if ( first > len ) first = len;
+	memcpy( cap->ring + off, data, first );
+	memcpy( cap->ring, (const u8 *)data + first, len - first );
+	cap->tail += len;
+}
+
+void
+zw_capture_add( struct zw_capture *cap, int dir, const u8 *buff, int len )
+{
+	struct zw_cap_rec_hdr rec;
+
+	if ( !cap || 0 >= len ) return;
+
+	memset( &rec, 0, sizeof( rec ) );
+	rec.ts_ns = zw_time_ns();
+	rec.len = len;
+	rec.dir = dir;
+
+	pthread_mutex_lock( &cap->lock );
+	if ( cap->stop ||
+	     cap->tail - cap->head + sizeof( rec ) + len > ZW_CAP_RING_SZ ) {
+		cap->dropped++;
+	}
+	else {
+		zw_capture_copy( cap, &rec, sizeof( rec ) );
+		zw_capture_copy( cap, buff, len );
+		pthread_cond_signal( &cap->cond );
+	}
+	pthread_mutex_unlock( &cap->lock );
+}
+
+struct zw_capture *
+zw_capture_open( const char *path )
+{
+	struct zw_capture *cap = calloc( 1, sizeof( *cap ) );
+	struct zw_cap_file_hdr hdr;
+	struct timespec ts;
+
+	if ( !cap ) goto err;
+	cap->ring = malloc( ZW_CAP_RING_SZ );
+	if ( !cap->ring ) goto err;
+
+	cap->fd = open( path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+	if ( 0 > cap->fd ) {
+		perror( path );
+		goto err;
+	}
+
+	memset( &hdr, 0, sizeof( hdr ) );
+	memcpy( hdr.magic, ZW_CAP_MAGIC, sizeof( hdr.magic ) );
+	hdr.version = ZW_CAP_VERSION;
+	hdr.mono_ns = zw_time_ns();
+	clock_gettime( CLOCK_REALTIME, &ts );
+	hdr.real_ns = (u64)ts.tv_sec * ZW_NSEC_PER_SEC + ts.tv_nsec;
+	if ( zw_capture_write_all( cap->fd, (u8 *)&hdr, sizeof( hdr ) ) ) {
+		perror( path );
+		close( cap->fd );
+		goto err;
+	}
+
+	pthread_mutex_init( &cap->lock, NULL );
+	pthread_cond_init( &cap->cond, NULL );
+	if ( pthread_create( &cap->writer, NULL, zw_capture_writer, cap ) ) {
+		close( cap->fd );
+		goto err;
+	}
+
+	SYSLOG_INFO( "capturing serial traffic to %s", path );
+	return cap;
+err:
+	if ( cap ) free( cap->ring );
+	free( cap );
+	return NULL;
+}
+
+void
+zw_capture_close( struct zw_capture *cap )
+{
+	if ( !cap ) return;
+
+	pthread_mutex_lock( &cap->lock );
+	cap->stop = 1;
+	pthread_cond_signal( &cap->cond );
+	pthread_mutex_unlock( &cap->lock );
+	pthread_join( cap->writer, NULL );
+
+	if ( cap->dropped )
+		SYSLOG_WARN( "capture: %llu records dropped", cap->dropped );
+	close( cap->fd );
+	pthread_mutex_destroy( &cap->lock );
+	pthread_cond_destroy( &cap->cond );
+	free( cap->ring );
+	free( cap );
+}
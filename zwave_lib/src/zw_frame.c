@@ -0,0 +1,162 @@
+//
+//  Created by Praveen Murali Nair on 09/07/2013.
+//  Copyright (c) 2013 Praveen M Nair. All rights reserved.
+//
+// 	Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are met:
+//      * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//      * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//      * Neither the name of the <organization> nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//      ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//      WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//      DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+//      DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//      (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//       LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//      ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include <string.h>
+
+#include "zw_frame.h"
+#include "log.h"
+
+u8 
+zw_checksum( const u8 *buff, int len )
+{
+        int csum = 0xff;
+	int i;
+
+        for( i = 0; i < len; i++ )
+		csum ^= buff[ i ];
+
+        return csum;
+}
+
+void
+zw_rx_init( struct zw_rx_buf *rx )
+{
+	rx->head = 0;
+	rx->tail = 0;
+	rx->garbage = 0;
+}
+
+/*
+ * Return the free space at the end of the buffer for the next read. Items
+ * returned by an earlier zw_rx_parse() are invalidated.
+ */
+int
+zw_rx_space( struct zw_rx_buf *rx, u8 **space )
+{
+	if ( rx->head == rx->tail ) {
+		rx->head = 0;
+		rx->tail = 0;
+	}
+	else if ( rx->head ) {
+		memmove( rx->data, rx->data + rx->head, rx->tail - rx->head );
+		rx->tail -= rx->head;
+		rx->head = 0;
+	}
+
+	*space = rx->data + rx->tail;
+	return ZW_RX_BUF_SZ - rx->tail;
+}
+
+void
+zw_rx_commit( struct zw_rx_buf *rx, int len )
+{
+	rx->tail += len;
+}
+
+/*
+ * Extract up to max complete items. A frame with a bad checksum is
+ * consumed whole so that no byte of its body is taken for an ACK, NAK or
+ * CAN. A frame with an impossible length only consumes its SOF byte so
+ * that parsing resyncs on the next SOF; stray bytes between frames are
+ * skipped.
+ */
+int
+zw_rx_parse( struct zw_rx_buf *rx, struct zw_rx_item *items, int max )
+{
+	int count = 0;
+	u8 *p;
+	int avail, flen;
+
+	while ( count < max && rx->head < rx->tail ) {
+		p = rx->data + rx->head;
+		avail = rx->tail - rx->head;
+
+		switch ( p[ 0 ] ) {
+		case ACK:
+		case NAK:
+		case CAN:
+			items[ count ].type = ( ACK == p[ 0 ] ) ? ZW_RX_ACK :
+					      ( NAK == p[ 0 ] ) ? ZW_RX_NAK : ZW_RX_CAN;
+			items[ count ].data = p;
+			items[ count ].len = 1;
+			count++;
+			rx->head++;
+			break;
+		case SOF:
+			if ( 2 > avail ) goto out;
+			flen = p[ 1 ];
+			if ( 3 > flen ) {
+				SYSLOG_DEBUG( "Invalid frame length %d, resyncing", flen );
+				rx->garbage++;
+				rx->head++;
+				break;
+			}
+			if ( flen + 2 > avail ) goto out;
+
+			items[ count ].data = p + 2;
+			items[ count ].len = flen - 1;
+			if ( zw_checksum( p + 1, flen ) == p[ flen + 1 ] ) {
+				items[ count ].type = ZW_RX_FRAME;
+				rx->head += flen + 2;
+			}
+			else {
+				SYSLOG_WARN( "Frame checksum mismatch, resyncing" );
+				items[ count ].type = ZW_RX_BAD_FRAME;
+				rx->garbage += flen + 2;
+				rx->head += flen + 2;
+			}
+			count++;
+			break;
+		default:
+			rx->garbage++;
+			rx->head++;
+			break;
+		}
+	}
+out:
+	return count;
+}
+
+/* After zw_rx_parse() returned less than max: a frame is still incomplete */
+int
+zw_rx_partial( struct zw_rx_buf *rx )
+{
+	return rx->head < rx->tail;
+}
+
+/*
+ * The rest of the incomplete frame never came. Drop its SOF and parse
+ * what follows as a new stream, as for an impossible length.
+ */
+void
+zw_rx_resync( struct zw_rx_buf *rx )
+{
+	if ( rx->head == rx->tail ) return;
+
+	rx->garbage++;
+	rx->head++;
+}
@@ -0,0 +1,444 @@
+//
+//  Created by Praveen Murali Nair on 09/07/2013.
+//  Copyright (c) 2013 Praveen M Nair. All rights reserved.
+//
+// 	Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are met:
+//      * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//      * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//      * Neither the name of the <organization> nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//      ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//      WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//      DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+//      DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//      (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//       LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//      ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "zw_future.h"
+#include "zw_api.h"
+#include "zw_time.h"
+#include "log.h"
+
+/*
+ * A new future holds one reference for the caller. The library takes its
+ * own references while the request is queued or a report is awaited.
+ */
+zw_future_S *
+zw_future_new( struct zw_api_ctx *ctx, u8 nodeid, u8 cls, u8 cmd )
+{
+	pthread_condattr_t attr;
+	zw_future_S *fut;
+
+	fut = zw_pool_get( &ctx->fut_pool );
+	if ( !fut ) return NULL;
+
+	fut->ctx = ctx;
+	fut->refs = 1;
+	fut->val = -1;
+	fut->node_id = nodeid;
+	fut->cls = cls;
+	fut->cmd = cmd;
+	pthread_mutex_init( &fut->lock, NULL );
+	pthread_condattr_init( &attr );
+	pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+	pthread_cond_init( &fut->cond, &attr );
+	pthread_condattr_destroy( &attr );
+
+	return fut;
+}
+
+zw_future_S *
+zw_future_get( zw_future_S *fut )
+{
+	pthread_mutex_lock( &fut->lock );
+	fut->refs++;
+	pthread_mutex_unlock( &fut->lock );
+
+	return fut;
+}
+
+void
+zw_future_put( zw_future_S *fut )
+{
+	int refs;
+
+	if ( !fut ) return;
+
+	pthread_mutex_lock( &fut->lock );
+	refs = --fut->refs;
+	pthread_mutex_unlock( &fut->lock );
+	if ( refs ) return;
+
+	pthread_cond_destroy( &fut->cond );
+	pthread_mutex_destroy( &fut->lock );
+	zw_pool_put( &fut->ctx->fut_pool, fut );
+}
+
+/*
+ * First completion wins; returns -1 if the future was already done. The
+ * completion callback runs here, outside the future's lock, and before
+ * the waiters are woken so they see whatever it updated.
+ */
+int
+zw_future_complete( zw_future_S *fut, int status, int val )
+{
+	zw_future_cb cb;
+	void *arg;
+
+	pthread_mutex_lock( &fut->lock );
+	if ( fut->completing ) {
+		pthread_mutex_unlock( &fut->lock );
+		return -1;
+	}
+	fut->completing = 1;
+	fut->status = status;
+	fut->val = val;
+	cb = fut->cb;
+	arg = fut->cb_arg;
+	pthread_mutex_unlock( &fut->lock );
+
+	if ( cb ) cb( fut, arg );
+
+	pthread_mutex_lock( &fut->lock );
+	fut->done = 1;
+	pthread_cond_broadcast( &fut->cond );
+	pthread_mutex_unlock( &fut->lock );
+
+	return 0;
+}
+
+int
+zw_future_done( zw_future_S *fut )
+{
+	int done;
+
+	pthread_mutex_lock( &fut->lock );
+	done = fut->done;
+	pthread_mutex_unlock( &fut->lock );
+
+	return done;
+}
+
+/*
+ * Wait up to timeout_ms (forever if negative) for the future. Returns its
+ * status, or ETIMEDOUT if it is still pending. The reader thread completes
+ * futures, so it may never wait on one.
+ */
+int
+zw_future_wait( zw_future_S *fut, int timeout_ms, int *val )
+{
+	struct timespec ts;
+	int rc = 0;
+
+	if ( pthread_equal( pthread_self(), fut->ctx->reader ) ) {
+		SYSLOG_FAULT( "zw_future_wait called from the reader thread" );
+		return EDEADLK;
+	}
+
+	if ( 0 <= timeout_ms )
+		zw_ns_to_timespec( zw_time_ns() + timeout_ms * ZW_NSEC_PER_MSEC, &ts );
+
+	pthread_mutex_lock( &fut->lock );
+	while ( !fut->done && !rc ) {
+		if ( 0 > timeout_ms )
+			rc = pthread_cond_wait( &fut->cond, &fut->lock );
+		else
+			rc = pthread_cond_timedwait( &fut->cond, &fut->lock, &ts );
+	}
+	if ( fut->done ) {
+		rc = fut->status;
+		if ( val ) *val = fut->val;
+	}
+	pthread_mutex_unlock( &fut->lock );
+
+	return rc;
+}
+
+/*
+ * Register the completion callback. If the future is already done the
+ * callback runs right away in the calling thread.
+ */
+void
+zw_future_on_complete( zw_future_S *fut, zw_future_cb cb, void *arg )
+{
+	int done;
+
+	pthread_mutex_lock( &fut->lock );
+	done = fut->completing;
+	if ( !done ) {
+		fut->cb = cb;
+		fut->cb_arg = arg;
+	}
+	pthread_mutex_unlock( &fut->lock );
+
+	if ( done ) cb( fut, arg );
+}
+
+static struct zw_wait_bucket *
+zw_waiters_bucket( struct zw_waiters *w, u8 nodeid, u8 cls, u8 cmd )
+{
+	u32 key = ( nodeid << 16 ) | ( cls << 8 ) | cmd;
+
+	key *= 2654435761u;
+	return &w->bucket[ ( key >> 16 ) & ( ZW_WAIT_BUCKETS - 1 ) ];
+}
+
+void
+zw_waiters_init( struct zw_waiters *w )
+{
+	int i;
+
+	for ( i = 0; i < ZW_WAIT_BUCKETS; i++ ) {
+		pthread_mutex_init( &w->bucket[ i ].lock, NULL );
+		list_init( &w->bucket[ i ].list );
+		w->bucket[ i ].next_deadline_ns = 0;
+	}
+	w->next_deadline_ns = 0;
+}
+
+/* The table takes its own reference to the future */
+void
+zw_waiters_add( struct zw_waiters *w, zw_future_S *fut )
+{
+	struct zw_wait_bucket *b = zw_waiters_bucket( w, fut->node_id, fut->cls, fut->cmd );
+
+	zw_future_get( fut );
+	pthread_mutex_lock( &b->lock );
+	list_add( &b->list, (list_node *)fut );
+	fut->listed = 1;
+	pthread_mutex_unlock( &b->lock );
+}
+
+/* Returns 1 if the future was in the table; the caller drops its reference */
+int
+zw_waiters_remove( struct zw_waiters *w, zw_future_S *fut )
+{
+	struct zw_wait_bucket *b = zw_waiters_bucket( w, fut->node_id, fut->cls, fut->cmd );
+	int listed;
+
+	pthread_mutex_lock( &b->lock );
+	listed = fut->listed;
+	if ( listed ) {
+		list_del( (list_node *)fut );
+		fut->listed = 0;
+	}
+	pthread_mutex_unlock( &b->lock );
+
+	return listed;
+}
+
+void
+zw_waiters_arm( struct zw_waiters *w, zw_future_S *fut, u64 deadline_ns )
+{
+	struct zw_wait_bucket *b = zw_waiters_bucket( w, fut->node_id, fut->cls, fut->cmd );
+
+	pthread_mutex_lock( &b->lock );
+	fut->deadline_ns = deadline_ns;
+	if ( !b->next_deadline_ns || deadline_ns < b->next_deadline_ns )
+		b->next_deadline_ns = deadline_ns;
+	pthread_mutex_unlock( &b->lock );
+
+	if ( !w->next_deadline_ns || deadline_ns < w->next_deadline_ns )
+		w->next_deadline_ns = deadline_ns;
+}
+
+/* A new reference to a pending, shared future for this report, or NULL */
+zw_future_S *
+zw_waiters_find( struct zw_waiters *w, u8 nodeid, u8 cls, u8 cmd )
+{
+	struct zw_wait_bucket *b = zw_waiters_bucket( w, nodeid, cls, cmd );
+	list_node *node = NULL;
+	zw_future_S *fut;
+
+	pthread_mutex_lock( &b->lock );
+	list_foreach( node, (&b->list) ) {
+		fut = (zw_future_S *)node;
+		if ( fut->shared && fut->node_id == nodeid && fut->cls == cls && fut->cmd == cmd ) {
+			zw_future_get( fut );
+			pthread_mutex_unlock( &b->lock );
+			return fut;
+		}
+	}
+	pthread_mutex_unlock( &b->lock );
+
+	return NULL;
+}
+
+void
+zw_waiters_share( struct zw_waiters *w, zw_future_S *fut )
+{
+	struct zw_wait_bucket *b = zw_waiters_bucket( w, fut->node_id, fut->cls, fut->cmd );
+
+	pthread_mutex_lock( &b->lock );
+	fut->shared = fut->listed;
+	pthread_mutex_unlock( &b->lock );
+}
+
+/* Pending futures for this report stop taking new joiners */
+void
+zw_waiters_unshare( struct zw_waiters *w, u8 nodeid, u8 cls, u8 cmd )
+{
+	struct zw_wait_bucket *b = zw_waiters_bucket( w, nodeid, cls, cmd );
+	list_node *node = NULL;
+	zw_future_S *fut;
+
+	pthread_mutex_lock( &b->lock );
+	list_foreach( node, (&b->list) ) {
+		fut = (zw_future_S *)node;
+		if ( fut->node_id == nodeid && fut->cls == cls && fut->cmd == cmd )
+			fut->shared = 0;
+	}
+	pthread_mutex_unlock( &b->lock );
+}
+
+static int
+zw_waiters_complete_all( list_head *done, int status, int val )
+{
+	zw_future_S *fut;
+	int count = 0;
+
+	while ( !list_empty( done ) ) {
+		fut = (zw_future_S *)list_pop_front( done );
+		zw_future_complete( fut, status, val );
+		zw_future_put( fut );
+		count++;
+	}
+
+	return count;
+}
+
+/*
+ * Complete every future waiting for this report. Only the futures of
+ * this key whose request has been written are woken; a get still in the
+ * queue wants a report sent after it. Returns how many there were.
+ */
+int
+zw_waiters_report( struct zw_waiters *w, u8 nodeid, u8 cls, u8 cmd, int val )
+{
+	struct zw_wait_bucket *b = zw_waiters_bucket( w, nodeid, cls, cmd );
+	list_node *node, *next;
+	zw_future_S *fut;
+	list_head done;
+
+	list_init( &done );
+	pthread_mutex_lock( &b->lock );
+	for ( node = b->list.next; node != &b->list; node = next ) {
+		next = node->next;
+		fut = (zw_future_S *)node;
+		if ( fut->node_id != nodeid || fut->cls != cls || fut->cmd != cmd || !fut->deadline_ns )
+			continue;
+		list_del( node );
+		fut->listed = 0;
+		list_add( &done, node );
+	}
+	pthread_mutex_unlock( &b->lock );
+
+	return zw_waiters_complete_all( &done, 0, val );
+}
+
+/*
+ * Time out every armed future past its deadline; returns how many. Only
+ * runs through the buckets once the earliest deadline is due, and
+ * recomputes it on the way.
+ */
+int
+zw_waiters_expire( struct zw_waiters *w, u64 now )
+{
+	struct zw_wait_bucket *b;
+	list_node *node, *next;
+	zw_future_S *fut;
+	list_head done;
+	u64 earliest = 0;
+	int i;
+
+	if ( !w->next_deadline_ns || now < w->next_deadline_ns ) return 0;
+
+	list_init( &done );
+	for ( i = 0; i < ZW_WAIT_BUCKETS; i++ ) {
+		b = &w->bucket[ i ];
+		pthread_mutex_lock( &b->lock );
+		if ( b->next_deadline_ns && now >= b->next_deadline_ns ) {
+			b->next_deadline_ns = 0;
+			for ( node = b->list.next; node != &b->list; node = next ) {
+				next = node->next;
+				fut = (zw_future_S *)node;
+				if ( !fut->deadline_ns )
+					continue;
+				if ( now < fut->deadline_ns ) {
+					if ( !b->next_deadline_ns || fut->deadline_ns < b->next_deadline_ns )
+						b->next_deadline_ns = fut->deadline_ns;
+					continue;
+				}
+				list_del( node );
+				fut->listed = 0;
+				list_add( &done, node );
+			}
+		}
+		if ( b->next_deadline_ns && ( !earliest || b->next_deadline_ns < earliest ) )
+			earliest = b->next_deadline_ns;
+		pthread_mutex_unlock( &b->lock );
+	}
+	w->next_deadline_ns = earliest;
+
+	return zw_waiters_complete_all( &done, ETIMEDOUT, -1 );
+}
+
+/*
+ * Complete every armed future in the table with status; returns how many.
+ * Futures whose request is not written yet, such as one held for a
+ * sleeping node, stay in the table.
+ */
+int
+zw_waiters_fail( struct zw_waiters *w, int status )
+{
+	struct zw_wait_bucket *b;
+	list_node *node, *next;
+	zw_future_S *fut;
+	list_head done;
+	int i;
+
+	list_init( &done );
+	for ( i = 0; i < ZW_WAIT_BUCKETS; i++ ) {
+		b = &w->bucket[ i ];
+		pthread_mutex_lock( &b->lock );
+		for ( node = b->list.next; node != &b->list; node = next ) {
+			next = node->next;
+			fut = (zw_future_S *)node;
+			if ( !fut->deadline_ns )
+				continue;
+			list_del( node );
+			fut->listed = 0;
+			list_add( &done, node );
+		}
+		b->next_deadline_ns = 0;
+		pthread_mutex_unlock( &b->lock );
+	}
+	w->next_deadline_ns = 0;
+
+	return zw_waiters_complete_all( &done, status, -1 );
+}
+
+/*
+ * Earliest report deadline, 0 if none; reader only. It may be early when
+ * a future has completed since; the next expire pass then moves it
+ * forward.
+ */
+u64
+zw_waiters_next_deadline( struct zw_waiters *w )
+{
+	return w->next_deadline_ns;
+}
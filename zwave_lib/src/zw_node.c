@@ -27,13 +27,16 @@
 //      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 //
 #include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
 #include "zw_node.h"
+#include "zw_time.h"
 #include "cmd_class.h"
 #include "log.h"
 
-LIST_HEAD( zw_nodes );
-LIST_HEAD( zw_nodes_pending );
-
 static u8
 get_cmd_class( const u8 gtype )
 {
@@ -57,228 +60,520 @@ get_cmd_class( const u8 gtype )
 	return cmd_cls;
 }
 
+/* seqlock write side; writers still exclude each other with the mutex */
+static void
+zw_node_write_begin( struct zw_node *zwnode )
+{
+	pthread_mutex_lock( &zwnode->lock );
+	__atomic_store_n( &zwnode->seq, zwnode->seq + 1, __ATOMIC_RELAXED );
+	__atomic_thread_fence( __ATOMIC_RELEASE );
+}
+
+static void
+zw_node_write_end( struct zw_node *zwnode )
+{
+	__atomic_store_n( &zwnode->seq, zwnode->seq + 1, __ATOMIC_RELEASE );
+	pthread_mutex_unlock( &zwnode->lock );
+}
+
+/*
+ * Seqlock read side. A writer only holds the sequence odd for a few
+ * stores; if it gets preempted there, yield.
+ */
+static u32
+zw_node_read_begin( struct zw_node *zwnode )
+{
+	u32 seq;
+
+	while ( ( seq = __atomic_load_n( &zwnode->seq, __ATOMIC_ACQUIRE ) ) & 1 )
+		sched_yield();
+
+	return seq;
+}
+
+/* The copy made since zw_node_read_begin() may be torn, read again */
+static int
+zw_node_read_retry( struct zw_node *zwnode, u32 seq )
+{
+	__atomic_thread_fence( __ATOMIC_ACQUIRE );
+	return seq != __atomic_load_n( &zwnode->seq, __ATOMIC_RELAXED );
+}
+
+/* Copy the node without taking its lock */
+void
+zw_node_snapshot( struct zw_node *zwnode, struct zw_node_snapshot *snap )
+{
+	u32 seq;
+
+	do {
+		seq = zw_node_read_begin( zwnode );
+		memcpy( snap->name, zwnode->name, MAX_ZW_NODE_NAME );
+		snap->id = zwnode->id;
+		snap->mode = zwnode->mode;
+		snap->func = zwnode->func;
+		snap->btype = zwnode->btype;
+		snap->gtype = zwnode->gtype;
+		snap->stype = zwnode->stype;
+		snap->cclass = zwnode->cclass;
+		snap->batt_level = zwnode->batt_level;
+		snap->state = zwnode->state;
+	} while ( zw_node_read_retry( zwnode, seq ) );
+
+	snap->name[ MAX_ZW_NODE_NAME - 1 ] = 0;
+	snap->seq = seq;
+}
+
+/* Replaces the previous callback; NULL turns it off */
+void
+zw_node_on_change( zw_api_ctx_S *ctx, zw_node_change_cb cb, void *arg )
+{
+	__atomic_store_n( &ctx->node_change_arg, arg, __ATOMIC_RELAXED );
+	__atomic_store_n( &ctx->node_change, cb, __ATOMIC_RELEASE );
+}
+
+static void
+zw_node_changed( zw_api_ctx_S *ctx, u8 id )
+{
+	zw_node_change_cb cb = __atomic_load_n( &ctx->node_change, __ATOMIC_ACQUIRE );
+
+	if ( cb ) cb( ctx, id, __atomic_load_n( &ctx->node_change_arg, __ATOMIC_RELAXED ) );
+}
+
+/* Snapshots of up to max nodes in id order; returns how many */
 int
-zw_node_set_batt_level( u8 id, u8 level )
+zw_node_snapshot_all( zw_api_ctx_S *ctx, struct zw_node_snapshot *snaps, int max )
 {
-	list_node *node = NULL;
 	struct zw_node *zwnode;
-	int rc = -1;
-
-	list_foreach(node, (&zw_nodes)) {
-		zwnode = (struct zw_node *)node;	
-		if ( zwnode->id == id ) {
-			pthread_mutex_lock( &zwnode->lock );
-			zwnode->batt_level = level;
-			pthread_mutex_unlock( &zwnode->lock );
-			rc = 0;
-			break;
-		}
+	int count = 0;
+
+	zw_foreach_node( ctx, zwnode ) {
+		if ( count == max ) break;
+		zw_node_snapshot( zwnode, &snaps[ count++ ] );
 	}
 
-	return rc;
+	return count;
 }
 
-int
-zw_node_set_state( u8 id, u8 state )
+/*
+ * Remember the value of a class of the node, in the slot already holding
+ * that class, else a free one, else the one learned longest ago.
+ */
+void
+zw_node_cache_value( zw_api_ctx_S *ctx, u8 id, u8 cls, int val, int src )
 {
-	list_node *node = NULL;
-	struct zw_node *zwnode;
-	int rc = -1;
-
-	list_foreach(node, (&zw_nodes)) {
-		zwnode = (struct zw_node *)node;	
-		if ( zwnode->id == id ) {
-			pthread_mutex_lock( &zwnode->lock );
-			if ( zwnode->state != state )
-				SYSLOG_INFO( "State Change on node(%d): %d", id, state );
-			zwnode->state = state;
-			pthread_mutex_unlock( &zwnode->lock );
-			rc = 0;
+	struct zw_node *zwnode = zw_node_find( ctx, id );
+	struct zw_node_value *slot;
+	int i;
+
+	if ( !zwnode || !cls ) return;
+
+	zw_node_write_begin( zwnode );
+	slot = &zwnode->values[ 0 ];
+	for ( i = 0; i < ZW_NODE_VALUES; i++ ) {
+		if ( zwnode->values[ i ].cls == cls && zwnode->values[ i ].when_ns ) {
+			slot = &zwnode->values[ i ];
 			break;
 		}
+		if ( zwnode->values[ i ].when_ns < slot->when_ns )
+			slot = &zwnode->values[ i ];
 	}
+	slot->when_ns = zw_time_ns();
+	slot->val = val;
+	slot->cls = cls;
+	slot->src = src;
+	zw_node_write_end( zwnode );
+}
+
+/*
+ * The cached value of a class of the node, if one was learned within the
+ * last max_age_ms. Returns 0 when value was filled in, -1 otherwise.
+ */
+int
+zw_node_cached_value( zw_api_ctx_S *ctx, u8 id, u8 cls, int max_age_ms, struct zw_node_value *value )
+{
+	struct zw_node *zwnode = zw_node_find( ctx, id );
+	u32 seq;
+	int i;
+
+	if ( !zwnode || 0 >= max_age_ms ) return -1;
+
+	do {
+		seq = zw_node_read_begin( zwnode );
+		value->when_ns = 0;
+		for ( i = 0; i < ZW_NODE_VALUES; i++ ) {
+			if ( zwnode->values[ i ].cls == cls && zwnode->values[ i ].when_ns ) {
+				*value = zwnode->values[ i ];
+				break;
+			}
+		}
+	} while ( zw_node_read_retry( zwnode, seq ) );
+
+	if ( !value->when_ns ||
+	     zw_time_ns() - value->when_ns > (u64)max_age_ms * ZW_NSEC_PER_MSEC )
+		return -1;
+
+	return 0;
+}
+
+/* A lookup with a max age counts toward the cache hit ratio in the cc stats */
+static int
+zw_node_lookup_value( zw_api_ctx_S *ctx, u8 id, u8 cls, int max_age_ms, int *val )
+{
+	struct zw_node_value value;
+	int rc;
+
+	if ( 0 >= max_age_ms ) return -1;
+
+	rc = zw_node_cached_value( ctx, id, cls, max_age_ms, &value );
+	pthread_mutex_lock( &ctx->cc_lock );
+	if ( rc ) ctx->cc_stats.cache_misses++;
+	else ctx->cc_stats.cache_hits++;
+	pthread_mutex_unlock( &ctx->cc_lock );
+	if ( !rc ) *val = value.val;
 
 	return rc;
 }
 
 int
-zw_node_set_label( u8 id, char *label )
+zw_node_set_batt_level( zw_api_ctx_S *ctx, u8 id, u8 level )
 {
-	list_node *node = NULL;
-	struct zw_node *zwnode;
-	int rc = -1;
-
-	list_foreach(node, (&zw_nodes)) {
-		zwnode = (struct zw_node *)node;	
-		if ( zwnode->id == id ) {
-			pthread_mutex_lock( &zwnode->lock );
-			snprintf( zwnode->name, MAX_ZW_NODE_NAME, "%s", label );
-			pthread_mutex_unlock( &zwnode->lock );
-			rc = 0;
-			break;
-		}
+	struct zw_node *zwnode = zw_node_find( ctx, id );
+	int changed;
+
+	if ( !zwnode ) return -1;
+
+	zw_node_write_begin( zwnode );
+	changed = zwnode->batt_level != level;
+	zwnode->batt_level = level;
+	zw_node_write_end( zwnode );
+	if ( changed ) zw_node_changed( ctx, id );
+
+	return 0;
+}
+
+int
+zw_node_set_state( zw_api_ctx_S *ctx, u8 id, u8 state )
+{
+	struct zw_node *zwnode = zw_node_find( ctx, id );
+	int changed;
+
+	if ( !zwnode ) return -1;
+
+	zw_node_write_begin( zwnode );
+	changed = zwnode->state != state;
+	zwnode->state = state;
+	zw_node_write_end( zwnode );
+	if ( changed ) {
+		SYSLOG_INFO( "State Change on node(%d): %d", id, state );
+		zw_node_changed( ctx, id );
 	}
 
-	return rc;
+	return 0;
+}
+
+int
+zw_node_set_label( zw_api_ctx_S *ctx, u8 id, char *label )
+{
+	struct zw_node *zwnode = zw_node_find( ctx, id );
 
+	if ( !zwnode ) return -1;
+
+	zw_node_write_begin( zwnode );
+	snprintf( zwnode->name, MAX_ZW_NODE_NAME, "%s", label );
+	zw_node_write_end( zwnode );
+	zw_node_changed( ctx, id );
+
+	return 0;
 }
 
+/*
+ * Runs in the reader thread, so it only queues the gets; the reports
+ * update the node when they come in.
+ */
 void
 zw_node_wakeup_handler( zw_api_ctx_S *ctx, u8 id )
 {
-	list_node *node = NULL;
-	struct zw_node *zwnode;
-	int batt = -1;
-	int state = -1;
-
-	list_foreach(node, (&zw_nodes)) {
-		zwnode = (struct zw_node *)node;	
-		if ( zwnode->id == id ) {
-			if ( 0 != cc_get( ctx, id, COMMAND_CLASS_BATTERY, (void *)&batt ) )
-				SYSLOG_FAULT( "Get Battery state command failed for node %d", id );
-			if ( 0 != cc_get( ctx, id, zwnode->cclass, (void *)&state ) )
-				SYSLOG_FAULT( "Get state command failed for node %d", id );
-			break;
-		}
-	}
+	struct zw_node *zwnode = zw_node_find( ctx, id );
+	zw_future_S *fut;
+
+	if ( !zwnode ) return;
+
+	fut = cc_get_async( ctx, id, COMMAND_CLASS_BATTERY );
+	if ( !fut )
+		SYSLOG_FAULT( "Get Battery state command failed for node %d", id );
+	zw_future_put( fut );
+	fut = cc_get_async( ctx, id, zwnode->cclass );
+	if ( !fut )
+		SYSLOG_FAULT( "Get state command failed for node %d", id );
+	zw_future_put( fut );
 }
 
 int
 zw_node_get_version( zw_api_ctx_S *ctx, u8 id, void *resp )
 {
-	list_node *node = NULL;
-	struct zw_node *zwnode;
-	int rc = -1;
+	struct zw_node *zwnode = zw_node_find( ctx, id );
 
-	list_foreach(node, (&zw_nodes)) {
-		zwnode = (struct zw_node *)node;	
-		if ( zwnode->id == id ) {
-			rc = cc_version( ctx, id, zwnode->cclass, resp );
-			break;
-		}
-	}
+	if ( !zwnode ) return -1;
 
-	return rc;
+	return cc_version( ctx, id, zwnode->cclass, resp );
 }
 
+/*
+ * The node's value, from the cache if it was learned within max_age_ms,
+ * else from the node. A max_age_ms of 0 always asks the node.
+ */
 int
-zw_node_get_value( zw_api_ctx_S *ctx, u8 id, void *resp )
+zw_node_get_value( zw_api_ctx_S *ctx, u8 id, int max_age_ms, void *resp )
 {
-	list_node *node = NULL;
-	struct zw_node *zwnode;
-	int rc = -1;
+	struct zw_node *zwnode = zw_node_find( ctx, id );
 
-	list_foreach(node, (&zw_nodes)) {
-		zwnode = (struct zw_node *)node;	
-		if ( zwnode->id == id ) {
-			rc = cc_get( ctx, id, zwnode->cclass, resp );
-			break;
-		}
+	if ( !zwnode ) return -1;
+
+	if ( !zw_node_lookup_value( ctx, id, zwnode->cclass, max_age_ms, (int *)resp ) )
+		return 0;
+
+	return cc_get( ctx, id, zwnode->cclass, resp );
+}
+
+/* As zw_node_get_value(); a cache hit returns a future that is already done */
+zw_future_S *
+zw_node_get_value_async( zw_api_ctx_S *ctx, u8 id, int max_age_ms )
+{
+	struct zw_node *zwnode = zw_node_find( ctx, id );
+	zw_future_S *fut;
+	int val;
+
+	if ( !zwnode ) return NULL;
+
+	if ( !zw_node_lookup_value( ctx, id, zwnode->cclass, max_age_ms, &val ) ) {
+		fut = zw_future_new( ctx, id, zwnode->cclass, 0 );
+		if ( fut ) zw_future_complete( fut, 0, val );
+		return fut;
 	}
 
-	return rc;
+	return cc_get_async( ctx, id, zwnode->cclass );
+}
+
+/* arg carries the class and the value set, see zw_node_set_value_async() */
+static void
+zw_node_set_done( zw_future_S *fut, void *arg )
+{
+	uintptr_t set = (uintptr_t)arg;
+
+	if ( fut->status ) return;
+
+	zw_node_cache_value( fut->ctx, fut->node_id, set >> 8, set & 0xff, ZW_VALUE_SET );
+	zw_node_set_state( fut->ctx, fut->node_id, set & 0xff );
+}
+
+/*
+ * Once the node acknowledges the set, its value is cached and becomes the
+ * node's state; a check answered from the cache brings no report to do it.
+ */
+zw_future_S *
+zw_node_set_value_async( zw_api_ctx_S *ctx, u8 id, void *value )
+{
+	struct zw_node *zwnode = zw_node_find( ctx, id );
+	zw_future_S *fut;
+
+	if ( !zwnode ) return NULL;
+
+	fut = cc_set_async( ctx, id, zwnode->cclass, value );
+	if ( fut )
+		zw_future_on_complete( fut, zw_node_set_done,
+				       (void *)(uintptr_t)( ( zwnode->cclass << 8 ) | ( *(int *)value & 0xff ) ) );
+
+	return fut;
 }
 
 int
 zw_node_set_value( zw_api_ctx_S *ctx, u8 id, void *value )
 {
-	list_node *node = NULL;
-	struct zw_node *zwnode;
-	int rc = -1;
+	struct zw_node *zwnode = zw_node_find( ctx, id );
 
-	list_foreach(node, (&zw_nodes)) {
-		zwnode = (struct zw_node *)node;	
-		if ( zwnode->id == id ) {
-			rc = cc_set( ctx, id, zwnode->cclass, value );
-			break;
+	if ( !zwnode ) return -1;
+
+	return cc_set( ctx, id, zwnode->cclass, value );
+}
+
+/*
+ * Mark in ok[] the nodes that have reported state on their own since
+ * since_ns, or been learned to have it any other way, waiting up to
+ * ZW_GROUP_REPORT_WINDOW_MS for the rest. Returns how many were marked.
+ */
+static int
+zw_node_collect_reports( zw_api_ctx_S *ctx, const u8 *ids, const u8 *classes, int count,
+			 int state, u64 since_ns, u8 *ok )
+{
+	struct timespec ts = { 0, ZW_GROUP_POLL_MS * ZW_NSEC_PER_MSEC };
+	u64 end = zw_time_ns() + ZW_GROUP_REPORT_WINDOW_MS * ZW_NSEC_PER_MSEC;
+	struct zw_node_value value;
+	int i, pending, marked = 0;
+
+	while ( 1 ) {
+		pending = 0;
+		for ( i = 0; i < count; i++ ) {
+			if ( ok[ i ] ) continue;
+			if ( !zw_node_cached_value( ctx, ids[ i ], classes[ i ], INT_MAX, &value ) &&
+			     value.when_ns >= since_ns && !value.val == !state ) {
+				ok[ i ] = 1;
+				marked++;
+			}
+			else pending++;
 		}
+		if ( !pending || zw_time_ns() >= end ) break;
+		nanosleep( &ts, NULL );
 	}
 
-	return rc;
+	return marked;
 }
 
+/*
+ * Ask every node in ids not yet marked for its state at once and mark the
+ * ones that reported state in ok[]; a round costs one report timeout at
+ * most.
+ */
+static void
+zw_node_check_group( zw_api_ctx_S *ctx, const u8 *ids, const u8 *classes, int count,
+		     int state, u8 *ok )
+{
+	zw_future_S *fut[ MAX_ZWAVE_NODES ];
+	int i, val;
+
+	for ( i = 0; i < count; i++ )
+		fut[ i ] = ok[ i ] ? NULL : cc_get_async( ctx, ids[ i ], classes[ i ] );
+	for ( i = 0; i < count; i++ ) {
+		if ( !fut[ i ] ) continue;
+		if ( !zw_future_wait( fut[ i ], CC_GET_TIMEOUT_MS, &val ) && !val == !state )
+			ok[ i ] = 1;
+		zw_future_put( fut[ i ] );
+	}
+}
+
+/*
+ * Switch several nodes with one frame per CC_MULTICAST_MAX nodes instead
+ * of a set and a get per node: a SEND_DATA_MULTI to the listening switches
+ * in ids, or a SWITCH_ALL broadcast to every switch when ids is NULL.
+ * Nobody acknowledges a multicast, but nodes with a lifeline report their
+ * new state: those reports are collected for a short window, only the
+ * silent nodes are then asked for their state, together, and only the
+ * ones that didn't follow get a singlecast set and another check. Returns
+ * 0 when every node confirmed.
+ */
 int
-zw_node_get_report( zw_api_ctx_S *ctx, u8 id, void *resp )
+zw_node_set_group( zw_api_ctx_S *ctx, const u8 *ids, int count, int state, struct zw_group_result *res )
 {
-	list_node *node = NULL;
+	u8 tid[ MAX_ZWAVE_NODES ], tcls[ MAX_ZWAVE_NODES ], ok[ MAX_ZWAVE_NODES ];
+	zw_future_S *fut[ MAX_ZWAVE_NODES ];
 	struct zw_node *zwnode;
-	int rc = -1;
+	int ntargets = 0, nfut = 0;
+	int i, val = state;
+	u64 since_ns;
+
+	memset( res, 0, sizeof( *res ) );
+	memset( ok, 0, sizeof( ok ) );
+
+	zw_foreach_node( ctx, zwnode ) {
+		if ( ids && !memchr( ids, zwnode->id, count ) ) continue;
+		if ( !( zwnode->mode & ZW_NODE_MODE_LISTENING ) ||
+		     ( COMMAND_CLASS_SWITCH_BINARY != zwnode->cclass &&
+		       COMMAND_CLASS_SWITCH_TOGGLE_BINARY != zwnode->cclass ) ) continue;
+		tid[ ntargets ] = zwnode->id;
+		tcls[ ntargets ] = zwnode->cclass;
+		ntargets++;
+	}
+	for ( i = 0; ids && i < count; i++ ) {
+		if ( !memchr( tid, ids[ i ], ntargets ) && res->nfailed < MAX_ZWAVE_NODES )
+			res->failed[ res->nfailed++ ] = ids[ i ];
+	}
+	if ( !ntargets ) goto out;
+
+	since_ns = zw_time_ns();
+	if ( !ids )
+		fut[ nfut++ ] = cc_set_group_async( ctx, tid, tcls, ntargets, state, 1 );
+	for ( i = 0; ids && i < ntargets; i += CC_MULTICAST_MAX )
+		fut[ nfut++ ] = cc_set_group_async( ctx, tid + i, tcls + i,
+						    ntargets - i < CC_MULTICAST_MAX ? ntargets - i : CC_MULTICAST_MAX,
+						    state, 0 );
+
+	for ( i = 0; i < nfut; i++ ) {
+		if ( fut[ i ] && !zw_future_wait( fut[ i ], CC_GET_TIMEOUT_MS, NULL ) ) res->frames++;
+		zw_future_put( fut[ i ] );
+	}
+	res->reported = zw_node_collect_reports( ctx, tid, tcls, ntargets, state, since_ns, ok );
+	zw_node_check_group( ctx, tid, tcls, ntargets, state, ok );
 
-	list_foreach(node, (&zw_nodes)) {
-		zwnode = (struct zw_node *)node;	
-		if ( zwnode->id == id ) {
-			rc = cc_report( ctx, id, zwnode->cclass, resp );
-			break;
-		}
+	for ( i = 0; i < ntargets; i++ ) {
+		if ( ok[ i ] ) continue;
+		zw_future_put( cc_set_async( ctx, tid[ i ], tcls[ i ], &val ) );
+		res->followups++;
 	}
+	if ( res->followups )
+		zw_node_check_group( ctx, tid, tcls, ntargets, state, ok );
 
-	return rc;
+	for ( i = 0; i < ntargets; i++ ) {
+		if ( ok[ i ] ) res->confirmed++;
+		else if ( res->nfailed < MAX_ZWAVE_NODES ) res->failed[ res->nfailed++ ] = tid[ i ];
+	}
+	SYSLOG_INFO( "group set %d: %d node(s) in %d frame(s), %d reported, %d follow-up(s), %d failed",
+		     state, ntargets, res->frames, res->reported, res->followups, res->nfailed );
+out:
+	return res->nfailed ? -1 : 0;
+}
+
+int
+zw_node_get_report( zw_api_ctx_S *ctx, u8 id, void *resp )
+{
+	struct zw_node *zwnode = zw_node_find( ctx, id );
+
+	if ( !zwnode ) return -1;
+
+	return cc_report( ctx, id, zwnode->cclass, resp );
 }
 
 int
 zw_node_get_battery_status( zw_api_ctx_S *ctx, u8 id, void *resp )
 {
-	list_node *node = NULL;
-	struct zw_node *zwnode;
-	int rc = -1;
+	struct zw_node *zwnode = zw_node_find( ctx, id );
 
-	list_foreach(node, (&zw_nodes)) {
-		zwnode = (struct zw_node *)node;
-		if ( zwnode->id == id ) {
-			rc = cc_get( ctx, id, COMMAND_CLASS_BATTERY, resp );
-			break;
-		}
-	}
+	if ( !zwnode ) return -1;
 
-	return rc;
+	return cc_get( ctx, id, COMMAND_CLASS_BATTERY, resp );
 }
 
 int
 zw_node_set_wakeup_interval( zw_api_ctx_S *ctx, u8 id, int intvl )
 {
-	list_node *node = NULL;
-	struct zw_node *zwnode;
-	int rc = -1;
 	int val = intvl;
 
-	list_foreach(node, (&zw_nodes)) {
-		zwnode = (struct zw_node *)node;
-		if ( zwnode->id == id ) {
-			rc = cc_set( ctx, id, COMMAND_CLASS_WAKE_UP, (void *)&val );
-			break;
-		}
-	}
+	if ( !zw_node_find( ctx, id ) ) return -1;
 
-	return rc;
+	return cc_set( ctx, id, COMMAND_CLASS_WAKE_UP, (void *)&val );
 }
 
 int
 zw_node_get_wakeup_interval( zw_api_ctx_S *ctx, u8 id, void *resp )
 {
-	list_node *node = NULL;
-	struct zw_node *zwnode;
-	int rc = -1;
+	if ( !zw_node_find( ctx, id ) ) return -1;
 
-	list_foreach(node, (&zw_nodes)) {
-		zwnode = (struct zw_node *)node;
-		if ( zwnode->id == id ) {
-			rc = cc_get( ctx, id, COMMAND_CLASS_WAKE_UP, resp );
-			break;
-		}
-	}
-
-	return rc;
+	return cc_get( ctx, id, COMMAND_CLASS_WAKE_UP, resp );
 }
 
 void 
-zw_list_nodes()
+zw_list_nodes( zw_api_ctx_S *ctx )
 {
-	list_node *node = NULL;
 	struct zw_node *zwnode;
-
-	list_foreach(node, (&zw_nodes)) {
-		zwnode = (struct zw_node *)node;	
-		SYSLOG_INFO( "ZW_NODE: %s - %d\n", zwnode->name, zwnode->id );
+	struct zw_node_snapshot snap;
+	struct zw_rtt rtt;
+
+	zw_foreach_node( ctx, zwnode ) {
+		zw_node_snapshot( zwnode, &snap );
+		zw_api_get_rtt( ctx, snap.id, &rtt );
+		SYSLOG_INFO( "ZW_NODE: %s - %d rtt %llu us (var %llu us) rto %llu ms timeouts %u\n",
+				snap.name, snap.id,
+				(unsigned long long)( rtt.srtt_ns / 1000 ),
+				(unsigned long long)( rtt.rttvar_ns / 1000 ),
+				(unsigned long long)( rtt.rto_ns / ZW_NSEC_PER_MSEC ), rtt.timeouts );
 /*
 		printf( "	btype: %s\n", zw_get_basic_type( zwnode->btype ) );
 		printf( "	gtype: %s\n", zw_get_gen_type( zwnode->gtype ) );
@@ -288,16 +583,55 @@ zw_list_nodes()
 	}
 }
 
-list_head *
-zw_get_node_list()
+/* O(1): nodes are indexed by id */
+struct zw_node *
+zw_node_find( zw_api_ctx_S *ctx, int id )
+{
+	if ( 0 >= id || ZW_MAX_NODE_ID < id ) return NULL;
+
+	return __atomic_load_n( &ctx->node_table[ id ], __ATOMIC_ACQUIRE );
+}
+
+/*
+ * The node with the lowest id above prev, NULL past the last one. The
+ * bitmap skips 32 absent ids per word, so a walk touches at most eight
+ * words and the table entries of the nodes that are there.
+ */
+struct zw_node *
+zw_node_next( zw_api_ctx_S *ctx, int prev )
 {
-	return (&zw_nodes);
+	struct zw_node *zwnode;
+	int id = prev + 1;
+	u32 word;
+
+	while ( 0 < id && ZW_MAX_NODE_ID >= id ) {
+		word = __atomic_load_n( &ctx->node_map[ id / 32 ], __ATOMIC_ACQUIRE ) >> ( id % 32 );
+		if ( !word ) {
+			id = ( id / 32 + 1 ) * 32;
+			continue;
+		}
+		id += __builtin_ctz( word );
+		zwnode = zw_node_find( ctx, id );
+		if ( zwnode ) return zwnode;
+		id++;
+	}
+
+	return NULL;
 }
 
+/* Called by the reader; other threads only look nodes up */
 struct zw_node *
-create_zw_node( int id )
+create_zw_node( zw_api_ctx_S *ctx, int id )
 {
-	struct zw_node *zwnode = calloc( 1, sizeof( struct zw_node ) );
+	struct zw_node *zwnode = zw_node_find( ctx, id );
+
+	if ( zwnode ) goto out;
+	if ( 0 >= id || ZW_MAX_NODE_ID < id ) {
+		SYSLOG_WARN( "create_zw_node: invalid node id %d", id );
+		goto out;
+	}
+
+	zwnode = calloc( 1, sizeof( struct zw_node ) );
 	if ( !zwnode ) {
 		perror( "zw_node" );
 		goto out;
@@ -306,7 +640,8 @@ create_zw_node( int id )
 	zwnode->id     = id;
 	pthread_mutex_init( &zwnode->lock, NULL );
 
-	list_add((list_node *)&zw_nodes, (list_node *)zwnode);
+	__atomic_store_n( &ctx->node_table[ id ], zwnode, __ATOMIC_RELEASE );
+	__atomic_fetch_or( &ctx->node_map[ id / 32 ], 1u << ( id % 32 ), __ATOMIC_RELEASE );
 out:
 	return zwnode;
 }
@@ -314,52 +649,46 @@ out:
 int 
 register_zw_node( zw_api_ctx_S *ctx, const u8 *frame, int id )
 {
-	list_node *node = NULL;
-	struct zw_node *zwnode;
-	int rc = -1;
+	struct zw_node *zwnode = zw_node_find( ctx, id );
+	u8 buff[ 2 ];
 
 	SYSLOG_INFO( "register_zw_node: %d\n", id );
-	fflush(stdout);
-	list_foreach(node, (&zw_nodes)) {
-		zwnode = (struct zw_node *)node;	
-		if ( zwnode->id == id ) {
-
-			zwnode->mode  = frame[ 2 ];	
-			zwnode->func  = frame[ 3 ];	
-			zwnode->btype  = frame[ 5 ];	
-			zwnode->gtype  = frame[ 6 ];	
-			zwnode->stype  = frame[ 7 ];	
-			zwnode->cclass = get_cmd_class( zwnode->gtype );
-			cc_get( ctx, id, zwnode->cclass, (void *)&zwnode->state );
-			rc = 0;
-                        SYSLOG_INFO( "register_zw_node: %d func=%d, bt=%d, gt=%d, st=%d\n", id,
-                                    zwnode->func, zwnode->btype, zwnode->gtype, zwnode->stype );
-			break;
-		}
+	if ( !zwnode ) return -1;
+
+	zw_node_write_begin( zwnode );
+	zwnode->mode  = frame[ 2 ];	
+	zwnode->func  = frame[ 3 ];	
+	zwnode->btype  = frame[ 5 ];	
+	zwnode->gtype  = frame[ 6 ];	
+	zwnode->stype  = frame[ 7 ];	
+	zwnode->cclass = get_cmd_class( zwnode->gtype );
+	zw_node_write_end( zwnode );
+	zw_node_changed( ctx, id );
+	zw_api_set_sleeping( ctx, id, !( zwnode->mode & ZW_NODE_MODE_LISTENING ) );
+	if ( zwnode->mode & ZW_NODE_MODE_LISTENING ) {
+		/* the node information frame tells whether it takes MULTI_CMD */
+		buff[ 0 ] = FUNC_ID_ZW_REQUEST_NODE_INFO;
+		buff[ 1 ] = id;
+		zw_send_request_prio( ctx, buff, 2, id, RESP_REQ, FUNC_ID_ZW_REQUEST_NODE_INFO,
+				      ZW_PRIO_BACKGROUND );
 	}
+	/* called by the reader; the report fills in the state */
+	zw_future_put( cc_get_async( ctx, id, zwnode->cclass ) );
+	SYSLOG_INFO( "register_zw_node: %d func=%d, bt=%d, gt=%d, st=%d\n", id,
+		     zwnode->func, zwnode->btype, zwnode->gtype, zwnode->stype );
 
-	return rc;
+	return 0;
 }
 
+/* The node isn't freed: another thread may still be using it */
 int 
-unregister_zw_node( int id )
+unregister_zw_node( zw_api_ctx_S *ctx, int id )
 {
-	list_node *node = NULL;
-	struct zw_node *zwnode;
-	int rc = -1;
+	if ( !zw_node_find( ctx, id ) ) return -1;
 
-	list_foreach(node, (&zw_nodes)) {
-		zwnode = (struct zw_node *)node;	
-		if ( zwnode->id == id ) {
-			rc = 0;
-			break;
-		}
-	}
-
-	if ( 0 == rc ) 
-		list_remove((list_node *)&zw_nodes, (list_node *)zwnode);
+	__atomic_fetch_and( &ctx->node_map[ id / 32 ], ~( 1u << ( id % 32 ) ), __ATOMIC_RELEASE );
+	__atomic_store_n( &ctx->node_table[ id ], NULL, __ATOMIC_RELEASE );
+	zw_node_changed( ctx, id );
 
-	return rc;
+	return 0;
 }
-
-
@@ -0,0 +1,131 @@
+//
+//  Created by Praveen Murali Nair on 09/07/2013.
+//  Copyright (c) 2013 Praveen M Nair. All rights reserved.
+//
+// 	Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are met:
+//      * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//      * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//      * Neither the name of the <organization> nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//      ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//      WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//      DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+//      DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//      (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//       LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//      ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "zw_pool.h"
+#include "log.h"
+
+#define ZW_POOL_GEN( head )	( ( ( head ) >> 32 ) + 1 )
+
+int
+zw_pool_init( struct zw_pool *pool, size_t size, u32 capacity )
+{
+	u32 i;
+
+	memset( pool, 0, sizeof( *pool ) );
+	if ( !capacity ) capacity = ZW_POOL_DEFAULT;
+
+	/* keep every object aligned for the mutexes and u64s inside */
+	pool->size = ( size + 15 ) & ~(size_t)15;
+	pool->capacity = capacity;
+	pool->mem = calloc( capacity, pool->size );
+	pool->next = calloc( capacity, sizeof( u32 ) );
+	if ( !pool->mem || !pool->next ) {
+		SYSLOG_FAULT( "calloc failed" );
+		zw_pool_destroy( pool );
+		return -1;
+	}
+
+	for ( i = 0; i < capacity; i++ )
+		pool->next[ i ] = ( i + 1 < capacity ) ? i + 2 : 0;
+	pool->head = 1;
+
+	return 0;
+}
+
+void
+zw_pool_destroy( struct zw_pool *pool )
+{
+	free( pool->mem );
+	free( pool->next );
+	pool->mem = NULL;
+	pool->next = NULL;
+	pool->capacity = 0;
+	pool->head = 0;
+}
+
+/* A zeroed object, or NULL with errno set to ENOBUFS when all are in use */
+void *
+zw_pool_get( struct zw_pool *pool )
+{
+	u64 head = __atomic_load_n( &pool->head, __ATOMIC_ACQUIRE );
+	u64 new;
+	u32 top, used, high;
+	void *obj;
+
+	do {
+		top = (u32)head;
+		if ( !top ) {
+			__atomic_add_fetch( &pool->exhausted, 1, __ATOMIC_RELAXED );
+			errno = ENOBUFS;
+			return NULL;
+		}
+		new = ZW_POOL_GEN( head ) << 32 | __atomic_load_n( &pool->next[ top - 1 ], __ATOMIC_RELAXED );
+	} while ( !__atomic_compare_exchange_n( &pool->head, &head, new, 1,
+						__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE ) );
+
+	__atomic_add_fetch( &pool->allocs, 1, __ATOMIC_RELAXED );
+	used = __atomic_add_fetch( &pool->in_use, 1, __ATOMIC_RELAXED );
+	high = __atomic_load_n( &pool->high_water, __ATOMIC_RELAXED );
+	while ( used > high &&
+		!__atomic_compare_exchange_n( &pool->high_water, &high, used, 1,
+					      __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+		;
+
+	obj = pool->mem + (size_t)( top - 1 ) * pool->size;
+	memset( obj, 0, pool->size );
+
+	return obj;
+}
+
+void
+zw_pool_put( struct zw_pool *pool, void *obj )
+{
+	u32 idx = ( (u8 *)obj - pool->mem ) / pool->size + 1;
+	u64 head = __atomic_load_n( &pool->head, __ATOMIC_RELAXED );
+	u64 new;
+
+	do {
+		__atomic_store_n( &pool->next[ idx - 1 ], (u32)head, __ATOMIC_RELAXED );
+		new = ZW_POOL_GEN( head ) << 32 | idx;
+	} while ( !__atomic_compare_exchange_n( &pool->head, &head, new, 1,
+						__ATOMIC_RELEASE, __ATOMIC_RELAXED ) );
+
+	__atomic_sub_fetch( &pool->in_use, 1, __ATOMIC_RELAXED );
+}
+
+void
+zw_pool_get_stats( struct zw_pool *pool, struct zw_pool_stats *stats )
+{
+	stats->capacity = pool->capacity;
+	stats->in_use = __atomic_load_n( &pool->in_use, __ATOMIC_RELAXED );
+	stats->high_water = __atomic_load_n( &pool->high_water, __ATOMIC_RELAXED );
+	stats->allocs = __atomic_load_n( &pool->allocs, __ATOMIC_RELAXED );
+	stats->exhausted = __atomic_load_n( &pool->exhausted, __ATOMIC_RELAXED );
+}
@@ -0,0 +1,113 @@
+//
+//  Created by Praveen Murali Nair on 09/07/2013.
+//  Copyright (c) 2013 Praveen M Nair. All rights reserved.
+//
+// 	Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are met:
+//      * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//      * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//      * Neither the name of the <organization> nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//      ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//      WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//      DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+//      DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//      (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//       LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//      ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "zw_ring.h"
+#include "log.h"
+
+/* capacity is rounded up to a power of two */
+int
+zw_ring_init( struct zw_ring *ring, u32 capacity )
+{
+	u32 size = 1;
+	u32 i;
+
+	memset( ring, 0, sizeof( *ring ) );
+	while ( size < capacity ) size <<= 1;
+
+	ring->slots = calloc( size, sizeof( *ring->slots ) );
+	if ( !ring->slots ) {
+		SYSLOG_FAULT( "calloc failed" );
+		return -1;
+	}
+	for ( i = 0; i < size; i++ )
+		ring->slots[ i ].seq = i;
+	ring->mask = size - 1;
+
+	return 0;
+}
+
+void
+zw_ring_destroy( struct zw_ring *ring )
+{
+	free( ring->slots );
+	ring->slots = NULL;
+}
+
+/*
+ * A slot is free for position pos when its sequence is pos, and holds an
+ * item for the consumer when it is pos + 1. Returns -1 with errno ENOBUFS
+ * when the ring is full.
+ */
+int
+zw_ring_push( struct zw_ring *ring, void *item )
+{
+	struct zw_ring_slot *slot;
+	u32 pos = __atomic_load_n( &ring->tail, __ATOMIC_RELAXED );
+	int diff;
+
+	for ( ;; ) {
+		slot = &ring->slots[ pos & ring->mask ];
+		diff = (int)( __atomic_load_n( &slot->seq, __ATOMIC_ACQUIRE ) - pos );
+		if ( !diff ) {
+			if ( __atomic_compare_exchange_n( &ring->tail, &pos, pos + 1, 1,
+							  __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+				break;
+		}
+		else if ( 0 > diff ) {
+			__atomic_add_fetch( &ring->full, 1, __ATOMIC_RELAXED );
+			errno = ENOBUFS;
+			return -1;
+		}
+		else
+			pos = __atomic_load_n( &ring->tail, __ATOMIC_RELAXED );
+	}
+
+	slot->item = item;
+	__atomic_store_n( &slot->seq, pos + 1, __ATOMIC_RELEASE );
+
+	return 0;
+}
+
+/* Next item in the order the pushes claimed their slots, NULL when empty */
+void *
+zw_ring_pop( struct zw_ring *ring )
+{
+	struct zw_ring_slot *slot = &ring->slots[ ring->head & ring->mask ];
+	void *item;
+
+	if ( __atomic_load_n( &slot->seq, __ATOMIC_ACQUIRE ) != ring->head + 1 )
+		return NULL;
+
+	item = slot->item;
+	__atomic_store_n( &slot->seq, ring->head + ring->mask + 1, __ATOMIC_RELEASE );
+	ring->head++;
+
+	return item;
+}
@@ -0,0 +1,413 @@
+//
+//  Created by Praveen Murali Nair on 09/07/2013.
+//  Copyright (c) 2013 Praveen M Nair. All rights reserved.
+//
+// 	Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are met:
+//      * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//      * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//      * Neither the name of the <organization> nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//      ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//      WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//      DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+//      DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//      (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//       LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//      ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/file.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <termios.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "zw_transport.h"
+#include "zw_time.h"
+#include "log.h"
+
+#define ZW_RTT_EWMA_SHIFT	3	/* avg += (sample - avg) / 8 */
+#define ZW_CONNECT_TIMEOUT_S	1	/* the reader waits out a reconnect attempt */
+
+static int
+tty_open( struct zw_transport *tp, const char *path )
+{
+        struct termios tios;
+	int rc = -1;
+
+	tp->fd = open( path, O_RDWR | O_NOCTTY );
+        if ( tp->fd < 0) {
+		perror( path );
+		goto out;
+	}
+ 
+        if ( flock( tp->fd, LOCK_EX | LOCK_NB ) < 0 ) {
+		perror( path );
+                goto err;
+        }
+	memset( &tios, 0, sizeof( tios ) );
+        tios.c_cflag = CS8 | CREAD | CLOCAL;
+
+        tios.c_cc[VMIN] = 1; 
+        tios.c_cc[VTIME] = 0;
+
+        cfsetispeed( &tios, BAUDRATE );
+        cfsetospeed( &tios, BAUDRATE );
+
+        tios.c_lflag = 0;
+
+        tios.c_iflag = IGNBRK;
+        tios.c_oflag = 0;
+
+	tcflush( tp->fd, TCIOFLUSH );
+        if ( 0 > tcsetattr( tp->fd, TCSANOW, &tios ) ) {
+		perror( path );
+                goto err;
+        }
+
+        usleep ( 1000 );  
+	tcflush( tp->fd, TCIOFLUSH );
+	rc = 0;
+	goto out;
+err:
+	close( tp->fd );
+	tp->fd = -1;
+out:
+        return rc;
+}
+
+/*
+ * Resolve host:port, or [host]:port for an IPv6 literal, into tp->addrs.
+ * Done once when the transport is opened so a reconnect on the reader
+ * thread never waits on the resolver.
+ */
+static int
+tcp_resolve( struct zw_transport *tp, const char *path )
+{
+	struct addrinfo hints;
+	char host[ ZW_MAX_URI ];
+	const char *port;
+	size_t hlen;
+	int rc = -1;
+
+	port = strrchr( path, ':' );
+	if ( !port || port == path || ( port - path ) >= ZW_MAX_URI ) {
+		SYSLOG_FAULT( "tcp transport: expected host:port, got %s", path );
+		goto out;
+	}
+	snprintf( host, port - path + 1, "%s", path );
+	port++;
+
+	hlen = strlen( host );
+	if ( '[' == host[ 0 ] && ']' == host[ hlen - 1 ] ) {
+		memmove( host, host + 1, hlen - 2 );
+		host[ hlen - 2 ] = '\0';
+	}
+
+	memset( &hints, 0, sizeof( hints ) );
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ( 0 != getaddrinfo( host, port, &hints, &tp->addrs ) ) {
+		SYSLOG_FAULT( "tcp transport: cannot resolve %s", path );
+		tp->addrs = NULL;
+		goto out;
+	}
+	rc = 0;
+out:
+	return rc;
+}
+
+/*
+ * Connect to the first address that answers. The attempts share one
+ * ZW_CONNECT_TIMEOUT_S budget, since a reconnect runs on the reader.
+ */
+static int
+tcp_open( struct zw_transport *tp, const char *path )
+{
+	struct addrinfo *ai;
+	struct timeval tv;
+	struct timeval no_tv = { 0, 0 };
+	u64 start, now, deadline;
+	int one = 1;
+	int rc = -1;
+
+	if ( !tp->addrs && tcp_resolve( tp, path ) ) goto out;
+
+	start = zw_time_ns();
+	deadline = start + ZW_CONNECT_TIMEOUT_S * ZW_NSEC_PER_SEC;
+	for ( ai = tp->addrs; ai; ai = ai->ai_next ) {
+		now = zw_time_ns();
+		if ( now >= deadline ) break;
+
+		tp->fd = socket( ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol );
+		if ( 0 > tp->fd ) continue;
+
+		/* bounds connect(), then writes block again */
+		tv.tv_sec = ( deadline - now ) / ZW_NSEC_PER_SEC;
+		tv.tv_usec = ( ( deadline - now ) % ZW_NSEC_PER_SEC ) / 1000;
+		setsockopt( tp->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof( tv ) );
+		if ( 0 == connect( tp->fd, ai->ai_addr, ai->ai_addrlen ) ) {
+			setsockopt( tp->fd, SOL_SOCKET, SO_SNDTIMEO, &no_tv, sizeof( no_tv ) );
+			SYSLOG_INFO( "tcp transport: connected to %s in %llu us", path,
+				     ( zw_time_ns() - start ) / 1000 );
+			break;
+		}
+		close( tp->fd );
+		tp->fd = -1;
+	}
+
+	if ( 0 > tp->fd ) {
+		SYSLOG_FAULT( "tcp transport: connect to %s failed", path );
+		goto out;
+	}
+
+	/* every frame is latency critical; never wait to coalesce segments */
+	setsockopt( tp->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+	setsockopt( tp->fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof( one ) );
+	rc = 0;
+out:
+	return rc;
+}
+
+static int
+fd_read( struct zw_transport *tp, u8 *buff, int len )
+{
+	return read( tp->fd, buff, len );
+}
+
+static int
+fd_write( struct zw_transport *tp, const u8 *buff, int len )
+{
+	int done = 0;
+	int rc;
+
+	while ( done < len ) {
+		rc = write( tp->fd, buff + done, len - done );
+		if ( 0 > rc ) {
+			if ( EINTR == errno ) continue;
+			return rc;
+		}
+		done += rc;
+	}
+	return done;
+}
+
+static int
+fd_poll_fd( struct zw_transport *tp )
+{
+	return tp->fd;
+}
+
+static void
+fd_close( struct zw_transport *tp )
+{
+	if ( 0 <= tp->fd ) close( tp->fd );
+	tp->fd = -1;
+}
+
+static const struct zw_transport_ops tty_ops = {
+	.scheme		= "tty",
+	.open		= tty_open,
+	.read		= fd_read,
+	.write		= fd_write,
+	.poll_fd	= fd_poll_fd,
+	.close		= fd_close,
+};
+
+static const struct zw_transport_ops tcp_ops = {
+	.scheme		= "tcp",
+	.open		= tcp_open,
+	.read		= fd_read,
+	.write		= fd_write,
+	.poll_fd	= fd_poll_fd,
+	.close		= fd_close,
+};
+
+static const struct zw_transport_ops *transports[] = {
+	&tty_ops,
+	&tcp_ops,
+};
+
+/*
+ * Pick the backend from the URI scheme. A bare path such as /dev/ttyUSB0
+ * is treated as tty:///dev/ttyUSB0.
+ */
+int
+zw_transport_open( struct zw_transport *tp, const char *uri )
+{
+	const char *sep = strstr( uri, "://" );
+	const char *path = uri;
+	int ii;
+
+	memset( tp, 0, sizeof( *tp ) );
+	pthread_mutex_init( &tp->stats_lock, NULL );
+	tp->fd = -1;
+	tp->ops = &tty_ops;
+	snprintf( tp->uri, ZW_MAX_URI, "%s", uri );
+
+	if ( sep ) {
+		tp->ops = NULL;
+		for ( ii = 0; ii < sizeof( transports ) / sizeof( transports[ 0 ] ); ii++ ) {
+			if ( strlen( transports[ ii ]->scheme ) == sep - uri &&
+			     0 == strncmp( transports[ ii ]->scheme, uri, sep - uri ) ) {
+				tp->ops = transports[ ii ];
+				break;
+			}
+		}
+		if ( !tp->ops ) {
+			SYSLOG_FAULT( "Unknown transport in %s", uri );
+			pthread_mutex_destroy( &tp->stats_lock );
+			return -1;
+		}
+		path = sep + 3;
+	}
+	snprintf( tp->path, ZW_MAX_URI, "%s", path );
+
+	if ( !tp->ops->open( tp, tp->path ) ) return 0;
+
+	if ( tp->addrs ) freeaddrinfo( tp->addrs );
+	tp->addrs = NULL;
+	pthread_mutex_destroy( &tp->stats_lock );
+	return -1;
+}
+
+int
+zw_transport_reopen( struct zw_transport *tp )
+{
+	tp->ops->close( tp );
+	tp->txlen = 0;
+	tp->tx_frame = 0;
+	tp->tx_ns = 0;
+	pthread_mutex_lock( &tp->stats_lock );
+	tp->stats.reconnects++;
+	pthread_mutex_unlock( &tp->stats_lock );
+	return tp->ops->open( tp, tp->path );
+}
+
+int
+zw_transport_read( struct zw_transport *tp, u8 *buff, int len )
+{
+	int rc = tp->ops->read( tp, buff, len );
+
+	if ( 0 < rc ) {
+		zw_capture_add( tp->capture, ZW_CAP_RX, buff, rc );
+		pthread_mutex_lock( &tp->stats_lock );
+		tp->stats.rx_bytes += rc;
+		tp->stats.rx_reads++;
+		pthread_mutex_unlock( &tp->stats_lock );
+	}
+	return rc;
+}
+
+/*
+ * Writes are batched; everything queued between two flushes goes out in a
+ * single write (one TCP segment for the tcp backend).
+ */
+int
+zw_transport_write( struct zw_transport *tp, const u8 *buff, int len )
+{
+	if ( tp->txlen + len > ZW_TX_BUF_SZ && 0 > zw_transport_flush( tp ) )
+		return -1;
+
+	if ( len > ZW_TX_BUF_SZ ) return -1;
+
+	memcpy( tp->txbuf + tp->txlen, buff, len );
+	tp->txlen += len;
+	if ( SOF == buff[ 0 ] ) tp->tx_frame = 1;
+
+	return len;
+}
+
+int
+zw_transport_flush( struct zw_transport *tp )
+{
+	int rc;
+
+	if ( !tp->txlen ) return 0;
+
+	zw_capture_add( tp->capture, ZW_CAP_TX, tp->txbuf, tp->txlen );
+	rc = tp->ops->write( tp, tp->txbuf, tp->txlen );
+	if ( rc != tp->txlen ) {
+		perror( "zw_transport_flush" );
+		tp->txlen = 0;
+		tp->tx_frame = 0;
+		return -1;
+	}
+	if ( tp->tx_frame ) {
+		tp->tx_ns = zw_time_ns();
+		tp->tx_frame = 0;
+	}
+	pthread_mutex_lock( &tp->stats_lock );
+	tp->stats.tx_bytes += rc;
+	tp->stats.tx_writes++;
+	pthread_mutex_unlock( &tp->stats_lock );
+	tp->txlen = 0;
+
+	return rc;
+}
+
+int
+zw_transport_poll_fd( struct zw_transport *tp )
+{
+	return tp->ops->poll_fd( tp );
+}
+
+/* account the round trip of the last flushed frame */
+void
+zw_transport_ack( struct zw_transport *tp )
+{
+	struct zw_transport_stats *st = &tp->stats;
+	u64 sample;
+
+	if ( !tp->tx_ns ) return;
+
+	sample = zw_time_ns() - tp->tx_ns;
+	tp->tx_ns = 0;
+
+	pthread_mutex_lock( &tp->stats_lock );
+	st->rtt_last_ns = sample;
+	if ( !st->rtt_samples++ )
+		st->rtt_avg_ns = sample;
+	else if ( sample > st->rtt_avg_ns )
+		st->rtt_avg_ns += ( sample - st->rtt_avg_ns ) >> ZW_RTT_EWMA_SHIFT;
+	else
+		st->rtt_avg_ns -= ( st->rtt_avg_ns - sample ) >> ZW_RTT_EWMA_SHIFT;
+	if ( sample > st->rtt_max_ns ) st->rtt_max_ns = sample;
+	pthread_mutex_unlock( &tp->stats_lock );
+}
+
+void
+zw_transport_get_stats( struct zw_transport *tp, struct zw_transport_stats *stats )
+{
+	pthread_mutex_lock( &tp->stats_lock );
+	*stats = tp->stats;
+	pthread_mutex_unlock( &tp->stats_lock );
+}
+
+/* The stats stay readable after close */
+void
+zw_transport_close( struct zw_transport *tp )
+{
+	zw_transport_flush( tp );
+	tp->ops->close( tp );
+	if ( tp->addrs ) freeaddrinfo( tp->addrs );
+	tp->addrs = NULL;
+}
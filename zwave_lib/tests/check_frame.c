@@ -0,0 +1,209 @@
+//
+//  Created by Praveen Murali Nair on 09/07/2013.
+//  Copyright (c) 2013 Praveen M Nair. All rights reserved.
+//
+// 	Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are met:
+//      * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//      * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//      * Neither the name of the <organization> nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//      ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//      WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//      DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+//      DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//      (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//       LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//      ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+//
+// check_frame - the Serial API stream parser: frames split across reads,
+// checksum rejection and resync after garbage or a truncated frame.
+//
+
+#include <string.h>
+
+#include "zw_frame.h"
+#include "check.h"
+
+/* SOF, LEN, type, body..., checksum; returns the frame length */
+static int
+make_frame( u8 *out, u8 type, const u8 *body, int blen )
+{
+	out[ 0 ] = SOF;
+	out[ 1 ] = blen + 2;
+	out[ 2 ] = type;
+	memcpy( out + 3, body, blen );
+	out[ blen + 3 ] = zw_checksum( out + 1, blen + 2 );
+
+	return blen + 4;
+}
+
+static void
+feed( struct zw_rx_buf *rx, const u8 *bytes, int len )
+{
+	u8 *space;
+
+	CHECK( zw_rx_space( rx, &space ) >= len );
+	memcpy( space, bytes, len );
+	zw_rx_commit( rx, len );
+}
+
+static void
+check_single_bytes( void )
+{
+	static const u8 bytes[] = { ACK, NAK, CAN };
+	struct zw_rx_item items[ ZW_RX_MAX_ITEMS ];
+	struct zw_rx_buf rx;
+
+	zw_rx_init( &rx );
+	feed( &rx, bytes, sizeof( bytes ) );
+	CHECK( 3 == zw_rx_parse( &rx, items, ZW_RX_MAX_ITEMS ) );
+	CHECK( ZW_RX_ACK == items[ 0 ].type );
+	CHECK( ZW_RX_NAK == items[ 1 ].type );
+	CHECK( ZW_RX_CAN == items[ 2 ].type );
+	CHECK( !zw_rx_partial( &rx ) );
+}
+
+/* Every split point of a frame, then two frames and an ACK in one read */
+static void
+check_split_reads( void )
+{
+	static const u8 body[] = { 0x13, 0x05, 0x03, 0x25, 0x01, 0xff };
+	struct zw_rx_item items[ ZW_RX_MAX_ITEMS ];
+	struct zw_rx_buf rx;
+	u8 frame[ 16 ], two[ 40 ];
+	int flen, cut, n;
+
+	flen = make_frame( frame, REQUEST, body, sizeof( body ) );
+	for ( cut = 1; cut < flen; cut++ ) {
+		zw_rx_init( &rx );
+		feed( &rx, frame, cut );
+		CHECK( 0 == zw_rx_parse( &rx, items, ZW_RX_MAX_ITEMS ) );
+		CHECK( zw_rx_partial( &rx ) );
+		feed( &rx, frame + cut, flen - cut );
+		n = zw_rx_parse( &rx, items, ZW_RX_MAX_ITEMS );
+		CHECK( 1 == n );
+		if ( 1 != n ) continue;
+		CHECK( ZW_RX_FRAME == items[ 0 ].type );
+		CHECK( (int)sizeof( body ) + 1 == items[ 0 ].len );
+		CHECK( REQUEST == items[ 0 ].data[ 0 ] );
+		CHECK( !memcmp( body, items[ 0 ].data + 1, sizeof( body ) ) );
+		CHECK( !zw_rx_partial( &rx ) );
+		CHECK( 0 == rx.garbage );
+	}
+
+	zw_rx_init( &rx );
+	memcpy( two, frame, flen );
+	two[ flen ] = ACK;
+	memcpy( two + flen + 1, frame, flen );
+	feed( &rx, two, 2 * flen + 1 );
+	n = zw_rx_parse( &rx, items, ZW_RX_MAX_ITEMS );
+	CHECK( 3 == n );
+	CHECK( ZW_RX_FRAME == items[ 0 ].type );
+	CHECK( ZW_RX_ACK == items[ 1 ].type );
+	CHECK( ZW_RX_FRAME == items[ 2 ].type );
+}
+
+/*
+ * A bad checksum consumes the whole frame, so an ACK byte inside its body
+ * is not taken for an ACK, and the frame after it parses.
+ */
+static void
+check_bad_checksum( void )
+{
+	static const u8 body[] = { 0x04, 0x00, 0x05, ACK, NAK, CAN };
+	struct zw_rx_item items[ ZW_RX_MAX_ITEMS ];
+	struct zw_rx_buf rx;
+	u8 bytes[ 40 ];
+	int flen, n;
+
+	flen = make_frame( bytes, REQUEST, body, sizeof( body ) );
+	bytes[ flen - 1 ] ^= 0x5a;
+	make_frame( bytes + flen, RESPONSE, body, 2 );
+
+	zw_rx_init( &rx );
+	feed( &rx, bytes, flen + 6 );
+	n = zw_rx_parse( &rx, items, ZW_RX_MAX_ITEMS );
+	CHECK( 2 == n );
+	CHECK( ZW_RX_BAD_FRAME == items[ 0 ].type );
+	CHECK( ZW_RX_FRAME == items[ 1 ].type );
+	CHECK( RESPONSE == items[ 1 ].data[ 0 ] );
+	CHECK( (u32)flen == rx.garbage );
+	CHECK( !zw_rx_partial( &rx ) );
+}
+
+/* Stray bytes and an impossible length are skipped up to the next SOF */
+static void
+check_resync( void )
+{
+	static const u8 body[] = { 0x15, 0x01 };
+	struct zw_rx_item items[ ZW_RX_MAX_ITEMS ];
+	struct zw_rx_buf rx;
+	u8 bytes[ 40 ];
+	int len = 0, n;
+
+	bytes[ len++ ] = 0x00;
+	bytes[ len++ ] = 0x42;
+	bytes[ len++ ] = SOF;
+	bytes[ len++ ] = 0x02;		/* too short to be a frame */
+	len += make_frame( bytes + len, RESPONSE, body, sizeof( body ) );
+
+	zw_rx_init( &rx );
+	feed( &rx, bytes, len );
+	n = zw_rx_parse( &rx, items, ZW_RX_MAX_ITEMS );
+	CHECK( 1 == n );
+	CHECK( ZW_RX_FRAME == items[ 0 ].type );
+	CHECK( 4 == rx.garbage );
+}
+
+/*
+ * The rest of a frame never comes: after the byte timeout the reader
+ * resyncs and the next frame parses, whatever was left of the first.
+ */
+static void
+check_truncated( void )
+{
+	static const u8 body[] = { 0x13, 0x22, 0x00, 0x7f, 0x10 };
+	struct zw_rx_item items[ ZW_RX_MAX_ITEMS ];
+	struct zw_rx_buf rx;
+	u8 frame[ 16 ];
+	int flen, n;
+
+	flen = make_frame( frame, REQUEST, body, sizeof( body ) );
+
+	zw_rx_init( &rx );
+	feed( &rx, frame, 4 );
+	CHECK( 0 == zw_rx_parse( &rx, items, ZW_RX_MAX_ITEMS ) );
+	CHECK( zw_rx_partial( &rx ) );
+	zw_rx_resync( &rx );
+	CHECK( 0 == zw_rx_parse( &rx, items, ZW_RX_MAX_ITEMS ) );
+	CHECK( !zw_rx_partial( &rx ) );
+
+	feed( &rx, frame, flen );
+	n = zw_rx_parse( &rx, items, ZW_RX_MAX_ITEMS );
+	CHECK( 1 == n );
+	CHECK( ZW_RX_FRAME == items[ 0 ].type );
+	CHECK( 4 == rx.garbage );
+}
+
+int
+main( int argc, char **argv )
+{
+	check_single_bytes();
+	check_split_reads();
+	check_bad_checksum();
+	check_resync();
+	check_truncated();
+
+	return check_done( "check_frame" );
+}
@@ -0,0 +1,183 @@
+//
+//  Created by Praveen Murali Nair on 09/07/2013.
+//  Copyright (c) 2013 Praveen M Nair. All rights reserved.
+//
+// 	Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are met:
+//      * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//      * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//      * Neither the name of the <organization> nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//      ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//      WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//      DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+//      DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//      (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//       LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//      ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+//
+// check_pool - the lock-free object pool: objects come back zeroed and
+// distinct, an empty pool fails with ENOBUFS, and objects keep being
+// reused, by one thread and by several, while the generation count in
+// the free list head wraps.
+//
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "zw_pool.h"
+#include "check.h"
+
+#define POOL_OBJS	16
+#define ROUNDS		64
+#define THREADS		4
+#define CYCLES		200000		/* get/put pairs per thread */
+
+struct obj {
+	u32 owner;
+	u32 stamp;
+	u8 pad[ 40 ];
+};
+
+/* Put the generation count a few pops short of wrapping */
+static void
+pool_age( struct zw_pool *pool )
+{
+	pool->head = (u64)0xfffffff0 << 32 | (u32)pool->head;
+}
+
+static int
+all_zero( const struct obj *o )
+{
+	static const struct obj zero;
+
+	return !memcmp( o, &zero, sizeof( zero ) );
+}
+
+static void
+check_reuse( void )
+{
+	struct zw_pool pool;
+	struct zw_pool_stats stats;
+	struct obj *objs[ POOL_OBJS ];
+	int round, i, j, bad = 0;
+
+	CHECK( 0 == zw_pool_init( &pool, sizeof( struct obj ), POOL_OBJS ) );
+	pool_age( &pool );
+
+	for ( round = 0; round < ROUNDS; round++ ) {
+		for ( i = 0; i < POOL_OBJS; i++ ) {
+			objs[ i ] = zw_pool_get( &pool );
+			if ( !objs[ i ] || !all_zero( objs[ i ] ) ) {
+				bad++;
+				break;
+			}
+			for ( j = 0; j < i; j++ )
+				if ( objs[ j ] == objs[ i ] ) bad++;
+			objs[ i ]->stamp = round + 1;
+			memset( objs[ i ]->pad, 0xa5, sizeof( objs[ i ]->pad ) );
+		}
+		if ( i < POOL_OBJS ) break;
+
+		errno = 0;
+		if ( zw_pool_get( &pool ) || ENOBUFS != errno ) bad++;
+		if ( POOL_OBJS != pool.in_use ) bad++;
+
+		/* hand them back in a different order every round */
+		for ( i = 0; i < POOL_OBJS; i++ )
+			zw_pool_put( &pool, objs[ ( i * 7 + round ) % POOL_OBJS ] );
+		if ( pool.in_use ) bad++;
+	}
+
+	CHECK( ROUNDS == round );
+	CHECK( 0 == bad );
+	CHECK( ( pool.head >> 32 ) < 0xfffffff0 );	/* the count did wrap */
+
+	zw_pool_get_stats( &pool, &stats );
+	CHECK( POOL_OBJS == stats.capacity );
+	CHECK( 0 == stats.in_use );
+	CHECK( POOL_OBJS == stats.high_water );
+	CHECK( (u64)ROUNDS * POOL_OBJS == stats.allocs );
+	CHECK( ROUNDS == stats.exhausted );
+
+	zw_pool_destroy( &pool );
+}
+
+static struct zw_pool shared;
+static long shared_bad;
+
+/* Each object must stay ours between the get and the put */
+static void *
+worker( void *arg )
+{
+	u32 id = (u32)(uintptr_t)arg + 1;
+	struct obj *o;
+	long bad = 0;
+	u32 n;
+
+	for ( n = 1; n <= CYCLES; n++ ) {
+		o = zw_pool_get( &shared );
+		if ( !o ) {
+			bad++;
+			continue;
+		}
+		if ( !all_zero( o ) ) bad++;
+		o->owner = id;
+		o->stamp = n;
+		__atomic_thread_fence( __ATOMIC_SEQ_CST );
+		if ( id != o->owner || n != o->stamp ) bad++;
+		zw_pool_put( &shared, o );
+	}
+	__atomic_add_fetch( &shared_bad, bad, __ATOMIC_RELAXED );
+
+	return NULL;
+}
+
+static void
+check_threads( void )
+{
+	pthread_t tid[ THREADS ];
+	struct zw_pool_stats stats;
+	int i;
+
+	/* more objects than threads, so a get never finds the pool empty */
+	CHECK( 0 == zw_pool_init( &shared, sizeof( struct obj ), THREADS * 2 ) );
+	pool_age( &shared );
+
+	for ( i = 0; i < THREADS; i++ )
+		pthread_create( &tid[ i ], NULL, worker, (void *)(uintptr_t)i );
+	for ( i = 0; i < THREADS; i++ )
+		pthread_join( tid[ i ], NULL );
+
+	CHECK( 0 == shared_bad );
+	CHECK( ( shared.head >> 32 ) < 0xfffffff0 );
+
+	zw_pool_get_stats( &shared, &stats );
+	CHECK( 0 == stats.in_use );
+	CHECK( (u64)THREADS * CYCLES == stats.allocs );
+	CHECK( 0 == stats.exhausted );
+	CHECK( THREADS >= stats.high_water );
+
+	zw_pool_destroy( &shared );
+}
+
+int
+main( int argc, char **argv )
+{
+	check_reuse();
+	check_threads();
+
+	return check_done( "check_pool" );
+}
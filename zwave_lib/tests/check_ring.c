@@ -0,0 +1,146 @@
+//
+//  Created by Praveen Murali Nair on 09/07/2013.
+//  Copyright (c) 2013 Praveen M Nair. All rights reserved.
+//
+// 	Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are met:
+//      * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//      * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//      * Neither the name of the <organization> nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//      ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//      WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//      DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+//      DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//      (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//       LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//      ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+//
+// check_ring - the MPSC submit ring: full and empty edges, and several
+// producers against one consumer through many laps of a small ring, with
+// the positions wrapping past 2^32 on the way.
+//
+
+#include <stdint.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "zw_ring.h"
+#include "check.h"
+
+#define RING_SLOTS	8
+#define PRODUCERS	4
+#define ITEMS		200000		/* per producer */
+
+static struct zw_ring ring;
+
+/* Start both ends at pos, as if that many items had gone through */
+static void
+ring_rewind( struct zw_ring *r, u32 pos )
+{
+	u32 i;
+
+	r->head = r->tail = pos;
+	for ( i = 0; i <= r->mask; i++ )
+		r->slots[ ( pos + i ) & r->mask ].seq = pos + i;
+}
+
+static void
+check_edges( void )
+{
+	uintptr_t i;
+
+	CHECK( NULL == zw_ring_pop( &ring ) );
+	for ( i = 1; i <= RING_SLOTS; i++ )
+		CHECK( 0 == zw_ring_push( &ring, (void *)i ) );
+	errno = 0;
+	CHECK( -1 == zw_ring_push( &ring, (void *)i ) );
+	CHECK( ENOBUFS == errno );
+	CHECK( 1 == ring.full );
+
+	CHECK( (void *)1 == zw_ring_pop( &ring ) );
+	CHECK( 0 == zw_ring_push( &ring, (void *)i ) );
+	for ( i = 2; i <= RING_SLOTS + 1; i++ )
+		CHECK( (void *)i == zw_ring_pop( &ring ) );
+	CHECK( NULL == zw_ring_pop( &ring ) );
+}
+
+/* Items are producer << 24 | sequence, never 0 */
+static void *
+producer( void *arg )
+{
+	uintptr_t id = (uintptr_t)arg;
+	uintptr_t seq;
+
+	for ( seq = 1; seq <= ITEMS; seq++ ) {
+		while ( zw_ring_push( &ring, (void *)( id << 24 | seq ) ) )
+			sched_yield();
+	}
+
+	return NULL;
+}
+
+static void
+check_producers( void )
+{
+	pthread_t tid[ PRODUCERS ];
+	uintptr_t last[ PRODUCERS ] = { 0 };
+	uintptr_t item, id;
+	u32 start = UINT32_MAX - 1000;
+	long popped = 0, bad = 0;
+	int i;
+
+	ring_rewind( &ring, start );
+	ring.full = 0;
+	for ( i = 0; i < PRODUCERS; i++ )
+		pthread_create( &tid[ i ], NULL, producer, (void *)(uintptr_t)i );
+
+	while ( popped < (long)PRODUCERS * ITEMS ) {
+		item = (uintptr_t)zw_ring_pop( &ring );
+		if ( !item ) {
+			sched_yield();
+			continue;
+		}
+		id = item >> 24;
+		/* each producer's items come out in its own order, none lost */
+		if ( PRODUCERS <= id || ( item & 0xffffff ) != last[ id ] + 1 )
+			bad++;
+		else
+			last[ id ]++;
+		popped++;
+	}
+	for ( i = 0; i < PRODUCERS; i++ )
+		pthread_join( tid[ i ], NULL );
+
+	CHECK( 0 == bad );
+	for ( i = 0; i < PRODUCERS; i++ )
+		CHECK( ITEMS == last[ i ] );
+	CHECK( NULL == zw_ring_pop( &ring ) );
+	CHECK( ring.head == ring.tail );
+	CHECK( ring.head == start + (u32)( PRODUCERS * ITEMS ) );
+	CHECK( ring.head < start );
+	fprintf( stderr, "check_ring: %ld items, %u pushes found the ring full\n", popped, ring.full );
+}
+
+int
+main( int argc, char **argv )
+{
+	if ( zw_ring_init( &ring, RING_SLOTS ) ) return 1;
+
+	check_edges();
+	check_producers();
+
+	zw_ring_destroy( &ring );
+	return check_done( "check_ring" );
+}
@@ -0,0 +1,156 @@
+//
+//  Created by Praveen Murali Nair on 09/07/2013.
+//  Copyright (c) 2013 Praveen M Nair. All rights reserved.
+//
+// 	Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are met:
+//      * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//      * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//      * Neither the name of the <organization> nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//      ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//      WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//      DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+//      DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//      (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//       LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//      ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+//
+// check_single_flight - cc_get_async() joins a get already in flight for
+// the same node and class instead of sending another, and cc_set_async()
+// stops later gets from joining one queued before the set. The context
+// is online but has no reader, so every request stays in the submit ring
+// and the test plays the reader's part on the waiter table.
+//
+
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "zw_api.h"
+#include "cmd_class.h"
+#include "zw_future.h"
+#include "zw_time.h"
+#include "check.h"
+
+#define NODE		5
+#define OTHER_NODE	6
+#define RACE_NODE	7
+#define THREADS		8
+
+static zw_api_ctx_S ctx;
+
+static u64
+gets_sent( void )
+{
+	struct zw_cc_stats stats;
+
+	cc_get_stats( &ctx, &stats );
+	return stats.gets;
+}
+
+static void
+check_join( void )
+{
+	struct zw_cc_stats stats;
+	zw_future_S *first, *joined, *other, *after_set, *set;
+	int level = 255;
+
+	first = cc_get_async( &ctx, NODE, COMMAND_CLASS_SWITCH_BINARY );
+	joined = cc_get_async( &ctx, NODE, COMMAND_CLASS_SWITCH_BINARY );
+	CHECK( first && first == joined );
+	cc_get_stats( &ctx, &stats );
+	CHECK( 1 == stats.gets );
+	CHECK( 1 == stats.coalesced );
+
+	/* another node is another key */
+	other = cc_get_async( &ctx, OTHER_NODE, COMMAND_CLASS_SWITCH_BINARY );
+	CHECK( other && other != first );
+	CHECK( 2 == gets_sent() );
+
+	/* a get after the set must not take the answer to one before it */
+	set = cc_set_async( &ctx, NODE, COMMAND_CLASS_SWITCH_BINARY, &level );
+	CHECK( NULL != set );
+	after_set = cc_get_async( &ctx, NODE, COMMAND_CLASS_SWITCH_BINARY );
+	CHECK( after_set && after_set != first );
+	CHECK( 3 == gets_sent() );
+
+	/* the report completes the written get, the queued one waits for its own */
+	zw_waiters_arm( &ctx.waiters, first, zw_time_ns() + 1000000000ULL );
+	CHECK( 1 == zw_waiters_report( &ctx.waiters, NODE, COMMAND_CLASS_SWITCH_BINARY,
+				       SWITCH_BINARY_REPORT, 255 ) );
+	CHECK( zw_future_done( first ) );
+	CHECK( 0 == first->status && 255 == first->val );
+	CHECK( !zw_future_done( after_set ) );
+	CHECK( !zw_future_done( other ) );
+
+	/* and later gets join the one sent after the set */
+	joined = cc_get_async( &ctx, NODE, COMMAND_CLASS_SWITCH_BINARY );
+	CHECK( joined == after_set );
+	CHECK( 3 == gets_sent() );
+
+	zw_future_put( joined );
+	zw_future_put( after_set );
+	zw_future_put( set );
+	zw_future_put( other );
+	zw_future_put( first );
+	zw_future_put( first );
+}
+
+static pthread_barrier_t start;
+static zw_future_S *raced[ THREADS ];
+
+static void *
+racer( void *arg )
+{
+	long i = (long)arg;
+
+	pthread_barrier_wait( &start );
+	raced[ i ] = cc_get_async( &ctx, RACE_NODE, COMMAND_CLASS_SWITCH_BINARY );
+
+	return NULL;
+}
+
+static void
+check_race( void )
+{
+	pthread_t tid[ THREADS ];
+	u64 before = gets_sent();
+	long i;
+
+	pthread_barrier_init( &start, NULL, THREADS );
+	for ( i = 0; i < THREADS; i++ )
+		pthread_create( &tid[ i ], NULL, racer, (void *)i );
+	for ( i = 0; i < THREADS; i++ )
+		pthread_join( tid[ i ], NULL );
+	pthread_barrier_destroy( &start );
+
+	CHECK( before + 1 == gets_sent() );
+	for ( i = 0; i < THREADS; i++ ) {
+		CHECK( raced[ i ] && raced[ i ] == raced[ 0 ] );
+		zw_future_put( raced[ i ] );
+	}
+}
+
+int
+main( int argc, char **argv )
+{
+	if ( zw_api_init_offline( &ctx ) ) return 1;
+	ctx.offline = 0;
+	ctx.wake_fd = eventfd( 0, EFD_NONBLOCK );
+	if ( 0 > ctx.wake_fd ) return 1;
+
+	check_join();
+	check_race();
+
+	return check_done( "check_single_flight" );
+}
@@ -0,0 +1,239 @@
+//
+//  Created by Praveen Murali Nair on 09/07/2013.
+//  Copyright (c) 2013 Praveen M Nair. All rights reserved.
+//
+// 	Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are met:
+//      * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//      * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//      * Neither the name of the <organization> nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//      ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//      WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//      DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+//      DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//      (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//       LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//      ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+//
+// zwbench - submission contention benchmark.
+//
+// N producer threads push asynchronous SWITCH_BINARY_SETs at the serial
+// thread as fast as their window of outstanding futures allows, against
+// zwsim or a stick. Reports the cost of the submit call itself, which is
+// where producers contend, and end to end throughput.
+//
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "zw_api.h"
+#include "zw_time.h"
+
+struct bench_thread {
+	pthread_t	tid;
+	int		idx;
+	u64		*lat;		/* submit latency of every request, ns */
+	u64		done;
+	u64		failed;
+	u64		backoffs;	/* submits refused with ENOBUFS */
+};
+
+static zw_api_ctx_S ctx;
+static int requests = 1000;
+static int window = 8;
+static int first_node = 2;
+static int nodes = 8;
+static int timeout_ms = 30000;
+
+static void
+bench_reap( struct bench_thread *bt, zw_future_S *fut )
+{
+	int val;
+
+	if ( zw_future_wait( fut, timeout_ms, &val ) ) bt->failed++;
+	else bt->done++;
+	zw_future_put( fut );
+}
+
+static void *
+bench_producer( void *arg )
+{
+	struct bench_thread *bt = arg;
+	zw_future_S **inflight;
+	zw_future_S *fut;
+	u8 buff[ 7 ];
+	int head = 0, count = 0, i, node;
+	u64 start;
+
+	inflight = calloc( window, sizeof( *inflight ) );
+	if ( !inflight ) return NULL;
+
+	for ( i = 0; i < requests; i++ ) {
+		node = first_node + ( bt->idx + i ) % nodes;
+		buff[ 0 ] = FUNC_ID_ZW_SEND_DATA;
+		buff[ 1 ] = node;
+		buff[ 2 ] = 3;
+		buff[ 3 ] = COMMAND_CLASS_SWITCH_BINARY;
+		buff[ 4 ] = SWITCH_BINARY_SET;
+		buff[ 5 ] = ( i & 1 ) ? 0xFF : 0;
+		buff[ 6 ] = TRANSMIT_OPTION_ACK | TRANSMIT_OPTION_AUTO_ROUTE;
+
+		if ( count == window ) {
+			bench_reap( bt, inflight[ head ] );
+			head = ( head + 1 ) % window;
+			count--;
+		}
+		while ( 1 ) {
+			start = zw_time_ns();
+			fut = zw_send_request_async( &ctx, buff, 7, node, RESP_REQ,
+						     FUNC_ID_ZW_SEND_DATA, 0, 0 );
+			bt->lat[ i ] = zw_time_ns() - start;
+			if ( fut || ENOBUFS != errno || !count ) break;
+			bt->backoffs++;
+			bench_reap( bt, inflight[ head ] );
+			head = ( head + 1 ) % window;
+			count--;
+		}
+		if ( !fut ) {
+			bt->failed++;
+			continue;
+		}
+		inflight[ ( head + count ) % window ] = fut;
+		count++;
+	}
+	while ( count-- ) {
+		bench_reap( bt, inflight[ head ] );
+		head = ( head + 1 ) % window;
+	}
+	free( inflight );
+	return NULL;
+}
+
+static int
+bench_cmp( const void *a, const void *b )
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static const char *usage_txt =
+"Call: zwbench [options] <port>\n"
+"  -t, --threads <n>     producer threads (4)\n"
+"  -r, --requests <n>    requests per thread (1000)\n"
+"  -w, --window <n>      outstanding requests per thread (8)\n"
+"  -f, --first <id>      first target node (2)\n"
+"  -n, --nodes <n>       number of target nodes (8)\n"
+"  -P, --pool <n>        message and future pool size\n"
+"  -v, --verbose         leave syslog on\n"
+"  the port is a tty, a zwsim pty or tcp://host:port\n";
+
+int main( int argc, char **argv )
+{
+	static const struct option long_opts[] = {
+		{ "threads",	1, 0, 't' },
+		{ "requests",	1, 0, 'r' },
+		{ "window",	1, 0, 'w' },
+		{ "first",	1, 0, 'f' },
+		{ "nodes",	1, 0, 'n' },
+		{ "pool",	1, 0, 'P' },
+		{ "verbose",	0, 0, 'v' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct zw_api_opts opts;
+	struct zw_pool_stats msgs, futs;
+	struct zw_tx_stats tx;
+	struct bench_thread *bt;
+	u64 *all, start, elapsed, done = 0, failed = 0, backoffs = 0, total;
+	int threads = 4, verbose = 0;
+	int c, i;
+
+	memset( &opts, 0, sizeof( opts ) );
+	while ( ( c = getopt_long( argc, argv, "t:r:w:f:n:P:v", long_opts, NULL ) ) != -1 ) {
+		switch ( c ) {
+		case 't': threads = atoi( optarg ); break;
+		case 'r': requests = atoi( optarg ); break;
+		case 'w': window = atoi( optarg ); break;
+		case 'f': first_node = atoi( optarg ); break;
+		case 'n': nodes = atoi( optarg ); break;
+		case 'P': opts.pool_size = atoi( optarg ); break;
+		case 'v': verbose = 1; break;
+		default:
+			fprintf( stderr, "%s", usage_txt );
+			return 1;
+		}
+	}
+	if ( optind >= argc || 0 >= threads || 0 >= requests || 0 >= window || 0 >= nodes ) {
+		fprintf( stderr, "%s", usage_txt );
+		return 1;
+	}
+
+	if ( !verbose ) setlogmask( LOG_UPTO( LOG_EMERG ) );
+
+	if ( zw_api_init_opts( argv[ optind ], &ctx, &opts ) ) {
+		fprintf( stderr, "%s: can't open\n", argv[ optind ] );
+		return 1;
+	}
+	/* let the start up requests drain */
+	sleep( 2 );
+
+	bt = calloc( threads, sizeof( *bt ) );
+	all = calloc( (size_t)threads * requests, sizeof( *all ) );
+	if ( !bt || !all ) {
+		perror( "calloc" );
+		return 1;
+	}
+
+	start = zw_time_ns();
+	for ( i = 0; i < threads; i++ ) {
+		bt[ i ].idx = i;
+		bt[ i ].lat = all + (size_t)i * requests;
+		if ( pthread_create( &bt[ i ].tid, NULL, bench_producer, &bt[ i ] ) ) {
+			perror( "pthread_create" );
+			return 1;
+		}
+	}
+	for ( i = 0; i < threads; i++ ) {
+		pthread_join( bt[ i ].tid, NULL );
+		done += bt[ i ].done;
+		failed += bt[ i ].failed;
+		backoffs += bt[ i ].backoffs;
+	}
+	elapsed = zw_time_ns() - start;
+
+	total = (u64)threads * requests;
+	qsort( all, total, sizeof( *all ), bench_cmp );
+	zw_api_get_pool_stats( &ctx, &msgs, &futs );
+	zw_api_get_tx_stats( &ctx, &tx );
+
+	fprintf( stderr, "%d threads x %d requests, window %d: %llu done, %llu failed in %.3f s, %.0f req/sec\n",
+		 threads, requests, window, done, failed, elapsed / 1e9,
+		 elapsed ? done * 1e9 / elapsed : 0.0 );
+	fprintf( stderr, "submit ns: p50 %llu p99 %llu max %llu, %llu ENOBUFS backoffs\n",
+		 all[ total / 2 ], all[ total * 99 / 100 ], all[ total - 1 ], backoffs );
+	fprintf( stderr, "pool: messages high water %u/%u, futures high water %u/%u\n",
+		 msgs.high_water, msgs.capacity, futs.high_water, futs.capacity );
+	fprintf( stderr, "tx: ok %llu no_ack %llu failed %llu cb_timeouts %llu batched %llu\n",
+		 tx.ok, tx.no_ack, tx.failed, tx.cb_timeouts, tx.batched );
+
+	free( all );
+	free( bt );
+	return 0;
+}
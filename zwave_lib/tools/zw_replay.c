@@ -0,0 +1,258 @@
+//
+//  Created by Praveen Murali Nair on 09/07/2013.
+//  Copyright (c) 2013 Praveen M Nair. All rights reserved.
+//
+// 	Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are met:
+//      * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//      * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//      * Neither the name of the <organization> nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//      ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//      WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//      DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+//      DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//      (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//       LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//      ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//      SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+//
+// zwreplay - feed a serial capture through the dispatch path offline.
+//
+// The capture written with the capture option of zw_api_init_opts() is
+// mmapped and every received frame is parsed and handed to
+// zw_process_frame() as fast as possible. Reports frames/sec and the cost
+// of each Serial API function / command class handler. With -s a fixed
+// mix of frames is replayed instead of a capture to time the dispatch
+// path on its own.
+//
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <syslog.h>
+
+#include "zw_api.h"
+#include "zw_frame.h"
+#include "zw_capture.h"
+#include "zw_time.h"
+
+struct replay_stat {
+	u64	count;
+	u64	total_ns;
+	u64	max_ns;
+};
+
+/* [ 0 ][ func ] for Serial API functions, [ 1 ][ class ] for commands */
+static struct replay_stat handler_stats[ 2 ][ 256 ];
+
+static void
+replay_frame( zw_api_ctx_S *ctx, u8 *frame, int len )
+{
+	struct replay_stat *st;
+	u64 start, cost;
+
+	if ( REQUEST == frame[ 0 ] && FUNC_ID_APPLICATION_COMMAND_HANDLER == frame[ 1 ] && 5 < len )
+		st = &handler_stats[ 1 ][ frame[ 5 ] ];
+	else
+		st = &handler_stats[ 0 ][ frame[ 1 ] ];
+
+	start = zw_time_ns();
+	zw_process_frame( ctx, frame, len );
+	cost = zw_time_ns() - start;
+
+	st->count++;
+	st->total_ns += cost;
+	if ( cost > st->max_ns ) st->max_ns = cost;
+}
+
+/*
+ * Steady state traffic for -s: the response and callback of a SEND_DATA,
+ * reports from the classes hzremote polls and one nobody handles.
+ */
+static const struct {
+	int	len;
+	u8	data[ 12 ];
+} synth_frames[] = {
+	{ 3, { RESPONSE, FUNC_ID_ZW_SEND_DATA, 1 } },
+	{ 4, { REQUEST, FUNC_ID_ZW_SEND_DATA, 1, TRANSMIT_COMPLETE_OK } },
+	{ 8, { REQUEST, FUNC_ID_APPLICATION_COMMAND_HANDLER, 0, 2, 3,
+	       COMMAND_CLASS_SWITCH_BINARY, SWITCH_BINARY_REPORT, 0xFF } },
+	{ 8, { REQUEST, FUNC_ID_APPLICATION_COMMAND_HANDLER, 0, 3, 3,
+	       COMMAND_CLASS_SENSOR_BINARY, SENSOR_BINARY_REPORT, 0 } },
+	{ 8, { REQUEST, FUNC_ID_APPLICATION_COMMAND_HANDLER, 0, 4, 3,
+	       COMMAND_CLASS_BATTERY, BATTERY_REPORT, 80 } },
+	{ 8, { REQUEST, FUNC_ID_APPLICATION_COMMAND_HANDLER, 0, 5, 3,
+	       COMMAND_CLASS_BASIC, BASIC_REPORT, 0 } },
+	{ 10, { REQUEST, FUNC_ID_APPLICATION_COMMAND_HANDLER, 0, 6, 5,
+		COMMAND_CLASS_METER, METER_REPORT, 0x21, 0x44, 0x10 } },
+};
+
+static u64
+replay_synthetic( zw_api_ctx_S *ctx, int rounds )
+{
+	u8 frame[ ZW_MAX_FRAME_SZ ];
+	u64 frames = 0;
+	int n = sizeof( synth_frames ) / sizeof( synth_frames[ 0 ] );
+	int r, i;
+
+	for ( r = 0; r < rounds; r++ ) {
+		for ( i = 0; i < n; i++ ) {
+			memcpy( frame, synth_frames[ i ].data, synth_frames[ i ].len );
+			replay_frame( ctx, frame, synth_frames[ i ].len );
+			frames++;
+		}
+	}
+	return frames;
+}
+
+static u64
+replay_feed( zw_api_ctx_S *ctx, const u8 *data, int len )
+{
+	struct zw_rx_item items[ ZW_RX_MAX_ITEMS ];
+	u64 frames = 0;
+	u8 *space;
+	int room, count, i;
+
+	while ( len ) {
+		room = zw_rx_space( &ctx->rx, &space );
+		if ( room > len ) room = len;
+		memcpy( space, data, room );
+		zw_rx_commit( &ctx->rx, room );
+		data += room;
+		len -= room;
+
+		do {
+			count = zw_rx_parse( &ctx->rx, items, ZW_RX_MAX_ITEMS );
+			for ( i = 0; i < count; i++ ) {
+				if ( ZW_RX_FRAME != items[ i ].type ) continue;
+				replay_frame( ctx, items[ i ].data, items[ i ].len );
+				frames++;
+			}
+		} while ( ZW_RX_MAX_ITEMS == count );
+	}
+	return frames;
+}
+
+static void
+replay_report( u64 frames, u64 elapsed, u64 sends )
+{
+	static const char *kind[ 2 ] = { "func", "class" };
+	struct replay_stat *st;
+	int k, i;
+
+	fprintf( stderr, "%llu frames in %.3f ms: %.0f frames/sec, %.0f ns/frame, %llu requests suppressed\n",
+		 frames, elapsed / 1e6, elapsed ? frames * 1e9 / elapsed : 0.0,
+		 frames ? (double)elapsed / frames : 0.0, sends );
+	fprintf( stderr, "%-6s %-5s %10s %12s %10s\n", "kind", "id", "count", "avg ns", "max ns" );
+	for ( k = 0; k < 2; k++ ) {
+		for ( i = 0; i < 256; i++ ) {
+			st = &handler_stats[ k ][ i ];
+			if ( !st->count ) continue;
+			fprintf( stderr, "%-6s 0x%02x  %10llu %12llu %10llu\n", kind[ k ], i,
+				 st->count, st->total_ns / st->count, st->max_ns );
+		}
+	}
+}
+
+static const char *usage_txt =
+"Call: zwreplay [-l|--loops <n>] [-v|--verbose] <capture file>\n"
+"      zwreplay -s|--synthetic <rounds> [-v|--verbose]\n"
+"  handler output goes to stdout, the report to stderr\n";
+
+int main( int argc, char **argv )
+{
+	static const struct option long_opts[] = {
+		{ "loops",	1, 0, 'l' },
+		{ "synthetic",	1, 0, 's' },
+		{ "verbose",	0, 0, 'v' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct zw_cap_file_hdr hdr;
+	struct zw_cap_rec_hdr rec;
+	struct stat sb;
+	zw_api_ctx_S ctx;
+	const u8 *map;
+	u64 off, frames = 0, start;
+	int loops = 1, verbose = 0, rounds = 0;
+	int c, fd, loop;
+
+	while ( ( c = getopt_long( argc, argv, "l:s:v", long_opts, NULL ) ) != -1 ) {
+		switch ( c ) {
+		case 'l': loops = atoi( optarg ); break;
+		case 's': rounds = atoi( optarg ); break;
+		case 'v': verbose = 1; break;
+		default:
+			fprintf( stderr, "%s", usage_txt );
+			return 1;
+		}
+	}
+	/* keep syslog out of the measurement unless asked for */
+	if ( !verbose ) setlogmask( LOG_UPTO( LOG_EMERG ) );
+
+	if ( 0 < rounds ) {
+		zw_api_init_offline( &ctx );
+		start = zw_time_ns();
+		frames = replay_synthetic( &ctx, rounds );
+		fflush( stdout );
+		replay_report( frames, zw_time_ns() - start, ctx.offline_sends );
+		return 0;
+	}
+	if ( optind >= argc ) {
+		fprintf( stderr, "%s", usage_txt );
+		return 1;
+	}
+
+	fd = open( argv[ optind ], O_RDONLY );
+	if ( 0 > fd || fstat( fd, &sb ) || sb.st_size < sizeof( hdr ) ) {
+		perror( argv[ optind ] );
+		return 1;
+	}
+	map = mmap( NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	if ( MAP_FAILED == map ) {
+		perror( "mmap" );
+		return 1;
+	}
+	madvise( (void *)map, sb.st_size, MADV_SEQUENTIAL );
+
+	memcpy( &hdr, map, sizeof( hdr ) );
+	if ( memcmp( hdr.magic, ZW_CAP_MAGIC, sizeof( hdr.magic ) ) || ZW_CAP_VERSION != hdr.version ) {
+		fprintf( stderr, "%s: not a capture file\n", argv[ optind ] );
+		return 1;
+	}
+
+	zw_api_init_offline( &ctx );
+	start = zw_time_ns();
+	for ( loop = 0; loop < loops; loop++ ) {
+		off = sizeof( hdr );
+		while ( off + sizeof( rec ) <= sb.st_size ) {
+			memcpy( &rec, map + off, sizeof( rec ) );
+			off += sizeof( rec );
+			if ( off + rec.len > sb.st_size ) break;
+			if ( ZW_CAP_RX == rec.dir )
+				frames += replay_feed( &ctx, map + off, rec.len );
+			off += rec.len;
+		}
+		zw_rx_init( &ctx.rx );
+	}
+	fflush( stdout );
+	replay_report( frames, zw_time_ns() - start, ctx.offline_sends );
+
+	munmap( (void *)map, sb.st_size );
+	close( fd );
+	return 0;
+}